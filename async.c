@@ -0,0 +1,404 @@
+#include <errno.h>
+#include <jansson.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "mmdb.h"
+#include "subscribe.h"
+
+#define MMDB_ASYNC_GET 1
+#define MMDB_ASYNC_PUT 2
+#define MMDB_ASYNC_REVS 3
+
+// most requests a worker will run inside one transaction
+#define MMDB_ASYNC_MAX_BATCH 256
+
+typedef struct mmdb_async_req_s {
+  struct mmdb_async_req_s *next;
+  int type;
+  mmdb_t *db;
+  char id[MMDB_MAX_ID_LENGTH + 1];
+  mmdb_doc_t *doc;
+  mmdb_rev_t *rev;
+  mmdb_revs_t *revs;
+  mmdb_put_options_t *opts;
+  mmdb_async_cb cb;
+  void *ptr;
+  int rc;
+} mmdb_async_req_t;
+
+struct mmdb_async_s {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t *threads;
+  int threads_total;
+  // databases currently owned by a worker; at most one entry per thread
+  mmdb_t **busy;
+  int stop;
+  int fd;
+  mmdb_async_req_t *queue, *queue_tail;
+  mmdb_async_req_t *done, *done_tail;
+};
+
+const char query_async_begin[] = "savepoint mmdb_async";
+
+const char query_async_commit[] = "release mmdb_async";
+
+const char query_async_rollback[] =
+    "rollback to mmdb_async; release mmdb_async";
+
+int mmdb_async_is_busy(mmdb_async_t *async, mmdb_t *db) {
+  int i;
+
+  for (i = 0; i < async->threads_total; i++) {
+    if (async->busy[i] == db) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// takes the oldest request whose database is idle, along with every later
+// request for the same database, so per-database order is preserved; requests
+// are queued against the shard owning them, so each shard gets its own writer
+mmdb_async_req_t *mmdb_async_take(mmdb_async_t *async) {
+  mmdb_async_req_t *r = NULL, *prev = NULL, *batch = NULL, *tail = NULL;
+  mmdb_t *db = NULL;
+  int n = 0;
+
+  for (r = async->queue; r != NULL && db == NULL; r = r->next) {
+    if (!mmdb_async_is_busy(async, r->db)) {
+      db = r->db;
+    }
+  }
+
+  if (db == NULL) {
+    return NULL;
+  }
+
+  r = async->queue;
+  while (r != NULL && n < MMDB_ASYNC_MAX_BATCH) {
+    if (r->db != db) {
+      prev = r;
+      r = r->next;
+      continue;
+    }
+
+    if (prev == NULL) {
+      async->queue = r->next;
+    } else {
+      prev->next = r->next;
+    }
+    if (async->queue_tail == r) {
+      async->queue_tail = prev;
+    }
+
+    if (tail == NULL) {
+      batch = r;
+    } else {
+      tail->next = r;
+    }
+    tail = r;
+    r = r->next;
+    tail->next = NULL;
+    n++;
+  }
+
+  return batch;
+}
+
+void mmdb_async_run(mmdb_async_req_t *req) {
+  switch (req->type) {
+    case MMDB_ASYNC_GET:
+      req->rc = mmdb_get(req->db, req->doc, req->id);
+      break;
+    case MMDB_ASYNC_PUT:
+      req->rc = mmdb_put(req->db, req->rev, req->doc, req->opts);
+      break;
+    case MMDB_ASYNC_REVS:
+      req->rc = mmdb_revs(req->db, req->revs, req->id);
+      break;
+    default:
+      req->rc = MMDB_ERROR;
+  }
+}
+
+// runs a batch inside one outer savepoint, so a burst of puts costs a single
+// commit; each put still has its own nested savepoint for conflicts
+void mmdb_async_run_batch(mmdb_async_req_t *batch) {
+  mmdb_async_req_t *r = NULL;
+  mmdb_t *db = batch->db;
+  int tx = 0;
+
+  tx = batch->next != NULL &&
+       sqlite3_exec(db->db, query_async_begin, NULL, NULL, NULL) == SQLITE_OK;
+
+  for (r = batch; r != NULL; r = r->next) {
+    mmdb_async_run(r);
+  }
+
+  if (!tx) {
+    return;
+  }
+
+  // subscribers only hear about the batch once it has actually committed
+  if (sqlite3_exec(db->db, query_async_commit, NULL, NULL, NULL) ==
+      SQLITE_OK) {
+    mmdb_subs_settle(db, 1);
+    return;
+  }
+
+  mmdb_subs_settle(db, 0);
+  sqlite3_exec(db->db, query_async_rollback, NULL, NULL, NULL);
+  mmdb_subs_settle(db, 0);
+
+  for (r = batch; r != NULL; r = r->next) {
+    if (r->type == MMDB_ASYNC_PUT && r->rc == MMDB_OK) {
+      r->rc = MMDB_ERROR;
+    }
+  }
+}
+
+void *mmdb_async_worker(void *ptr) {
+  mmdb_async_t *async = ptr;
+  mmdb_async_req_t *batch = NULL;
+  uint64_t one = 1;
+  int i;
+
+  pthread_mutex_lock(&async->lock);
+
+  while (1) {
+    if ((batch = mmdb_async_take(async)) == NULL) {
+      if (async->stop && async->queue == NULL) {
+        break;
+      }
+
+      pthread_cond_wait(&async->cond, &async->lock);
+      continue;
+    }
+
+    for (i = 0; async->busy[i] != NULL; i++)
+      ;
+    async->busy[i] = batch->db;
+
+    pthread_mutex_unlock(&async->lock);
+    mmdb_async_run_batch(batch);
+    pthread_mutex_lock(&async->lock);
+
+    async->busy[i] = NULL;
+
+    if (async->done_tail == NULL) {
+      async->done = batch;
+    } else {
+      async->done_tail->next = batch;
+    }
+    for (async->done_tail = batch; async->done_tail->next != NULL;
+         async->done_tail = async->done_tail->next)
+      ;
+
+    // other workers may be waiting for this database to become idle
+    pthread_cond_broadcast(&async->cond);
+
+    if (write(async->fd, &one, sizeof(one)) != sizeof(one) &&
+        errno != EAGAIN) {
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&async->lock);
+
+  return NULL;
+}
+
+int mmdb_async_new(mmdb_async_t **out, int threads) {
+  mmdb_async_t *r = NULL;
+
+  if (threads <= 0) {
+    return MMDB_ERROR;
+  }
+
+  if ((r = malloc(sizeof(mmdb_async_t))) == NULL) {
+    return MMDB_ERROR;
+  }
+  memset(r, 0, sizeof(mmdb_async_t));
+
+  r->threads = calloc(threads, sizeof(pthread_t));
+  r->busy = calloc(threads, sizeof(mmdb_t *));
+  if (r->threads == NULL || r->busy == NULL) {
+    free(r->threads);
+    free(r->busy);
+    free(r);
+    return MMDB_ERROR;
+  }
+
+  if ((r->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    free(r->threads);
+    free(r->busy);
+    free(r);
+    return MMDB_ERROR;
+  }
+
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->cond, NULL);
+
+  for (r->threads_total = 0; r->threads_total < threads; r->threads_total++) {
+    if (pthread_create(&r->threads[r->threads_total], NULL, mmdb_async_worker,
+                       r) != 0) {
+      mmdb_async_free(r);
+      return MMDB_ERROR;
+    }
+  }
+
+  *out = r;
+
+  return MMDB_OK;
+}
+
+// waits for everything queued to finish and runs the outstanding callbacks
+void mmdb_async_free(mmdb_async_t *async) {
+  int i;
+
+  if (async == NULL) return;
+
+  pthread_mutex_lock(&async->lock);
+  async->stop = 1;
+  pthread_cond_broadcast(&async->cond);
+  pthread_mutex_unlock(&async->lock);
+
+  for (i = 0; i < async->threads_total; i++) {
+    pthread_join(async->threads[i], NULL);
+  }
+
+  mmdb_async_poll(async, 0);
+
+  pthread_cond_destroy(&async->cond);
+  pthread_mutex_destroy(&async->lock);
+  close(async->fd);
+  free(async->threads);
+  free(async->busy);
+  free(async);
+}
+
+int mmdb_async_fd(mmdb_async_t *async) { return async->fd; }
+
+int mmdb_async_poll(mmdb_async_t *async, int timeout) {
+  struct pollfd pfd = {async->fd, POLLIN, 0};
+  mmdb_async_req_t *r = NULL, *next = NULL;
+  uint64_t n;
+
+  if (timeout != 0 && poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+    return MMDB_ERROR;
+  }
+
+  if (read(async->fd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+    return MMDB_ERROR;
+  }
+
+  pthread_mutex_lock(&async->lock);
+  r = async->done;
+  async->done = NULL;
+  async->done_tail = NULL;
+  pthread_mutex_unlock(&async->lock);
+
+  for (; r != NULL; r = next) {
+    next = r->next;
+    if (r->cb != NULL) {
+      r->cb(r->rc, r->ptr);
+    }
+    free(r);
+  }
+
+  return MMDB_OK;
+}
+
+int mmdb_async_submit(mmdb_async_t *async, mmdb_async_req_t *req) {
+  mmdb_async_req_t *r = NULL;
+
+  if ((r = malloc(sizeof(mmdb_async_req_t))) == NULL) {
+    return MMDB_ERROR;
+  }
+  memcpy(r, req, sizeof(mmdb_async_req_t));
+  r->next = NULL;
+
+  pthread_mutex_lock(&async->lock);
+
+  if (async->stop) {
+    pthread_mutex_unlock(&async->lock);
+    free(r);
+    return MMDB_ERROR;
+  }
+
+  if (async->queue_tail == NULL) {
+    async->queue = r;
+  } else {
+    async->queue_tail->next = r;
+  }
+  async->queue_tail = r;
+
+  pthread_cond_signal(&async->cond);
+  pthread_mutex_unlock(&async->lock);
+
+  return MMDB_OK;
+}
+
+int mmdb_get_async(mmdb_async_t *async, mmdb_t *db, mmdb_doc_t *out,
+                   const char *id, mmdb_async_cb cb, void *ptr) {
+  mmdb_async_req_t req;
+
+  if (strlen(id) > MMDB_MAX_ID_LENGTH) {
+    return MMDB_ERROR;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.type = MMDB_ASYNC_GET;
+  req.db = mmdb_shard(db, id);
+  strcpy(req.id, id);
+  req.doc = out;
+  req.cb = cb;
+  req.ptr = ptr;
+
+  return mmdb_async_submit(async, &req);
+}
+
+int mmdb_put_async(mmdb_async_t *async, mmdb_t *db, mmdb_rev_t *out_rev,
+                   mmdb_doc_t *doc, mmdb_put_options_t *opts, mmdb_async_cb cb,
+                   void *ptr) {
+  mmdb_async_req_t req;
+
+  memset(&req, 0, sizeof(req));
+  req.type = MMDB_ASYNC_PUT;
+  req.db = mmdb_shard(db, doc->id);
+  req.rev = out_rev;
+  req.doc = doc;
+  req.opts = opts;
+  req.cb = cb;
+  req.ptr = ptr;
+
+  return mmdb_async_submit(async, &req);
+}
+
+int mmdb_revs_async(mmdb_async_t *async, mmdb_t *db, mmdb_revs_t *out,
+                    const char *id, mmdb_async_cb cb, void *ptr) {
+  mmdb_async_req_t req;
+
+  if (strlen(id) > MMDB_MAX_ID_LENGTH) {
+    return MMDB_ERROR;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.type = MMDB_ASYNC_REVS;
+  req.db = mmdb_shard(db, id);
+  strcpy(req.id, id);
+  req.revs = out;
+  req.cb = cb;
+  req.ptr = ptr;
+
+  return mmdb_async_submit(async, &req);
+}
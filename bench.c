@@ -0,0 +1,64 @@
+#include <jansson.h>
+#include <openssl/evp.h>
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+#include "mmdb.h"
+
+// throughput of each revision hash over document-sized inputs:
+//
+//   make bench && ./bench
+
+static double bench_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  static const size_t sizes[] = {64, 1024, 64 * 1024, 1024 * 1024};
+  static const int algorithms[] = {MMDB_HASH_MD5, MMDB_HASH_BLAKE3,
+                                   MMDB_HASH_XXH3};
+  unsigned char *data = NULL, out[16];
+  size_t i, j, total, n;
+  double start, elapsed;
+
+  if ((data = malloc(sizes[3])) == NULL) {
+    return 1;
+  }
+  for (i = 0; i < sizes[3]; i++) {
+    data[i] = (unsigned char)(i * 2654435761u >> 24);
+  }
+
+  printf("%-8s %10s %12s\n", "hash", "bytes", "MB/s");
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    for (j = 0; j < sizeof(algorithms) / sizeof(algorithms[0]); j++) {
+      // about 256 MB per measurement, whatever the input size
+      total = 0;
+      start = bench_now();
+      for (n = 0; n < (256u << 20) / sizes[i]; n++) {
+        if (hash_oneshot(algorithms[j], out, sizeof(out), data, sizes[i]) !=
+            MMDB_OK) {
+          return 1;
+        }
+        total += sizes[i];
+      }
+      elapsed = bench_now() - start;
+
+      printf("%-8s %10zu %12.0f\n", hash_name(algorithms[j]), sizes[i],
+             total / elapsed / (1 << 20));
+    }
+  }
+
+  free(data);
+
+  return 0;
+}
@@ -0,0 +1,627 @@
+#include <ctype.h>
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "find.h"
+#include "mmdb.h"
+
+// selectors are mango-style: {"field": value} for equality, or
+// {"field": {"$op": value}} with $eq, $ne, $gt, $gte, $lt, $lte, $in, $nin
+// and $exists; $and, $or and $nor take a list of selectors and $not takes
+// one; dots in field names reach into nested objects
+
+const char find_select[] =
+    "select d.id, r.rev, b.doc%s from docs d join revs r on r.docid = d.docid "
+    "and r.rev = d.rev join bodies b on b.hash = r.body where r.deleted = 0 "
+    "and ";
+
+int find_add(find_sql_t *q, const char *fmt, ...) {
+  va_list ap;
+  char *str = NULL;
+  int n;
+
+  while (1) {
+    va_start(ap, fmt);
+    n = vsnprintf(q->str + q->len, q->cap - q->len, fmt, ap);
+    va_end(ap);
+
+    if (n < 0) {
+      return MMDB_ERROR;
+    }
+
+    if (q->len + n < q->cap) {
+      q->len += n;
+      return MMDB_OK;
+    }
+
+    if ((str = realloc(q->str, q->cap * 2 + n + 1)) == NULL) {
+      return MMDB_ERROR;
+    }
+    q->str = str;
+    q->cap = q->cap * 2 + n + 1;
+  }
+}
+
+int find_param(find_sql_t *q, json_t *v) {
+  if (json_array_append(q->params, v) != 0) {
+    return MMDB_ERROR;
+  }
+
+  // objects and arrays come back out of json_extract as minified text
+  return find_add(q, json_is_object(v) || json_is_array(v) ? "json(?)" : "?");
+}
+
+// turns a.b into '$."a"."b"', quoted for use as an sql literal; characters
+// that would need escaping in either aren't allowed
+int find_path(char *out, size_t len, const char *field) {
+  size_t n = 0;
+  const char *p;
+
+  if (len < 8 || *field == 0) {
+    return MMDB_ERROR;
+  }
+
+  n += snprintf(out, len, "'$.\"");
+
+  for (p = field; *p != 0; p++) {
+    if (*p == '"' || *p == '\'' || *p == '\\' || iscntrl((unsigned char)*p)) {
+      return MMDB_ERROR;
+    }
+
+    if (n + 6 >= len) {
+      return MMDB_ERROR;
+    }
+
+    if (*p == '.') {
+      if (p[1] == 0 || p[1] == '.' || p == field) {
+        return MMDB_ERROR;
+      }
+      n += snprintf(out + n, len - n, "\".\"");
+    } else {
+      out[n++] = *p;
+    }
+  }
+
+  snprintf(out + n, len - n, "\"'");
+
+  return MMDB_OK;
+}
+
+// names end up in table and index names, so they're kept to letters, digits
+// and underscores
+int find_name(const char *name) {
+  const char *p;
+
+  for (p = name; *p != 0; p++) {
+    if (!isalnum((unsigned char)*p) && *p != '_') {
+      return MMDB_ERROR;
+    }
+  }
+
+  return p == name || p - name > MMDB_MAX_NAME_LENGTH ? MMDB_ERROR : MMDB_OK;
+}
+
+int find_selector(find_sql_t *q, json_t *selector);
+
+int find_list(find_sql_t *q, json_t *list, const char *join) {
+  size_t i;
+  json_t *v;
+
+  if (!json_is_array(list) || json_array_size(list) == 0) {
+    return MMDB_ERROR;
+  }
+
+  if (find_add(q, "(") != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  json_array_foreach(list, i, v) {
+    if ((i > 0 && find_add(q, " %s ", join) != MMDB_OK) ||
+        find_selector(q, v) != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+  }
+
+  return find_add(q, ")");
+}
+
+int find_op(find_sql_t *q, const char *path, const char *op, json_t *v) {
+  static const char *cmps[][2] = {{"$gt", ">"},  {"$gte", ">="},
+                                  {"$lt", "<"},  {"$lte", "<="},
+                                  {"$eq", "="},  {"$ne", "!="}};
+  size_t i;
+  json_t *item;
+
+  if (strcmp(op, "$exists") == 0) {
+    if (!json_is_boolean(v)) {
+      return MMDB_ERROR;
+    }
+    return find_add(q, "json_type(b.doc, %s) is %s", path,
+                    json_is_true(v) ? "not null" : "null");
+  }
+
+  // json_extract can't tell null from missing, so null is matched by type
+  if (json_is_null(v) && strcmp(op, "$eq") == 0) {
+    return find_add(q, "json_type(b.doc, %s) = 'null'", path);
+  }
+
+  if (json_is_null(v) && strcmp(op, "$ne") == 0) {
+    return find_add(q, "json_type(b.doc, %s) != 'null'", path);
+  }
+
+  if (strcmp(op, "$in") == 0 || strcmp(op, "$nin") == 0) {
+    if (!json_is_array(v)) {
+      return MMDB_ERROR;
+    }
+
+    if (json_array_size(v) == 0) {
+      return find_add(q, strcmp(op, "$in") == 0 ? "0" : "1");
+    }
+
+    if (find_add(q, "json_extract(b.doc, %s) %s (", path,
+                 strcmp(op, "$in") == 0 ? "in" : "not in") != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+
+    json_array_foreach(v, i, item) {
+      if ((i > 0 && find_add(q, ", ") != MMDB_OK) ||
+          find_param(q, item) != MMDB_OK) {
+        return MMDB_ERROR;
+      }
+    }
+
+    return find_add(q, ")");
+  }
+
+  for (i = 0; i < sizeof(cmps) / sizeof(cmps[0]); i++) {
+    if (strcmp(op, cmps[i][0]) == 0 && !json_is_null(v)) {
+      if (find_add(q, "json_extract(b.doc, %s) %s ", path, cmps[i][1]) !=
+          MMDB_OK) {
+        return MMDB_ERROR;
+      }
+      return find_param(q, v);
+    }
+  }
+
+  return MMDB_ERROR;
+}
+
+int find_field(find_sql_t *q, const char *field, json_t *cond) {
+  char path[FIND_MAX_PATH_LENGTH], nested[FIND_MAX_PATH_LENGTH];
+  const char *key;
+  json_t *v;
+  int first = 1;
+
+  if (find_path(path, sizeof(path), field) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (!json_is_object(cond) || json_object_size(cond) == 0) {
+    return find_op(q, path, "$eq", cond);
+  }
+
+  if (find_add(q, "(") != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  // either all operators, or a nested object naming subfields
+  json_object_foreach(cond, key, v) {
+    if (!first && find_add(q, " and ") != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+    first = 0;
+
+    if (key[0] == '$') {
+      if (find_op(q, path, key, v) != MMDB_OK) {
+        return MMDB_ERROR;
+      }
+      continue;
+    }
+
+    if (snprintf(nested, sizeof(nested), "%s.%s", field, key) >=
+            (int)sizeof(nested) ||
+        find_field(q, nested, v) != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+  }
+
+  return find_add(q, ")");
+}
+
+int find_selector(find_sql_t *q, json_t *selector) {
+  const char *key;
+  json_t *v;
+  int first = 1, rc;
+
+  if (!json_is_object(selector)) {
+    return MMDB_ERROR;
+  }
+
+  if (json_object_size(selector) == 0) {
+    return find_add(q, "1");
+  }
+
+  if (find_add(q, "(") != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  json_object_foreach(selector, key, v) {
+    if (!first && find_add(q, " and ") != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+    first = 0;
+
+    if (strcmp(key, "$and") == 0) {
+      rc = find_list(q, v, "and");
+    } else if (strcmp(key, "$or") == 0) {
+      rc = find_list(q, v, "or");
+    } else if (strcmp(key, "$nor") == 0) {
+      rc = find_add(q, "not ") == MMDB_OK ? find_list(q, v, "or")
+                                          : MMDB_ERROR;
+    } else if (strcmp(key, "$not") == 0) {
+      rc = find_add(q, "not ") == MMDB_OK ? find_selector(q, v) : MMDB_ERROR;
+    } else if (key[0] == '$') {
+      rc = MMDB_ERROR;
+    } else {
+      rc = find_field(q, key, v);
+    }
+
+    if (rc != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+  }
+
+  return find_add(q, ")");
+}
+
+// sort is a list of field names, each optionally as {"field": "desc"}
+int find_sort_key(json_t *v, const char **field, int *desc) {
+  const char *key;
+  json_t *dir;
+
+  if (json_is_string(v)) {
+    *field = json_string_value(v);
+    *desc = 0;
+    return MMDB_OK;
+  }
+
+  if (!json_is_object(v) || json_object_size(v) != 1) {
+    return MMDB_ERROR;
+  }
+
+  json_object_foreach(v, key, dir) {
+    *field = key;
+    if (json_is_string(dir) && strcmp(json_string_value(dir), "asc") == 0) {
+      *desc = 0;
+    } else if (json_is_string(dir) &&
+               strcmp(json_string_value(dir), "desc") == 0) {
+      *desc = 1;
+    } else {
+      return MMDB_ERROR;
+    }
+  }
+
+  return MMDB_OK;
+}
+
+// pages are keyset based: the cursor holds the sort keys and id of the last
+// row returned, and the next page starts strictly after it
+int find_keyset(find_sql_t *q, char paths[][FIND_MAX_PATH_LENGTH],
+                json_t *cursor) {
+  int i, j;
+
+  if (!json_is_array(cursor) ||
+      json_array_size(cursor) != (size_t)q->keys + 1 ||
+      !json_is_string(json_array_get(cursor, q->keys))) {
+    return MMDB_ERROR;
+  }
+
+  if (find_add(q, " and (") != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  for (i = 0; i <= q->keys; i++) {
+    if (i > 0 && find_add(q, " or ") != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+
+    if (find_add(q, "(") != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+
+    for (j = 0; j < i; j++) {
+      if (find_add(q, "json_extract(b.doc, %s) = ", paths[j]) != MMDB_OK ||
+          find_param(q, json_array_get(cursor, j)) != MMDB_OK ||
+          find_add(q, " and ") != MMDB_OK) {
+        return MMDB_ERROR;
+      }
+    }
+
+    if (i == q->keys) {
+      if (find_add(q, "d.id > ") != MMDB_OK ||
+          find_param(q, json_array_get(cursor, i)) != MMDB_OK) {
+        return MMDB_ERROR;
+      }
+    } else if (find_add(q, "json_extract(b.doc, %s) %s ", paths[i],
+                        q->desc & (1u << i) ? "<" : ">") != MMDB_OK ||
+               find_param(q, json_array_get(cursor, i)) != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+
+    if (find_add(q, ")") != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+  }
+
+  return find_add(q, ")");
+}
+
+// builds a query returning id, rev and doc of every winning revision that
+// matches selector, followed by its sort keys; documents missing a sort key
+// are left out, and ties are broken by id
+int find_compile(find_sql_t *q, json_t *selector, json_t *sort,
+                 json_t *cursor, int limit) {
+  char paths[FIND_MAX_KEYS][FIND_MAX_PATH_LENGTH], keys[1024];
+  const char *field = NULL;
+  size_t i, n = 0;
+  json_t *v;
+  int desc;
+
+  memset(q, 0, sizeof(find_sql_t));
+  keys[0] = 0;
+
+  if ((q->params = json_array()) == NULL || (q->str = malloc(256)) == NULL) {
+    find_free(q);
+    return MMDB_ERROR;
+  }
+  q->cap = 256;
+  q->str[0] = 0;
+
+  if (sort != NULL && !json_is_array(sort)) {
+    find_free(q);
+    return MMDB_ERROR;
+  }
+
+  json_array_foreach(sort, i, v) {
+    if (i >= FIND_MAX_KEYS || find_sort_key(v, &field, &desc) != MMDB_OK ||
+        find_path(paths[i], sizeof(paths[i]), field) != MMDB_OK) {
+      find_free(q);
+      return MMDB_ERROR;
+    }
+
+    n += snprintf(keys + n, n < sizeof(keys) ? sizeof(keys) - n : 0,
+                  ", json_extract(b.doc, %s)", paths[i]);
+    if (n >= sizeof(keys)) {
+      find_free(q);
+      return MMDB_ERROR;
+    }
+
+    q->desc |= desc ? 1u << i : 0;
+    q->keys++;
+  }
+
+  if (find_add(q, find_select, keys) != MMDB_OK ||
+      find_selector(q, selector) != MMDB_OK) {
+    find_free(q);
+    return MMDB_ERROR;
+  }
+
+  for (i = 0; i < (size_t)q->keys; i++) {
+    if (find_add(q, " and json_extract(b.doc, %s) is not null", paths[i]) !=
+        MMDB_OK) {
+      find_free(q);
+      return MMDB_ERROR;
+    }
+  }
+
+  if (cursor != NULL && find_keyset(q, paths, cursor) != MMDB_OK) {
+    find_free(q);
+    return MMDB_ERROR;
+  }
+
+  if (find_add(q, " order by ") != MMDB_OK) {
+    find_free(q);
+    return MMDB_ERROR;
+  }
+
+  for (i = 0; i < (size_t)q->keys; i++) {
+    if (find_add(q, "json_extract(b.doc, %s) %s, ", paths[i],
+                 q->desc & (1u << i) ? "desc" : "asc") != MMDB_OK) {
+      find_free(q);
+      return MMDB_ERROR;
+    }
+  }
+
+  if (find_add(q, "d.id limit %d", limit > 0 ? limit : -1) != MMDB_OK) {
+    find_free(q);
+    return MMDB_ERROR;
+  }
+
+  return MMDB_OK;
+}
+
+// field indexes are expression indexes over the stored bodies, written the
+// same way as the queries so sqlite can match them up
+int find_index(find_sql_t *q, const char *name, json_t *fields) {
+  char path[FIND_MAX_PATH_LENGTH];
+  size_t i;
+  json_t *v;
+
+  memset(q, 0, sizeof(find_sql_t));
+
+  if (find_name(name) != MMDB_OK || !json_is_array(fields) ||
+      json_array_size(fields) == 0) {
+    return MMDB_ERROR;
+  }
+
+  if ((q->str = malloc(256)) == NULL) {
+    return MMDB_ERROR;
+  }
+  q->cap = 256;
+
+  if (find_add(q, "create index if not exists mmdb_find_%s on bodies (",
+               name) != MMDB_OK) {
+    find_free(q);
+    return MMDB_ERROR;
+  }
+
+  json_array_foreach(fields, i, v) {
+    if (!json_is_string(v) ||
+        find_path(path, sizeof(path), json_string_value(v)) != MMDB_OK ||
+        find_add(q, "%sjson_extract(doc, %s)", i > 0 ? ", " : "", path) !=
+            MMDB_OK) {
+      find_free(q);
+      return MMDB_ERROR;
+    }
+  }
+
+  if (find_add(q, ")") != MMDB_OK) {
+    find_free(q);
+    return MMDB_ERROR;
+  }
+
+  return MMDB_OK;
+}
+
+int find_bind(sqlite3_stmt *stmt, find_sql_t *q) {
+  size_t i;
+  json_t *v;
+  char *str = NULL;
+  int rc = SQLITE_OK;
+
+  json_array_foreach(q->params, i, v) {
+    switch (json_typeof(v)) {
+      case JSON_STRING:
+        rc = sqlite3_bind_text(stmt, i + 1, json_string_value(v),
+                               json_string_length(v), SQLITE_TRANSIENT);
+        break;
+      case JSON_INTEGER:
+        rc = sqlite3_bind_int64(stmt, i + 1, json_integer_value(v));
+        break;
+      case JSON_REAL:
+        rc = sqlite3_bind_double(stmt, i + 1, json_real_value(v));
+        break;
+      case JSON_TRUE:
+      case JSON_FALSE:
+        rc = sqlite3_bind_int(stmt, i + 1, json_is_true(v));
+        break;
+      case JSON_OBJECT:
+      case JSON_ARRAY:
+        // serialized the way documents are stored, so json(?) compares equal
+        if ((str = json_dumps(v, JSON_COMPACT | JSON_SORT_KEYS |
+                                     JSON_ENSURE_ASCII)) == NULL) {
+          return MMDB_ERROR;
+        }
+        rc = sqlite3_bind_text(stmt, i + 1, str, -1, free);
+        break;
+      default:
+        rc = sqlite3_bind_null(stmt, i + 1);
+    }
+
+    if (rc != SQLITE_OK) {
+      return MMDB_ERROR;
+    }
+  }
+
+  return MMDB_OK;
+}
+
+// orders two values the way sqlite does: null, then numbers, then text, then
+// blobs, with text compared bytewise
+int find_value_cmp(sqlite3_stmt *a, sqlite3_stmt *b, int col) {
+  static const int rank[] = {0, 1, 1, 2, 3, 0};
+  int ta = sqlite3_column_type(a, col), tb = sqlite3_column_type(b, col);
+  double da, db;
+  int na, nb, c;
+
+  if (rank[ta] != rank[tb]) {
+    return rank[ta] < rank[tb] ? -1 : 1;
+  }
+
+  switch (rank[ta]) {
+    case 1:
+      if (ta == SQLITE_INTEGER && tb == SQLITE_INTEGER) {
+        return sqlite3_column_int64(a, col) < sqlite3_column_int64(b, col)
+                   ? -1
+                   : sqlite3_column_int64(a, col) >
+                         sqlite3_column_int64(b, col);
+      }
+      da = sqlite3_column_double(a, col);
+      db = sqlite3_column_double(b, col);
+      return da < db ? -1 : da > db;
+    case 2:
+    case 3:
+      na = sqlite3_column_bytes(a, col);
+      nb = sqlite3_column_bytes(b, col);
+      if ((c = memcmp(sqlite3_column_blob(a, col), sqlite3_column_blob(b, col),
+                      na < nb ? na : nb)) != 0) {
+        return c;
+      }
+      return na < nb ? -1 : na > nb;
+    default:
+      return 0;
+  }
+}
+
+// compares the current rows of two statements from find_compile, for merging
+// the results of several shards
+int find_cmp(find_sql_t *q, sqlite3_stmt *a, sqlite3_stmt *b) {
+  int i, c;
+
+  for (i = 0; i < q->keys; i++) {
+    if ((c = find_value_cmp(a, b, 3 + i)) != 0) {
+      return q->desc & (1u << i) ? -c : c;
+    }
+  }
+
+  return strcmp((const char *)sqlite3_column_text(a, 0),
+                (const char *)sqlite3_column_text(b, 0));
+}
+
+// a column as json, for the types json_extract returns
+json_t *find_value(sqlite3_stmt *stmt, int col) {
+  switch (sqlite3_column_type(stmt, col)) {
+    case SQLITE_INTEGER:
+      return json_integer(sqlite3_column_int64(stmt, col));
+    case SQLITE_FLOAT:
+      return json_real(sqlite3_column_double(stmt, col));
+    case SQLITE_TEXT:
+      return json_stringn((const char *)sqlite3_column_text(stmt, col),
+                          sqlite3_column_bytes(stmt, col));
+    case SQLITE_NULL:
+      return json_null();
+    default:
+      return NULL;
+  }
+}
+
+// the cursor that resumes after the current row
+json_t *find_cursor(find_sql_t *q, sqlite3_stmt *stmt) {
+  json_t *r = NULL;
+  int i;
+
+  if ((r = json_array()) == NULL) {
+    return NULL;
+  }
+
+  // sort keys, then the id
+  for (i = 0; i <= q->keys; i++) {
+    if (json_array_append_new(r, find_value(stmt, i < q->keys ? 3 + i : 0)) !=
+        0) {
+      json_decref(r);
+      return NULL;
+    }
+  }
+
+  return r;
+}
+
+void find_free(find_sql_t *q) {
+  free(q->str);
+  json_decref(q->params);
+  memset(q, 0, sizeof(find_sql_t));
+}
@@ -0,0 +1,29 @@
+// most sort fields a query can have
+#define FIND_MAX_KEYS 16
+
+// longest json path a field name may turn into
+#define FIND_MAX_PATH_LENGTH 512
+
+typedef struct find_sql_s {
+  char *str;
+  size_t len;
+  size_t cap;
+  // values for the ? placeholders, in order
+  json_t *params;
+  // sort keys, selected after id, rev and doc; bit n of desc is set if key n
+  // sorts in descending order
+  int keys;
+  unsigned int desc;
+} find_sql_t;
+
+int find_name(const char *name);
+int find_path(char *out, size_t len, const char *field);
+int find_compile(find_sql_t *out, json_t *selector, json_t *sort,
+                 json_t *cursor, int limit);
+int find_index(find_sql_t *out, const char *name, json_t *fields);
+int find_bind(sqlite3_stmt *stmt, find_sql_t *sql);
+int find_value_cmp(sqlite3_stmt *a, sqlite3_stmt *b, int col);
+json_t *find_value(sqlite3_stmt *stmt, int col);
+int find_cmp(find_sql_t *sql, sqlite3_stmt *a, sqlite3_stmt *b);
+json_t *find_cursor(find_sql_t *sql, sqlite3_stmt *stmt);
+void find_free(find_sql_t *sql);
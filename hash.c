@@ -0,0 +1,355 @@
+#include <jansson.h>
+#include <openssl/evp.h>
+#include <sqlite3.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hash.h"
+#include "mmdb.h"
+
+// xxh3 is compiled in from the vendored single header, and picks the widest
+// simd the compiler targets on its own
+#define XXH_STATIC_LINKING_ONLY
+#define XXH_IMPLEMENTATION
+#include "xxhash/xxhash.h"
+
+// BLAKE3, portable implementation following the reference in the spec;
+// mmdb only ever needs the first 16 bytes of the root output
+
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+
+#define BLAKE3_CHUNK_START 1
+#define BLAKE3_CHUNK_END 2
+#define BLAKE3_PARENT 4
+#define BLAKE3_ROOT 8
+
+static const uint32_t blake3_iv[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372,
+                                      0xA54FF53A, 0x510E527F, 0x9B05688C,
+                                      0x1F83D9AB, 0x5BE0CD19};
+
+static const unsigned char blake3_permutation[16] = {
+    2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8};
+
+static inline uint32_t blake3_rotr(uint32_t w, int c) {
+  return (w >> c) | (w << (32 - c));
+}
+
+static inline void blake3_g(uint32_t *s, int a, int b, int c, int d,
+                            uint32_t mx, uint32_t my) {
+  s[a] = s[a] + s[b] + mx;
+  s[d] = blake3_rotr(s[d] ^ s[a], 16);
+  s[c] = s[c] + s[d];
+  s[b] = blake3_rotr(s[b] ^ s[c], 12);
+  s[a] = s[a] + s[b] + my;
+  s[d] = blake3_rotr(s[d] ^ s[a], 8);
+  s[c] = s[c] + s[d];
+  s[b] = blake3_rotr(s[b] ^ s[c], 7);
+}
+
+static void blake3_compress(const uint32_t cv[8], const uint32_t block[16],
+                            uint64_t counter, uint32_t block_len,
+                            uint32_t flags, uint32_t out[16]) {
+  uint32_t s[16], m[16], t[16];
+  int r, i;
+
+  memcpy(s, cv, sizeof(uint32_t) * 8);
+  memcpy(&s[8], blake3_iv, sizeof(uint32_t) * 4);
+  s[12] = (uint32_t)counter;
+  s[13] = (uint32_t)(counter >> 32);
+  s[14] = block_len;
+  s[15] = flags;
+
+  memcpy(m, block, sizeof(m));
+
+  for (r = 0; r < 7; r++) {
+    blake3_g(s, 0, 4, 8, 12, m[0], m[1]);
+    blake3_g(s, 1, 5, 9, 13, m[2], m[3]);
+    blake3_g(s, 2, 6, 10, 14, m[4], m[5]);
+    blake3_g(s, 3, 7, 11, 15, m[6], m[7]);
+    blake3_g(s, 0, 5, 10, 15, m[8], m[9]);
+    blake3_g(s, 1, 6, 11, 12, m[10], m[11]);
+    blake3_g(s, 2, 7, 8, 13, m[12], m[13]);
+    blake3_g(s, 3, 4, 9, 14, m[14], m[15]);
+
+    for (i = 0; i < 16; i++) {
+      t[i] = m[blake3_permutation[i]];
+    }
+    memcpy(m, t, sizeof(m));
+  }
+
+  for (i = 0; i < 8; i++) {
+    out[i] = s[i] ^ s[i + 8];
+    out[i + 8] = s[i + 8] ^ cv[i];
+  }
+}
+
+static void blake3_words(const unsigned char *in, uint32_t *out, int n) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    out[i] = (uint32_t)in[i * 4] | ((uint32_t)in[i * 4 + 1] << 8) |
+             ((uint32_t)in[i * 4 + 2] << 16) | ((uint32_t)in[i * 4 + 3] << 24);
+  }
+}
+
+static void blake3_chunk_reset(hash_blake3_t *b, uint64_t counter) {
+  memcpy(b->cv, b->key, sizeof(b->cv));
+  b->chunk_counter = counter;
+  memset(b->block, 0, sizeof(b->block));
+  b->block_len = 0;
+  b->blocks_compressed = 0;
+}
+
+static uint32_t blake3_chunk_flags(hash_blake3_t *b) {
+  return b->blocks_compressed == 0 ? BLAKE3_CHUNK_START : 0;
+}
+
+static void blake3_chunk_update(hash_blake3_t *b, const unsigned char *in,
+                                size_t len) {
+  uint32_t words[16], out[16];
+  size_t take;
+
+  while (len > 0) {
+    if (b->block_len == BLAKE3_BLOCK_LEN) {
+      blake3_words(b->block, words, 16);
+      blake3_compress(b->cv, words, b->chunk_counter, BLAKE3_BLOCK_LEN,
+                      blake3_chunk_flags(b), out);
+      memcpy(b->cv, out, sizeof(b->cv));
+      b->blocks_compressed++;
+      memset(b->block, 0, sizeof(b->block));
+      b->block_len = 0;
+    }
+
+    take = BLAKE3_BLOCK_LEN - b->block_len;
+    if (take > len) {
+      take = len;
+    }
+
+    memcpy(&b->block[b->block_len], in, take);
+    b->block_len += take;
+    in += take;
+    len -= take;
+  }
+}
+
+static void blake3_parent_cv(hash_blake3_t *b, const uint32_t left[8],
+                             const uint32_t right[8], uint32_t out[8]) {
+  uint32_t block[16], full[16];
+
+  memcpy(block, left, sizeof(uint32_t) * 8);
+  memcpy(&block[8], right, sizeof(uint32_t) * 8);
+  blake3_compress(b->key, block, 0, BLAKE3_BLOCK_LEN, BLAKE3_PARENT, full);
+  memcpy(out, full, sizeof(uint32_t) * 8);
+}
+
+static void blake3_init(hash_blake3_t *b) {
+  memcpy(b->key, blake3_iv, sizeof(b->key));
+  b->cv_stack_len = 0;
+  blake3_chunk_reset(b, 0);
+}
+
+static void blake3_update(hash_blake3_t *b, const unsigned char *in,
+                          size_t len) {
+  uint32_t words[16], out[16], cv[8];
+  uint64_t total;
+  size_t take;
+
+  while (len > 0) {
+    // a full chunk is only finished once more input shows it isn't the root
+    if (b->blocks_compressed * BLAKE3_BLOCK_LEN + b->block_len ==
+        BLAKE3_CHUNK_LEN) {
+      blake3_words(b->block, words, 16);
+      blake3_compress(b->cv, words, b->chunk_counter, b->block_len,
+                      blake3_chunk_flags(b) | BLAKE3_CHUNK_END, out);
+      memcpy(cv, out, sizeof(cv));
+
+      total = b->chunk_counter + 1;
+      while ((total & 1) == 0) {
+        b->cv_stack_len--;
+        blake3_parent_cv(b, b->cv_stack[b->cv_stack_len], cv, cv);
+        total >>= 1;
+      }
+      memcpy(b->cv_stack[b->cv_stack_len++], cv, sizeof(cv));
+
+      blake3_chunk_reset(b, b->chunk_counter + 1);
+    }
+
+    take = BLAKE3_CHUNK_LEN -
+           (b->blocks_compressed * BLAKE3_BLOCK_LEN + b->block_len);
+    if (take > len) {
+      take = len;
+    }
+
+    blake3_chunk_update(b, in, take);
+    in += take;
+    len -= take;
+  }
+}
+
+static void blake3_final(hash_blake3_t *b, unsigned char *out, size_t len) {
+  uint32_t cv[8], block[16], full[16];
+  uint64_t counter;
+  uint32_t block_len, flags;
+  size_t i;
+  int n;
+
+  // the output node starts out as the current chunk, then gets folded into
+  // the parents still waiting on the stack
+  memcpy(cv, b->cv, sizeof(cv));
+  blake3_words(b->block, block, 16);
+  counter = b->chunk_counter;
+  block_len = b->block_len;
+  flags = blake3_chunk_flags(b) | BLAKE3_CHUNK_END;
+
+  for (n = b->cv_stack_len; n > 0; n--) {
+    blake3_compress(cv, block, counter, block_len, flags, full);
+    memcpy(block, b->cv_stack[n - 1], sizeof(uint32_t) * 8);
+    memcpy(&block[8], full, sizeof(uint32_t) * 8);
+    memcpy(cv, b->key, sizeof(cv));
+    counter = 0;
+    block_len = BLAKE3_BLOCK_LEN;
+    flags = BLAKE3_PARENT;
+  }
+
+  blake3_compress(cv, block, 0, block_len, flags | BLAKE3_ROOT, full);
+
+  for (i = 0; i < len && i < 64; i++) {
+    out[i] = (full[i / 4] >> (8 * (i % 4))) & 0xff;
+  }
+}
+
+int hash_init(hash_t *h, int algorithm) {
+  memset(h, 0, sizeof(hash_t));
+  h->algorithm = algorithm;
+
+  switch (algorithm) {
+    case MMDB_HASH_MD5:
+      if ((h->md5 = EVP_MD_CTX_new()) == NULL) {
+        return MMDB_ERROR;
+      }
+      if (EVP_DigestInit_ex(h->md5, EVP_md5(), NULL) == 0) {
+        EVP_MD_CTX_free(h->md5);
+        h->md5 = NULL;
+        return MMDB_ERROR;
+      }
+      return MMDB_OK;
+    case MMDB_HASH_BLAKE3:
+      blake3_init(&h->blake3);
+      return MMDB_OK;
+    case MMDB_HASH_XXH3:
+      if ((h->xxh3 = XXH3_createState()) == NULL) {
+        return MMDB_ERROR;
+      }
+      if (XXH3_128bits_reset(h->xxh3) != XXH_OK) {
+        XXH3_freeState(h->xxh3);
+        h->xxh3 = NULL;
+        return MMDB_ERROR;
+      }
+      return MMDB_OK;
+    default:
+      return MMDB_ERROR;
+  }
+}
+
+int hash_update(hash_t *h, const void *data, size_t len) {
+  switch (h->algorithm) {
+    case MMDB_HASH_MD5:
+      if (EVP_DigestUpdate(h->md5, data, len) == 0) {
+        return MMDB_ERROR;
+      }
+      return MMDB_OK;
+    case MMDB_HASH_BLAKE3:
+      blake3_update(&h->blake3, data, len);
+      return MMDB_OK;
+    case MMDB_HASH_XXH3:
+      if (XXH3_128bits_update(h->xxh3, data, len) != XXH_OK) {
+        return MMDB_ERROR;
+      }
+      return MMDB_OK;
+    default:
+      return MMDB_ERROR;
+  }
+}
+
+// releases the context whether or not it succeeds
+int hash_final(hash_t *h, unsigned char *out, size_t len) {
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int n = 0;
+  int failed = 0;
+  XXH128_canonical_t canonical;
+
+  switch (h->algorithm) {
+    case MMDB_HASH_MD5:
+      if (EVP_DigestFinal_ex(h->md5, digest, &n) == 0 || n < len) {
+        failed = 1;
+      } else {
+        memcpy(out, digest, len);
+      }
+      EVP_MD_CTX_free(h->md5);
+      h->md5 = NULL;
+      break;
+    case MMDB_HASH_BLAKE3:
+      blake3_final(&h->blake3, out, len);
+      break;
+    case MMDB_HASH_XXH3:
+      if (len > sizeof(canonical)) {
+        failed = 1;
+      } else {
+        XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(h->xxh3));
+        memcpy(out, canonical.digest, len);
+      }
+      XXH3_freeState(h->xxh3);
+      h->xxh3 = NULL;
+      break;
+    default:
+      failed = 1;
+  }
+
+  return failed ? MMDB_ERROR : MMDB_OK;
+}
+
+int hash_oneshot(int algorithm, unsigned char *out, size_t out_len,
+                 const void *data, size_t len) {
+  hash_t h;
+
+  if (hash_init(&h, algorithm) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (hash_update(&h, data, len) != MMDB_OK) {
+    hash_final(&h, out, out_len);
+    return MMDB_ERROR;
+  }
+
+  return hash_final(&h, out, out_len);
+}
+
+const char *hash_name(int algorithm) {
+  switch (algorithm) {
+    case MMDB_HASH_MD5:
+      return "md5";
+    case MMDB_HASH_BLAKE3:
+      return "blake3";
+    case MMDB_HASH_XXH3:
+      return "xxh3";
+    default:
+      return NULL;
+  }
+}
+
+int hash_parse(const char *name) {
+  if (strcmp(name, "md5") == 0) {
+    return MMDB_HASH_MD5;
+  }
+
+  if (strcmp(name, "blake3") == 0) {
+    return MMDB_HASH_BLAKE3;
+  }
+
+  if (strcmp(name, "xxh3") == 0) {
+    return MMDB_HASH_XXH3;
+  }
+
+  return -1;
+}
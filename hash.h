@@ -0,0 +1,29 @@
+typedef struct hash_blake3_s {
+  uint32_t key[8];
+  uint32_t cv[8];
+  uint32_t cv_stack[54][8];
+  int cv_stack_len;
+  uint64_t chunk_counter;
+  unsigned char block[64];
+  int block_len;
+  int blocks_compressed;
+} hash_blake3_t;
+
+typedef struct hash_s {
+  int algorithm;
+  EVP_MD_CTX *md5;
+  hash_blake3_t blake3;
+  struct XXH3_state_s *xxh3;
+} hash_t;
+
+// MMDB_HASH_XXH3 is fast but not collision resistant, and must not be used
+// for content addressing; anything keyed by one of these hashes has to
+// compare the bytes too
+int hash_init(hash_t *h, int algorithm);
+int hash_update(hash_t *h, const void *data, size_t len);
+int hash_final(hash_t *h, unsigned char *out, size_t len);
+int hash_oneshot(int algorithm, unsigned char *out, size_t out_len,
+                 const void *data, size_t len);
+
+const char *hash_name(int algorithm);
+int hash_parse(const char *name);
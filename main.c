@@ -7,25 +7,27 @@
 #include <yder.h>
 
 #include "mmdb.h"
-
-#define MAX_TOKENS 10
+#include "server.h"
 
 void usage(const char *cmd) {
   fprintf(stderr,
           "Usage: %s [-d file.db] [-p port] [-b address] [-l "
-          "none|error|warning|info|debug]\n",
+          "none|error|warning|info|debug] [-i file.ndjson|-] "
+          "[-e file.ndjson|-] [-f bits-per-id]\n",
           cmd);
 }
 
 int main(int argc, char **argv) {
-  int opt, rc, i;
+  int opt, rc;
   unsigned short port;
   char *bind;
   unsigned long log_level;
-  char *db_file;
+  char *db_file, *import_file, *export_file;
+  FILE *f;
+  size_t total;
   mmdb_t *db;
-  char line[1000 + MMDB_MAX_DATA_LENGTH];
-  char *tokens[MAX_TOKENS+1], *token, *token_ptr;
+  mmdb_open_options_t opts;
+  mmdb_stats_t stats;
 
   opt = 0;
   rc = 0;
@@ -33,11 +35,12 @@ int main(int argc, char **argv) {
   bind = "127.0.0.1";
   log_level = Y_LOG_LEVEL_WARNING;
   db_file = NULL;
+  import_file = NULL;
+  export_file = NULL;
   db = NULL;
-  memset(line, 0, sizeof(line));
-  memset(tokens, 0, sizeof(tokens));
+  memset(&opts, 0, sizeof(opts));
 
-  while ((opt = getopt(argc, argv, "l:d:p:b:")) != -1) {
+  while ((opt = getopt(argc, argv, "l:d:p:b:i:e:f:")) != -1) {
     switch (opt) {
       case 'l':
         if (strcmp(optarg, "none") == 0) {
@@ -64,6 +67,15 @@ int main(int argc, char **argv) {
       case 'b':
         bind = strdup(optarg);
         break;
+      case 'i':
+        import_file = strdup(optarg);
+        break;
+      case 'e':
+        export_file = strdup(optarg);
+        break;
+      case 'f':
+        opts.id_filter = atoi(optarg);
+        break;
       default:
         usage(argv[0]);
         exit(EXIT_FAILURE);
@@ -76,12 +88,65 @@ int main(int argc, char **argv) {
   }
 
   y_log_message(Y_LOG_LEVEL_DEBUG, "opening database");
-  if ((rc = mmdb_open(db_file, &db)) != MMDB_OK) {
+  if ((rc = mmdb_open_v2(db_file, &db, &opts)) != MMDB_OK) {
     y_log_message(Y_LOG_LEVEL_ERROR, "couldn't open database: rc=%d", rc);
     return 1;
   }
   y_log_message(Y_LOG_LEVEL_DEBUG, "opened database");
 
+  if (import_file != NULL) {
+    f = strcmp(import_file, "-") == 0 ? stdin : fopen(import_file, "r");
+    if (f == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "couldn't open %s", import_file);
+      return 1;
+    }
+
+    if ((rc = mmdb_import(db, f, sysconf(_SC_NPROCESSORS_ONLN), &total)) !=
+        MMDB_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR,
+                    "couldn't import documents: rc=%d after=%zu", rc, total);
+      return 1;
+    }
+    y_log_message(Y_LOG_LEVEL_INFO, "imported %zu documents", total);
+
+    if (f != stdin) {
+      fclose(f);
+    }
+  }
+
+  if (export_file != NULL) {
+    f = strcmp(export_file, "-") == 0 ? stdout : fopen(export_file, "w");
+    if (f == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "couldn't open %s", export_file);
+      return 1;
+    }
+
+    if ((rc = mmdb_export(db, f)) != MMDB_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "couldn't export documents: rc=%d",
+                    rc);
+      return 1;
+    }
+
+    if (f != stdout) {
+      fclose(f);
+    }
+  }
+
+  // exporting is a one-off; otherwise serve whatever's there now
+  if (export_file == NULL && (rc = server_run(db, bind, port)) != MMDB_OK) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "server failed: rc=%d", rc);
+  }
+
+  if (opts.id_filter > 0 && mmdb_stats(db, &stats) == MMDB_OK) {
+    y_log_message(Y_LOG_LEVEL_INFO,
+                  "id filter: %lld ids, %zu bytes, %lld of %lld lookups "
+                  "skipped, %lld false positives",
+                  (long long)stats.filter_ids, stats.filter_bytes,
+                  (long long)stats.filter_skipped,
+                  (long long)stats.filter_lookups,
+                  (long long)stats.filter_false_positives);
+  }
+
   y_log_message(Y_LOG_LEVEL_DEBUG, "closing database");
   while ((rc = mmdb_close(db)) == MMDB_BUSY) {
     y_log_message(Y_LOG_LEVEL_DEBUG, "database is busy while closing; waiting");
@@ -93,24 +158,5 @@ int main(int argc, char **argv) {
   }
   y_log_message(Y_LOG_LEVEL_DEBUG, "closed database");
 
-  while (fgets(line, sizeof(line), stdin) != NULL) {
-    printf("got line len=%ld\n", strlen(line));
-
-    for (token = &(line[0]); token != NULL; strsep(&token, " ")) {
-      tokens[i++] = token;
-
-      if (i >= MAX_TOKENS) {
-        break;
-      }
-    }
-    tokens[i] = NULL;
-
-    printf("token count: %d\n", i);
-
-    for (i = 0; i < MAX_TOKENS; i++) {
-      printf("token %d: %s\n", i, tokens[i]);
-    }
-  }
-
   return 0;
 }
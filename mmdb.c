@@ -1,18 +1,82 @@
+#include <errno.h>
 #include <jansson.h>
-#include <openssl/md5.h>
+#include <openssl/evp.h>
+#include <pthread.h>
 #include <sqlite3.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 
+#include "find.h"
+#include "hash.h"
 #include "mmdb.h"
+#include "patch.h"
+#include "presence.h"
 #include "q.h"
+#include "search.h"
+#include "subscribe.h"
+#include "view.h"
 
 #define MMDB_MIN(a, b) ((a < b) ? a : b)
 
+#define MMDB_ARENA_ALIGN(n) (((n) + 7) & ~((size_t)7))
+#define MMDB_ARENA_MIN_BLOCK 4096
+
+// direct-mapped, so a lookup is one hash and one compare
+#define MMDB_DOCID_CACHE_SIZE 4096
+
+typedef struct mmdb_docid_entry_s {
+  char id[MMDB_MAX_ID_LENGTH + 1];
+  sqlite3_int64 docid;
+  sqlite3_int64 expires;
+  // what mmdb_data_version said before the row was read
+  sqlite3_int64 data_version;
+} mmdb_docid_entry_t;
+
+struct mmdb_docids_s {
+  mmdb_docid_entry_t entries[MMDB_DOCID_CACHE_SIZE];
+};
+
+int mmdb_migrate(mmdb_t *db);
+int mmdb_meta_cb(sqlite3_stmt *stmt, void *ptr);
+int mmdb_put_tx(mmdb_t *db, mmdb_rev_t *out_rev, mmdb_doc_t *doc,
+                mmdb_put_options_t *opts);
+int mmdb_patch_tx(mmdb_t *db, mmdb_rev_t *out_rev, const char *id,
+                  mmdb_rev_t *base, int type, json_t *patch);
 int mmdb_put_new(mmdb_t *db, mmdb_rev_t *out_rev, mmdb_doc_t *doc,
                  mmdb_put_options_t *opts);
-int mmdb_put_update(mmdb_t *db, mmdb_rev_t *out_rev, mmdb_doc_t *doc,
-                    mmdb_rev_t *current_rev, mmdb_put_options_t *opts);
+int mmdb_put_update(mmdb_t *db, sqlite3_int64 docid, mmdb_rev_t *out_rev,
+                    mmdb_doc_t *doc, mmdb_rev_t *current_rev,
+                    mmdb_put_options_t *opts);
+int mmdb_put_attachments(mmdb_t *db, sqlite3_int64 docid, const char *rev,
+                         const char *parent, mmdb_put_options_t *opts);
+int mmdb_docid(mmdb_t *db, const char *id, sqlite3_int64 *docid);
+int mmdb_docid_lookup(mmdb_t *db, const char *id, mmdb_docid_entry_t *out);
+int mmdb_expire_doc(mmdb_t *db, sqlite3_int64 docid, const char *id);
+int mmdb_set_expires(mmdb_t *db, const char *id, sqlite3_int64 old,
+                     mmdb_put_options_t *opts);
+int mmdb_stem(mmdb_t *db, sqlite3_int64 docid);
+int mmdb_delta_store(mmdb_t *db, sqlite3_int64 docid, const char *parent_rev,
+                     const char *rev, json_t *fields);
+int mmdb_get_rev_delta(mmdb_t *db, mmdb_doc_t *out, sqlite3_int64 docid,
+                       const char *id, const char *rev);
+unsigned int mmdb_shard_hash(const char *id);
+int mmdb_load_meta(mmdb_t *db);
+int mmdb_configure(mmdb_t *db, mmdb_open_options_t *opts);
+int mmdb_report(mmdb_t *db, mmdb_open_options_t *opts);
+int mmdb_rev_hash(mmdb_rev_t *out, int algorithm, mmdb_doc_t *doc,
+                  const char *fields, size_t len, mmdb_attachment_t *atts,
+                  int atts_total);
+int mmdb_body_hash(mmdb_t *db, unsigned char *out, const char *fields,
+                   size_t len);
+int mmdb_doc_scan(sqlite3_stmt *stmt, mmdb_doc_t *out);
+int mmdb_doc_nset_id(mmdb_doc_t *doc, const char *id, size_t len);
+int mmdb_doc_nset_rev(mmdb_doc_t *doc, const char *rev, size_t len);
+void mmdb_body_hash_fn(sqlite3_context *ctx, int argc, sqlite3_value **argv);
 
 const char query_init[] =
     "create table if not exists meta (rev text not null);"
@@ -21,244 +85,3552 @@ const char query_init[] =
     "doc blob, leaf integer not null default 1, deleted integer not null "
     "default 0);";
 
+// each entry upgrades the schema by one version, tracked in user_version
+const char *migrations[] = {
+    // 1: attachments, stored once per digest and referenced by revisions
+    "create table if not exists attachments (digest blob not null unique, "
+    "length integer not null, data blob not null);"
+    "create table if not exists rev_attachments (id text not null, rev blob "
+    "not null, name text not null, type text not null, digest blob not null, "
+    "length integer not null);"
+    "create index if not exists rev_attachments_id_rev on rev_attachments "
+    "(id, rev, name);"
+    "create index if not exists rev_attachments_digest on rev_attachments "
+    "(digest);",
+    // 2: revision bodies, stored once per hash of the canonical body
+    "create table if not exists bodies (hash blob not null primary key, doc "
+    "blob not null, refs integer not null default 0);"
+    "insert into bodies (hash, doc, refs) select mmdb_body_hash(doc), doc, "
+    "count(*) from revs where doc is not null group by 1;"
+    "create table revs_new (id text not null, rev blob not null, body blob, "
+    "leaf integer not null default 1, deleted integer not null default 0);"
+    "insert into revs_new (id, rev, body, leaf, deleted) select id, rev, "
+    "mmdb_body_hash(doc), leaf, deleted from revs;"
+    "drop table revs;"
+    "alter table revs_new rename to revs;"
+    "create index if not exists revs_id_rev on revs (id, rev);",
+    // 3: meta becomes a key/value store for per-database settings
+    "drop table meta;"
+    "create table meta (key text not null primary key, value text not null);",
+    // 4: leaves ordered by seq so the winning revision can be picked by index
+    "alter table revs add column seq integer not null default 0;"
+    "update revs set seq = cast(rev as integer);"
+    "create index if not exists revs_id_leaf on revs (id, leaf, deleted, seq "
+    "desc, rev desc);"
+    "create index if not exists docs_id on docs (id);"
+    "update docs set rev = (select rev from revs r where r.id = docs.id and "
+    "r.leaf = 1 order by r.deleted, r.seq desc, r.rev desc limit 1) where "
+    "exists (select 1 from revs r where r.id = docs.id and r.leaf = 1);",
+    // 5: documents get an integer key, and revisions and attachments refer to
+    // that instead of repeating the id
+    "create table docs_new (docid integer primary key autoincrement, id text "
+    "not null unique, rev blob not null);"
+    "insert into docs_new (id, rev) select id, rev from docs order by id;"
+    "create table revs_new (docid integer not null, rev blob not null, seq "
+    "integer not null default 0, body blob, leaf integer not null default 1, "
+    "deleted integer not null default 0);"
+    "insert into revs_new (docid, rev, seq, body, leaf, deleted) select "
+    "d.docid, r.rev, r.seq, r.body, r.leaf, r.deleted from revs r join "
+    "docs_new d on d.id = r.id;"
+    "create table rev_attachments_new (docid integer not null, rev blob not "
+    "null, name text not null, type text not null, digest blob not null, "
+    "length integer not null);"
+    "insert into rev_attachments_new (docid, rev, name, type, digest, length) "
+    "select d.docid, a.rev, a.name, a.type, a.digest, a.length from "
+    "rev_attachments a join docs_new d on d.id = a.id;"
+    "drop table docs;"
+    "drop table revs;"
+    "drop table rev_attachments;"
+    "alter table docs_new rename to docs;"
+    "alter table revs_new rename to revs;"
+    "alter table rev_attachments_new rename to rev_attachments;"
+    "create index revs_docid_rev on revs (docid, rev);"
+    "create index revs_docid_leaf on revs (docid, leaf, deleted, seq desc, "
+    "rev desc);"
+    "create index rev_attachments_docid_rev on rev_attachments (docid, rev, "
+    "name);"
+    "create index rev_attachments_digest on rev_attachments (digest);",
+    // 6: older revisions may be stored as a merge patch against the revision
+    // that replaced them; chain counts the deltas that lead to a revision
+    "alter table revs add column delta blob;"
+    "alter table revs add column base blob;"
+    "alter table revs add column chain integer not null default 0;",
+    // 7: lets a field index on bodies lead back to the revisions using them
+    "create index if not exists revs_body on revs (body);",
+    // 8: full-text indexes, each a list of fields backed by an fts5 table
+    "create table if not exists search_indexes (name text not null primary "
+    "key, fields text not null);",
+    // 9: aggregate views, with running totals per group and a count of each
+    // distinct value so min and max can be kept up to date
+    "create table if not exists views (name text not null primary key, key "
+    "text not null, value text);"
+    "create table if not exists view_groups (view text not null, key not "
+    "null, count integer not null, n integer not null, sum not null, primary "
+    "key (view, key));"
+    "create index if not exists view_groups_empty on view_groups (view) where "
+    "count <= 0;"
+    "create table if not exists view_values (view text not null, key not "
+    "null, value not null, count integer not null, primary key (view, key, "
+    "value));"
+    "create index if not exists view_values_empty on view_values (view) where "
+    "count <= 0;",
+    // 10: each revision remembers the one it was written over, so ancestry
+    // can be walked through revs_docid_rev
+    "alter table revs add column parent blob;",
+    // 11: documents may expire, and only the ones that can are indexed
+    "alter table docs add column expires integer;"
+    "create index if not exists docs_expires on docs (expires) where expires "
+    "is not null;",
+    NULL};
+
+const char query_version[] = "pragma user_version";
+
+const char query_journal_mode[] = "pragma journal_mode";
+
+const char query_synchronous[] = "pragma synchronous";
+
+const char query_cache_size[] = "pragma cache_size";
+
+const char query_mmap_size[] = "pragma mmap_size";
+
+const char query_page_size[] = "pragma page_size";
+
+const char query_busy_timeout[] = "pragma busy_timeout";
+
+const char query_meta_get[] = "select value from meta where key = $1";
+
+const char query_meta_set[] =
+    "insert or replace into meta (key, value) values ($1, $2)";
+
+const char query_has_revs[] = "select 1 from revs limit 1";
+
+const char query_view[] =
+    "select g.key, g.count, g.n, g.sum, (select min(value) from view_values v "
+    "where v.view = g.view and v.key = g.key), (select max(value) from "
+    "view_values v where v.view = g.view and v.key = g.key) from view_groups g "
+    "where g.view = $1 order by g.key";
+
+const char query_snapshot_begin[] =
+    "begin; select count(*) from sqlite_master";
+
+const char query_snapshot_end[] = "commit";
+
+const char query_snapshot_open[] = "begin";
+
+const char query_snapshot_abort[] = "rollback";
+
+const char query_scan[] =
+    "select d.id, r.rev, b.doc from docs d join revs r on r.docid = d.docid "
+    "and r.rev = d.rev join bodies b on b.hash = r.body where d.id >= $1 "
+    "order by d.id limit $2";
+
+const char query_has_docs[] = "select 1 from docs limit 1";
+
+// dropped while bulk loading an empty database and rebuilt in one pass after
+const char query_import_drop_indexes[] =
+    "drop index if exists revs_docid_rev;"
+    "drop index if exists revs_docid_leaf;";
+
+const char query_import_create_indexes[] =
+    "create index if not exists revs_docid_rev on revs (docid, rev);"
+    "create index if not exists revs_docid_leaf on revs (docid, leaf, "
+    "deleted, seq desc, rev desc);";
+
+// a hash only names a body once the bytes match too, since md5 and xxh3
+// collisions can be made on purpose; a match that's a different body
+// changes nothing, and the write fails rather than sharing it
+const char query_import_body[] =
+    "insert into bodies (hash, doc, refs) values ($1, $2, 1) on conflict "
+    "(hash) do update set refs = refs + 1 where cast(doc as blob) = "
+    "cast(excluded.doc as blob)";
+
+const char query_begin[] = "savepoint mmdb";
+
+const char query_commit[] = "release mmdb";
+
+const char query_rollback[] = "rollback to mmdb; release mmdb";
+
+const char query_docid[] = "select docid, expires from docs where id = $1";
+
+const char query_set_expires[] =
+    "update docs set expires = nullif($1, 0) where id = $2";
+
+// oldest expiry first, through docs_expires
+const char query_expired[] =
+    "select docid, id from docs where expires <= $1 order by expires limit $2";
+
+const char query_expire_unref_bodies[] =
+    "update bodies set refs = refs - (select count(*) from revs where docid = "
+    "$1 and body = bodies.hash) where hash in (select body from revs where "
+    "docid = $1)";
+
+const char query_expire_delete_bodies[] =
+    "delete from bodies where refs <= 0 and hash in (select body from revs "
+    "where docid = $1)";
+
+const char query_expire_attachments[] =
+    "delete from attachments where digest in (select digest from "
+    "rev_attachments where docid = $1) and not exists (select 1 from "
+    "rev_attachments o where o.digest = attachments.digest and o.docid != $1)";
+
+const char query_expire_rev_attachments[] =
+    "delete from rev_attachments where docid = $1";
+
+const char query_expire_revs[] = "delete from revs where docid = $1";
+
+const char query_expire_doc[] = "delete from docs where docid = $1";
+
 const char query_get[] =
-    "select r.id, r.rev, r.doc from docs d left join revs r on r.id = d.id and "
-    "r.rev = d.rev where d.id = $1";
+    "select d.id, r.rev, b.doc from docs d left join revs r on r.docid = "
+    "d.docid and r.rev = d.rev left join bodies b on b.hash = r.body where "
+    "d.docid = $1";
 
 const char query_get_rev[] =
-    "select id, rev, doc from revs where id = $1 and rev = $2";
+    "select d.id, r.rev, b.doc from revs r join docs d on d.docid = r.docid "
+    "join bodies b on b.hash = r.body where r.docid = $1 and r.rev = $2";
+
+// leaves in winning order: live before deleted, then highest seq, then highest
+// hash, so every replica picks the same winner without coordinating
+const char query_get_leaves[] =
+    "select d.id, r.rev, b.doc, r.deleted from revs r join docs d on d.docid "
+    "= r.docid left join bodies b on b.hash = r.body where r.docid = $1 and "
+    "r.leaf = 1 order by r.deleted, r.seq desc, r.rev desc";
 
 const char query_revs[] =
-    "select rev from revs where id = $1 and leaf = 1 and deleted = 0";
+    "select rev from revs where docid = $1 and leaf = 1 and deleted = 0";
 
-const char query_rev[] = "select rev from docs where id = $1";
+const char query_rev[] = "select rev from docs where docid = $1";
 
 const char query_insert_rev[] =
-    "insert into revs (id, rev, doc) values ($1, $2, $3);";
+    "insert into revs (docid, rev, seq, body, parent) values ($1, $2, cast($2 "
+    "as integer), $3, nullif($4, ''));";
+
+const char query_ref_body[] =
+    "update bodies set refs = refs + 1 where hash = $1 and cast(doc as blob) = "
+    "cast($2 as blob)";
+
+const char query_insert_body[] =
+    "insert into bodies (hash, doc, refs) values ($1, $2, 1)";
+
+const char query_compact[] =
+    "create temp table mmdb_compact (hash blob primary key, n integer);"
+    "insert into temp.mmdb_compact (hash, n) select body, count(*) from revs "
+    "where leaf = 0 and body is not null group by body;"
+    "update bodies set refs = refs - (select n from temp.mmdb_compact c where "
+    "c.hash = bodies.hash) where hash in (select hash from "
+    "temp.mmdb_compact);"
+    "update revs set body = null where leaf = 0 and body is not null;"
+    "update revs set delta = null, base = null, chain = 0 where delta is not "
+    "null or chain != 0;"
+    "delete from bodies where refs <= 0;"
+    "drop table temp.mmdb_compact;";
+
+const char query_delta_parent[] =
+    "select r.body, r.chain, b.doc from revs r join bodies b on b.hash = "
+    "r.body where r.docid = $1 and r.rev = $2 and r.leaf = 1";
+
+const char query_delta_store[] =
+    "update revs set body = null, delta = $1, base = $2 where docid = $3 and "
+    "rev = $4";
+
+const char query_delta_chain[] =
+    "update revs set chain = max(chain, $1) where docid = $2 and rev = $3";
+
+const char query_unref_body[] =
+    "update bodies set refs = refs - 1 where hash = $1";
+
+const char query_delete_body[] =
+    "delete from bodies where hash = $1 and refs <= 0";
+
+const char query_get_delta[] =
+    "select b.doc, r.delta, r.base from revs r left join bodies b on b.hash = "
+    "r.body where r.docid = $1 and r.rev = $2";
+
+// newest first, following parent links until they run out
+const char query_rev_history[] =
+    "with recursive h(rev, parent, n) as (select rev, parent, 0 from revs "
+    "where docid = $1 and rev = $2 union all select r.rev, r.parent, h.n + 1 "
+    "from h join revs r on r.docid = $1 and r.rev = h.parent) select rev from "
+    "h order by n";
+
+const char query_rev_history_current[] =
+    "with recursive h(rev, parent, n) as (select rev, parent, 0 from revs "
+    "where docid = $1 and rev = (select rev from docs where docid = $1) union "
+    "all select r.rev, r.parent, h.n + 1 from h join revs r on r.docid = $1 "
+    "and r.rev = h.parent) select rev from h order by n";
+
+// revisions at least $2 generations behind every leaf that descends from
+// them, apart from any a surviving delta is still built on
+const char query_stem[] =
+    "with recursive a(rev, n) as (select rev, 0 from revs where docid = $1 "
+    "and leaf = 1 union all select r.parent, a.n + 1 from a join revs r on "
+    "r.docid = $1 and r.rev = a.rev where r.parent is not null), old(rev) as "
+    "(select rev from a group by rev having min(n) >= $2), need(rev) as "
+    "(select base from revs where docid = $1 and base is not null and rev not "
+    "in (select rev from old) union select r.base from need join revs r on "
+    "r.docid = $1 and r.rev = need.rev where r.base is not null) select rev "
+    "from revs where docid = $1 and rev in (select rev from old) and rev not "
+    "in (select rev from need)";
+
+const char query_stem_unref_body[] =
+    "update bodies set refs = refs - 1 where hash = (select body from revs "
+    "where docid = $1 and rev = $2)";
+
+const char query_stem_delete_body[] =
+    "delete from bodies where refs <= 0 and hash = (select body from revs "
+    "where docid = $1 and rev = $2)";
+
+const char query_stem_attachments[] =
+    "delete from attachments where digest in (select digest from "
+    "rev_attachments where docid = $1 and rev = $2) and not exists (select 1 "
+    "from rev_attachments o where o.digest = attachments.digest and "
+    "(o.docid != $1 or o.rev != $2))";
+
+const char query_stem_rev_attachments[] =
+    "delete from rev_attachments where docid = $1 and rev = $2";
+
+const char query_stem_rev[] = "delete from revs where docid = $1 and rev = $2";
 
 const char query_insert_doc[] = "insert into docs (id, rev) values ($1, $2);";
 
 const char query_remove_leaf[] =
-    "update revs set leaf = 0 where id = $1 and rev = $2";
+    "update revs set leaf = 0 where docid = $1 and rev = $2";
+
+const char query_update_doc[] =
+    "update docs set rev = (select rev from revs where docid = $1 and leaf = 1 "
+    "order by deleted, seq desc, rev desc limit 1) where docid = $1";
+
+const char query_copy_attachments[] =
+    "insert into rev_attachments (docid, rev, name, type, digest, length) "
+    "select docid, $1, name, type, digest, length from rev_attachments where "
+    "docid = $2 and rev = $3";
+
+const char query_remove_rev_attachment[] =
+    "delete from rev_attachments where docid = $1 and rev = $2 and name = $3";
+
+const char query_insert_rev_attachment[] =
+    "insert into rev_attachments (docid, rev, name, type, digest, length) "
+    "values ($1, $2, $3, $4, $5, $6)";
+
+// as with bodies, a digest that's already stored for different bytes isn't
+// found, and inserting them trips the unique constraint
+const char query_has_attachment[] =
+    "select 1 from attachments where digest = $1 and length = $2 and data = "
+    "$3";
+
+const char query_insert_attachment[] =
+    "insert into attachments (digest, length, data) values ($1, $2, $3)";
+
+const char query_attachments[] =
+    "select name, type, digest, length from rev_attachments where docid = $1 "
+    "and rev = $2 order by name";
+
+const char query_attachments_current[] =
+    "select name, type, digest, length from rev_attachments where docid = $1 "
+    "and rev = (select rev from docs where docid = $1) order by name";
+
+const char query_attachment_open[] =
+    "select a.rowid, a.length from rev_attachments r join attachments a on "
+    "a.digest = r.digest where r.docid = $1 and r.rev = $2 and r.name = $3";
+
+const char query_attachment_open_current[] =
+    "select a.rowid, a.length from rev_attachments r join attachments a on "
+    "a.digest = r.digest where r.docid = $1 and r.rev = (select rev from docs "
+    "where docid = $1) and r.name = $2";
+
+int mmdb_open(const char *filename, mmdb_t **db) {
+  return mmdb_open_v2(filename, db, NULL);
+}
+
+int mmdb_open_v2(const char *filename, mmdb_t **db,
+                 mmdb_open_options_t *opts) {
+  mmdb_t *r = NULL;
+  int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+
+  if (opts != NULL && opts->read_only) {
+    flags = SQLITE_OPEN_READONLY;
+  }
+
+  r = malloc(sizeof(mmdb_t));
+  memset(r, 0, sizeof(mmdb_t));
+
+  if (sqlite3_open_v2(filename, &r->db, flags, NULL) != SQLITE_OK) {
+    return MMDB_ERROR;
+  }
+
+  // page_size has to be in place before the first table is created
+  if (opts != NULL && mmdb_configure(r, opts) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (sqlite3_create_function_v2(r->db, "mmdb_body_hash", 1,
+                                 SQLITE_UTF8 | SQLITE_DETERMINISTIC, r,
+                                 mmdb_body_hash_fn, NULL, NULL,
+                                 NULL) != SQLITE_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (!sqlite3_db_readonly(r->db, "main") &&
+      sqlite3_exec(r->db, query_init, NULL, NULL, NULL) != SQLITE_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (mmdb_migrate(r) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (mmdb_load_meta(r) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (mmdb_subs_new(r) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (search_load(r) != MMDB_OK || view_load(r) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (presence_load(r, opts != NULL ? opts->id_filter : 0) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (opts != NULL && mmdb_report(r, opts) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  r->open = 1;
+  *db = r;
+
+  return MMDB_OK;
+}
+
+// stable across processes and platforms, since it decides which file a
+// document lives in
+unsigned int mmdb_shard_hash(const char *id) {
+  unsigned int h = 2166136261u;
+
+  for (; *id != 0; id++) {
+    h = (h ^ (unsigned char)*id) * 16777619u;
+  }
+
+  return h;
+}
+
+mmdb_t *mmdb_shard(mmdb_t *db, const char *id) {
+  if (db->shards == NULL) {
+    return db;
+  }
+
+  return db->shards[mmdb_shard_hash(id) % db->shards_total];
+}
+
+int mmdb_open_sharded(const char *dir, int n, mmdb_t **db,
+                      mmdb_open_options_t *opts) {
+  mmdb_t *r = NULL;
+  char filename[4096], value[MMDB_MAX_NAME_LENGTH], count[16];
+  int i;
+
+  if (n <= 0 || (mkdir(dir, 0755) != 0 && errno != EEXIST)) {
+    return MMDB_ERROR;
+  }
+
+  r = malloc(sizeof(mmdb_t));
+  memset(r, 0, sizeof(mmdb_t));
+
+  if ((r->shards = calloc(n, sizeof(mmdb_t *))) == NULL) {
+    free(r);
+    return MMDB_ERROR;
+  }
+  r->shards_total = n;
+  r->open = 1;
+
+  snprintf(count, sizeof(count), "%d", n);
+
+  for (i = 0; i < n; i++) {
+    snprintf(filename, sizeof(filename), "%s/shard-%d.db", dir, i);
+
+    if (mmdb_open_v2(filename, &r->shards[i], opts) != MMDB_OK) {
+      mmdb_close(r);
+      return MMDB_ERROR;
+    }
+
+    // reopening with a different count would route ids to the wrong files
+    if (q_exec1(r->shards[i]->db, query_meta_get, value, mmdb_meta_cb, "s",
+                "shards") != MMDB_OK ||
+        (strlen(value) > 0 && strcmp(value, count) != 0) ||
+        (strlen(value) == 0 &&
+         q_exec0(r->shards[i]->db, query_meta_set, "ss", "shards", count) !=
+             MMDB_OK)) {
+      mmdb_close(r);
+      return MMDB_ERROR;
+    }
+  }
+
+  r->hash = r->shards[0]->hash;
+  *db = r;
+
+  return MMDB_OK;
+}
+
+int mmdb_begin(mmdb_t *db) {
+  if (db->shards != NULL) {
+    return MMDB_ERROR;
+  }
+
+  // a transaction committed directly through sqlite can't be seen finishing,
+  // so its changes go out as soon as the handle is used again
+  if (sqlite3_get_autocommit(db->db)) {
+    mmdb_subs_settle(db, 1);
+  }
+
+  if (sqlite3_exec(db->db, query_begin, NULL, NULL, NULL) != SQLITE_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (mmdb_subs_begin(db) != MMDB_OK) {
+    sqlite3_exec(db->db, query_rollback, NULL, NULL, NULL);
+    mmdb_subs_settle(db, 0);
+    return MMDB_ERROR;
+  }
+
+  return MMDB_OK;
+}
+
+int mmdb_commit(mmdb_t *db) {
+  if (sqlite3_exec(db->db, query_commit, NULL, NULL, NULL) != SQLITE_OK) {
+    mmdb_subs_settle(db, 0);
+    return MMDB_ERROR;
+  }
+
+  mmdb_subs_end(db, 1);
+  mmdb_subs_settle(db, 1);
+
+  return MMDB_OK;
+}
+
+int mmdb_rollback(mmdb_t *db) {
+  int rc = sqlite3_exec(db->db, query_rollback, NULL, NULL, NULL);
+
+  mmdb_subs_end(db, 0);
+  mmdb_subs_settle(db, 0);
+
+  return rc == SQLITE_OK ? MMDB_OK : MMDB_ERROR;
+}
+
+// reads inside a snapshot all see the database as of its first read; with a
+// wal journal this doesn't block writers on other handles
+int mmdb_snapshot_begin(mmdb_t *db) {
+  int i;
+
+  // each shard is pinned separately, so this is only per-shard consistent
+  for (i = 0; i < db->shards_total; i++) {
+    if (mmdb_snapshot_begin(db->shards[i]) != MMDB_OK) {
+      for (i--; i >= 0; i--) {
+        mmdb_snapshot_end(db->shards[i]);
+      }
+      return MMDB_ERROR;
+    }
+  }
+
+  if (db->shards != NULL) {
+    return MMDB_OK;
+  }
+
+  if (sqlite3_exec(db->db, query_snapshot_begin, NULL, NULL, NULL) !=
+      SQLITE_OK) {
+    return MMDB_ERROR;
+  }
+
+  return MMDB_OK;
+}
+
+int mmdb_snapshot_end(mmdb_t *db) {
+  int i, failed = 0;
+
+  for (i = 0; i < db->shards_total; i++) {
+    if (mmdb_snapshot_end(db->shards[i]) != MMDB_OK) {
+      failed = 1;
+    }
+  }
+
+  if (db->shards != NULL) {
+    return failed ? MMDB_ERROR : MMDB_OK;
+  }
+
+  if (sqlite3_exec(db->db, query_snapshot_end, NULL, NULL, NULL) !=
+      SQLITE_OK) {
+    mmdb_subs_settle(db, 0);
+    return MMDB_ERROR;
+  }
+
+  mmdb_subs_settle(db, 1);
+
+  return MMDB_OK;
+}
+
+// exporting and importing snapshots needs sqlite built with
+// SQLITE_ENABLE_SNAPSHOT; without it these always fail
+int mmdb_snapshot_get(mmdb_t *db, mmdb_snapshot_t **out) {
+#ifdef SQLITE_ENABLE_SNAPSHOT
+  if (db->shards != NULL) {
+    return MMDB_ERROR;
+  }
+
+  if (sqlite3_snapshot_get(db->db, "main", out) != SQLITE_OK) {
+    return MMDB_ERROR;
+  }
+
+  return MMDB_OK;
+#else
+  return MMDB_ERROR;
+#endif
+}
+
+int mmdb_snapshot_open(mmdb_t *db, mmdb_snapshot_t *snapshot) {
+#ifdef SQLITE_ENABLE_SNAPSHOT
+  if (db->shards != NULL) {
+    return MMDB_ERROR;
+  }
+
+  if (sqlite3_exec(db->db, query_snapshot_open, NULL, NULL, NULL) != SQLITE_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (sqlite3_snapshot_open(db->db, "main", snapshot) != SQLITE_OK) {
+    sqlite3_exec(db->db, query_snapshot_abort, NULL, NULL, NULL);
+    return MMDB_ERROR;
+  }
+
+  return MMDB_OK;
+#else
+  return MMDB_ERROR;
+#endif
+}
+
+void mmdb_snapshot_free(mmdb_snapshot_t *snapshot) {
+#ifdef SQLITE_ENABLE_SNAPSHOT
+  sqlite3_snapshot_free(snapshot);
+#endif
+}
+
+int mmdb_version_cb(sqlite3_stmt *stmt, void *ptr) {
+  int *version = ptr;
+
+  if (stmt == NULL) {
+    *version = 0;
+    return MMDB_OK;
+  }
+
+  return q_scan(stmt, "i", version);
+}
+
+int mmdb_migrate(mmdb_t *db) {
+  int version = 0, latest = 0;
+  char sql[64];
+
+  while (migrations[latest] != NULL) {
+    latest++;
+  }
+
+  if (q_exec1(db->db, query_version, &version, mmdb_version_cb, "") !=
+      MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  // written by a newer version of mmdb
+  if (version > latest) {
+    return MMDB_ERROR;
+  }
+
+  // a read-only handle can't bring an old file up to date
+  if (version < latest && sqlite3_db_readonly(db->db, "main")) {
+    return MMDB_ERROR;
+  }
+
+  for (; version < latest; version++) {
+    snprintf(sql, sizeof(sql), "pragma user_version = %d", version + 1);
 
-const char query_update_doc[] = "update docs set rev = $1 where id = $2";
+    if (mmdb_begin(db) != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+
+    if (sqlite3_exec(db->db, migrations[version], NULL, NULL, NULL) !=
+            SQLITE_OK ||
+        sqlite3_exec(db->db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+      mmdb_rollback(db);
+      return MMDB_ERROR;
+    }
+
+    if (mmdb_commit(db) != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+  }
+
+  return MMDB_OK;
+}
+
+int mmdb_pragma(mmdb_t *db, const char *name, const char *value) {
+  char *sql = NULL;
+  int rc;
+
+  if ((sql = sqlite3_mprintf("pragma %s = %Q", name, value)) == NULL) {
+    return MMDB_ERROR;
+  }
+
+  rc = sqlite3_exec(db->db, sql, NULL, NULL, NULL);
+  sqlite3_free(sql);
+
+  return rc == SQLITE_OK ? MMDB_OK : MMDB_ERROR;
+}
+
+int mmdb_pragma_int(mmdb_t *db, const char *name, sqlite3_int64 value) {
+  char sql[128];
+
+  snprintf(sql, sizeof(sql), "pragma %s = %lld", name, (long long)value);
+
+  if (sqlite3_exec(db->db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+    return MMDB_ERROR;
+  }
+
+  return MMDB_OK;
+}
+
+int mmdb_configure(mmdb_t *db, mmdb_open_options_t *opts) {
+  if (opts->busy_timeout > 0 &&
+      sqlite3_busy_timeout(db->db, opts->busy_timeout) != SQLITE_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (opts->page_size > 0 &&
+      mmdb_pragma_int(db, "page_size", opts->page_size) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (strlen(opts->journal_mode) > 0 &&
+      mmdb_pragma(db, "journal_mode", opts->journal_mode) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (strlen(opts->synchronous) > 0 &&
+      mmdb_pragma(db, "synchronous", opts->synchronous) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (opts->cache_size != 0 &&
+      mmdb_pragma_int(db, "cache_size", opts->cache_size) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  // reads of mapped pages are served straight from the mapping instead of
+  // being copied into the page cache first
+  if (opts->mmap_size > 0 &&
+      mmdb_pragma_int(db, "mmap_size", opts->mmap_size) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (opts->delta_chain > 0) {
+    db->delta_chain = opts->delta_chain < MMDB_MAX_DELTA_CHAIN
+                          ? opts->delta_chain
+                          : MMDB_MAX_DELTA_CHAIN;
+  }
+
+  return MMDB_OK;
+}
+
+int mmdb_report_str_cb(sqlite3_stmt *stmt, void *ptr) {
+  char *value = ptr;
+
+  if (stmt == NULL) {
+    value[0] = 0;
+    return MMDB_OK;
+  }
+
+  return q_scan(stmt, "s", value, MMDB_MAX_PRAGMA_LENGTH);
+}
+
+int mmdb_report_int_cb(sqlite3_stmt *stmt, void *ptr) {
+  sqlite3_int64 *value = ptr;
+
+  if (stmt == NULL) {
+    *value = 0;
+    return MMDB_OK;
+  }
+
+  return q_scan(stmt, "l", value);
+}
+
+// overwrites the options with the settings sqlite actually ended up using,
+// since it silently ignores values it can't honour
+int mmdb_report(mmdb_t *db, mmdb_open_options_t *opts) {
+  static const char *synchronous[] = {"off", "normal", "full", "extra"};
+  sqlite3_int64 v = 0;
+
+  if (q_exec1(db->db, query_journal_mode, opts->journal_mode,
+              mmdb_report_str_cb, "") != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (q_exec1(db->db, query_synchronous, &v, mmdb_report_int_cb, "") !=
+          MMDB_OK ||
+      v < 0 || v > 3) {
+    return MMDB_ERROR;
+  }
+  snprintf(opts->synchronous, sizeof(opts->synchronous), "%s",
+           synchronous[v]);
+
+  if (q_exec1(db->db, query_cache_size, &v, mmdb_report_int_cb, "") !=
+      MMDB_OK) {
+    return MMDB_ERROR;
+  }
+  opts->cache_size = v;
+
+  if (q_exec1(db->db, query_mmap_size, &v, mmdb_report_int_cb, "") !=
+      MMDB_OK) {
+    return MMDB_ERROR;
+  }
+  opts->mmap_size = v;
+
+  if (q_exec1(db->db, query_page_size, &v, mmdb_report_int_cb, "") !=
+      MMDB_OK) {
+    return MMDB_ERROR;
+  }
+  opts->page_size = v;
+
+  if (q_exec1(db->db, query_busy_timeout, &v, mmdb_report_int_cb, "") !=
+      MMDB_OK) {
+    return MMDB_ERROR;
+  }
+  opts->busy_timeout = v;
+
+  opts->read_only = sqlite3_db_readonly(db->db, "main") == 1;
+  opts->delta_chain = db->delta_chain;
+  opts->id_filter = presence_bits_per_id(db);
+
+  return MMDB_OK;
+}
+
+int mmdb_meta_cb(sqlite3_stmt *stmt, void *ptr) {
+  char *value = ptr;
+
+  if (stmt == NULL) {
+    value[0] = 0;
+    return MMDB_OK;
+  }
+
+  return q_scan(stmt, "s", value, MMDB_MAX_NAME_LENGTH);
+}
+
+int mmdb_load_meta(mmdb_t *db) {
+  char value[MMDB_MAX_NAME_LENGTH];
+
+  if (q_exec1(db->db, query_meta_get, value, mmdb_meta_cb, "s", "hash") !=
+      MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  // databases that predate the setting always used md5
+  if (strlen(value) == 0) {
+    db->hash = MMDB_HASH_MD5;
+  } else if ((db->hash = hash_parse(value)) < 0) {
+    return MMDB_ERROR;
+  }
+
+  if (q_exec1(db->db, query_meta_get, value, mmdb_meta_cb, "s",
+              "revs_limit") != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+  db->revs_limit = atoi(value);
+
+  return MMDB_OK;
+}
+
+int mmdb_exists_cb(sqlite3_stmt *stmt, void *ptr) {
+  int *found = ptr;
+
+  *found = stmt != NULL;
+
+  return MMDB_OK;
+}
+
+int mmdb_set_hash(mmdb_t *db, int hash) {
+  int found = 0, i;
+
+  if (hash_name(hash) == NULL) {
+    return MMDB_ERROR;
+  }
+
+  for (i = 0; i < db->shards_total; i++) {
+    if (mmdb_set_hash(db->shards[i], hash) != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+  }
+
+  if (db->shards != NULL) {
+    db->hash = hash;
+    return MMDB_OK;
+  }
+
+  // revisions and bodies are keyed by hash, so it can't change after the fact
+  if (q_exec1(db->db, query_has_revs, &found, mmdb_exists_cb, "") !=
+      MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (found) {
+    return db->hash == hash ? MMDB_OK : MMDB_ERROR;
+  }
+
+  if (q_exec0(db->db, query_meta_set, "ss", "hash", hash_name(hash)) !=
+      MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  db->hash = hash;
+
+  return MMDB_OK;
+}
+
+// how many generations of ancestry each branch of a document keeps, with zero
+// (the default) keeping everything; it takes effect on each document the
+// next time it's written
+int mmdb_set_revs_limit(mmdb_t *db, int limit) {
+  char value[16];
+  int i;
+
+  if (limit < 0) {
+    return MMDB_ERROR;
+  }
+
+  for (i = 0; i < db->shards_total; i++) {
+    if (mmdb_set_revs_limit(db->shards[i], limit) != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+  }
+
+  if (db->shards == NULL) {
+    snprintf(value, sizeof(value), "%d", limit);
+    if (q_exec0(db->db, query_meta_set, "ss", "revs_limit", value) !=
+        MMDB_OK) {
+      return MMDB_ERROR;
+    }
+  }
+
+  db->revs_limit = limit;
+
+  return MMDB_OK;
+}
+
+int mmdb_stats(mmdb_t *db, mmdb_stats_t *out) {
+  int i;
+
+  memset(out, 0, sizeof(mmdb_stats_t));
+
+  if (db->shards == NULL) {
+    presence_stats(db, out);
+  }
+
+  for (i = 0; i < db->shards_total; i++) {
+    presence_stats(db->shards[i], out);
+  }
+
+  return MMDB_OK;
+}
+
+// copies the database a few pages at a time, so writers only wait for one
+// step at a time; sqlite restarts the copy itself if another connection
+// writes in between, and a sharded database is copied into a directory
+int mmdb_backup(mmdb_t *db, const char *dest, int pages_per_step,
+                mmdb_backup_cb cb, void *ptr) {
+  sqlite3 *out = NULL;
+  sqlite3_backup *backup = NULL;
+  char filename[4096];
+  int i, rc, failed = 0;
+
+  if (db->shards != NULL) {
+    if (mkdir(dest, 0755) != 0 && errno != EEXIST) {
+      return MMDB_ERROR;
+    }
+
+    for (i = 0; i < db->shards_total; i++) {
+      snprintf(filename, sizeof(filename), "%s/shard-%d.db", dest, i);
+
+      if ((rc = mmdb_backup(db->shards[i], filename, pages_per_step, cb,
+                            ptr)) != MMDB_OK) {
+        return rc;
+      }
+    }
+
+    return MMDB_OK;
+  }
+
+  if (pages_per_step <= 0) {
+    pages_per_step = -1;
+  }
+
+  if (sqlite3_open(dest, &out) != SQLITE_OK) {
+    sqlite3_close(out);
+    return MMDB_ERROR;
+  }
+
+  if ((backup = sqlite3_backup_init(out, "main", db->db, "main")) == NULL) {
+    sqlite3_close(out);
+    return MMDB_ERROR;
+  }
+
+  while (1) {
+    rc = sqlite3_backup_step(backup, pages_per_step);
+
+    if (rc == SQLITE_DONE) {
+      break;
+    }
+
+    if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+      sqlite3_sleep(10);
+      continue;
+    }
+
+    if (rc != SQLITE_OK) {
+      failed = 1;
+      break;
+    }
+
+    if (cb != NULL && cb(sqlite3_backup_remaining(backup),
+                         sqlite3_backup_pagecount(backup), ptr) != MMDB_OK) {
+      failed = 1;
+      break;
+    }
+  }
+
+  if (sqlite3_backup_finish(backup) != SQLITE_OK) {
+    failed = 1;
+  }
+
+  if (sqlite3_close(out) != SQLITE_OK) {
+    failed = 1;
+  }
+
+  return failed ? MMDB_ERROR : MMDB_OK;
+}
+
+int mmdb_checkpoint(mmdb_t *db, int mode, int *log, int *checkpointed) {
+  int i, rc, n_log = 0, n_done = 0, total_log = 0, total_done = 0;
+
+  for (i = 0; i < db->shards_total; i++) {
+    if ((rc = mmdb_checkpoint(db->shards[i], mode, &n_log, &n_done)) !=
+        MMDB_OK) {
+      return rc;
+    }
+
+    total_log += n_log;
+    total_done += n_done;
+  }
+
+  if (db->shards == NULL) {
+    switch (sqlite3_wal_checkpoint_v2(db->db, NULL, mode, &total_log,
+                                      &total_done)) {
+      case SQLITE_OK:
+        break;
+      case SQLITE_BUSY:
+        return MMDB_BUSY;
+      default:
+        return MMDB_ERROR;
+    }
+  }
+
+  if (log != NULL) {
+    *log = total_log;
+  }
+
+  if (checkpointed != NULL) {
+    *checkpointed = total_done;
+  }
+
+  return MMDB_OK;
+}
+
+int mmdb_compact(mmdb_t *db) {
+  int i;
+
+  for (i = 0; i < db->shards_total; i++) {
+    if (mmdb_compact(db->shards[i]) != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+  }
+
+  if (db->shards != NULL) {
+    return MMDB_OK;
+  }
+
+  if (mmdb_begin(db) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (sqlite3_exec(db->db, query_compact, NULL, NULL, NULL) != SQLITE_OK) {
+    mmdb_rollback(db);
+    return MMDB_ERROR;
+  }
+
+  return mmdb_commit(db);
+}
+
+int mmdb_close(mmdb_t *db) {
+  int rc;
+
+  if (db == NULL) {
+    return MMDB_OK;
+  }
+
+  if (db->open == 0) {
+    return MMDB_OK;
+  }
+
+  // shards that closed stay closed, so a busy close can simply be retried
+  for (; db->shards_total > 0; db->shards_total--) {
+    if ((rc = mmdb_close(db->shards[db->shards_total - 1])) != MMDB_OK) {
+      return rc;
+    }
+    free(db->shards[db->shards_total - 1]);
+  }
+
+  if (db->shards != NULL) {
+    free(db->shards);
+    db->shards = NULL;
+    db->open = 0;
+    return MMDB_OK;
+  }
+
+  sqlite3_finalize(db->data_version);
+  db->data_version = NULL;
+
+  switch (sqlite3_close(db->db)) {
+    case SQLITE_BUSY:
+      return MMDB_BUSY;
+    case SQLITE_OK:
+      free(db->docids);
+      db->docids = NULL;
+      mmdb_subs_free(db);
+      search_free(db);
+      view_free(db);
+      presence_free(db);
+      db->open = 0;
+      return MMDB_OK;
+    default:
+      return MMDB_ERROR;
+  }
+}
+
+int mmdb_get_cb(sqlite3_stmt *stmt, void *ptr) {
+  mmdb_doc_t *out = ptr;
+
+  mmdb_doc_clear(out);
+
+  if (stmt == NULL) {
+    return MMDB_OK;
+  }
+
+  if (mmdb_doc_scan(stmt, out) != MMDB_OK) {
+    mmdb_doc_clear(out);
+    return MMDB_ERROR;
+  }
+
+  return MMDB_OK;
+}
+
+int mmdb_docid_cb(sqlite3_stmt *stmt, void *ptr) {
+  mmdb_docid_entry_t *out = ptr;
+
+  if (stmt == NULL) {
+    out->docid = 0;
+    out->expires = 0;
+    return MMDB_OK;
+  }
+
+  return q_scan(stmt, "ll", &out->docid, &out->expires);
+}
+
+// moves whenever another connection commits to the same file, and never for
+// this one's own commits; the statement stays prepared since it runs ahead of
+// every cached lookup
+int mmdb_data_version(mmdb_t *db, sqlite3_int64 *out) {
+  int rc;
+
+  if (db->data_version == NULL &&
+      sqlite3_prepare_v2(db->db, "pragma data_version", -1, &db->data_version,
+                         NULL) != SQLITE_OK) {
+    return MMDB_ERROR;
+  }
+
+  if ((rc = sqlite3_step(db->data_version)) == SQLITE_ROW) {
+    *out = sqlite3_column_int64(db->data_version, 0);
+  }
+
+  sqlite3_reset(db->data_version);
+
+  return rc == SQLITE_ROW ? MMDB_OK : MMDB_ERROR;
+}
+
+// docids are never reused, so a cached one stays valid until another handle
+// commits (it may have removed the document or changed its expiry) or this
+// one changes the row; finds expired documents too, and returns
+// MMDB_NOT_FOUND for unknown ids
+int mmdb_docid_lookup(mmdb_t *db, const char *id, mmdb_docid_entry_t *out) {
+  mmdb_docid_entry_t *entry = NULL;
+  sqlite3_int64 version;
+
+  if (strlen(id) > MMDB_MAX_ID_LENGTH || !presence_check(db, id)) {
+    return MMDB_NOT_FOUND;
+  }
+
+  if (mmdb_data_version(db, &version) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (db->docids != NULL) {
+    entry = &db->docids->entries[mmdb_shard_hash(id) % MMDB_DOCID_CACHE_SIZE];
+
+    if (entry->docid != 0 && entry->data_version == version &&
+        strcmp(entry->id, id) == 0) {
+      *out = *entry;
+      return MMDB_OK;
+    }
+  }
+
+  if (q_exec1(db->db, query_docid, out, mmdb_docid_cb, "s", id) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (out->docid == 0) {
+    presence_miss(db);
+    return MMDB_NOT_FOUND;
+  }
+
+  // a row written by a transaction that's still open could be rolled back
+  if (!sqlite3_get_autocommit(db->db)) {
+    return MMDB_OK;
+  }
+
+  if (db->docids == NULL &&
+      (db->docids = calloc(1, sizeof(struct mmdb_docids_s))) == NULL) {
+    return MMDB_OK;
+  }
+
+  entry = &db->docids->entries[mmdb_shard_hash(id) % MMDB_DOCID_CACHE_SIZE];
+  strcpy(entry->id, id);
+  entry->docid = out->docid;
+  entry->expires = out->expires;
+  entry->data_version = version;
+
+  return MMDB_OK;
+}
+
+// drops the id's cached key, if it has one, once its row changes or goes
+void mmdb_docid_forget(mmdb_t *db, const char *id) {
+  mmdb_docid_entry_t *entry = NULL;
+
+  if (db->docids == NULL) {
+    return;
+  }
+
+  entry = &db->docids->entries[mmdb_shard_hash(id) % MMDB_DOCID_CACHE_SIZE];
+  if (strcmp(entry->id, id) == 0) {
+    entry->docid = 0;
+  }
+}
+
+int mmdb_expired(sqlite3_int64 expires) {
+  return expires != 0 && expires <= (sqlite3_int64)time(NULL);
+}
+
+// every read by id goes through here, so an expired document that hasn't
+// been swept yet is as missing as one that never existed
+int mmdb_docid(mmdb_t *db, const char *id, sqlite3_int64 *docid) {
+  mmdb_docid_entry_t entry;
+  int rc;
+
+  if ((rc = mmdb_docid_lookup(db, id, &entry)) != MMDB_OK) {
+    return rc;
+  }
+
+  if (mmdb_expired(entry.expires)) {
+    return MMDB_NOT_FOUND;
+  }
+
+  *docid = entry.docid;
+
+  return MMDB_OK;
+}
+
+int mmdb_get(mmdb_t *db, mmdb_doc_t *out, const char *id) {
+  sqlite3_int64 docid = 0;
+
+  db = mmdb_shard(db, id);
+
+  switch (mmdb_docid(db, id, &docid)) {
+    case MMDB_OK:
+      return q_exec1(db->db, query_get, out, mmdb_get_cb, "l", docid);
+    case MMDB_NOT_FOUND:
+      mmdb_doc_clear(out);
+      return MMDB_OK;
+    default:
+      return MMDB_ERROR;
+  }
+}
+
+// points out at (or copies into out->buf) the id, rev and body it's given,
+// letting go of whatever held them once they're copied
+int mmdb_raw_set(mmdb_raw_t *out, const char *id, size_t id_len,
+                 const char *rev, size_t rev_len, const char *doc,
+                 size_t doc_len) {
+  out->id_len = id_len;
+  out->rev_len = rev_len;
+  out->doc_len = doc_len;
+
+  if (out->buf == NULL) {
+    out->id = id;
+    out->rev = rev;
+    out->doc = doc;
+    return MMDB_OK;
+  }
+
+  if (id_len + rev_len + doc_len + 3 > out->buf_len) {
+    return MMDB_ERROR;
+  }
+
+  out->id = memcpy(out->buf, id, id_len);
+  out->buf[id_len] = 0;
+  out->rev = memcpy(out->buf + id_len + 1, rev, rev_len);
+  out->buf[id_len + 1 + rev_len] = 0;
+  out->doc = memcpy(out->buf + id_len + rev_len + 2, doc, doc_len);
+  out->buf[id_len + rev_len + 2 + doc_len] = 0;
+
+  sqlite3_finalize(out->stmt);
+  out->stmt = NULL;
+  free(out->rebuilt);
+  out->rebuilt = NULL;
+
+  return MMDB_OK;
+}
+
+// runs a get query and takes the id, rev and body columns from its row
+int mmdb_raw_query(mmdb_t *db, mmdb_raw_t *out, const char *sql, size_t len,
+                   sqlite3_int64 docid, const char *rev) {
+  const char *id = NULL, *rev_str = NULL, *doc = NULL;
+
+  if (sqlite3_prepare_v2(db->db, sql, len, &out->stmt, NULL) != SQLITE_OK ||
+      (rev == NULL ? q_bind(out->stmt, "l", docid)
+                   : q_bind(out->stmt, "ls", docid, rev)) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  switch (sqlite3_step(out->stmt)) {
+    case SQLITE_ROW:
+      break;
+    case SQLITE_DONE:
+      return MMDB_NOT_FOUND;
+    default:
+      return MMDB_ERROR;
+  }
+
+  id = (const char *)sqlite3_column_text(out->stmt, 0);
+  rev_str = (const char *)sqlite3_column_text(out->stmt, 1);
+  doc = sqlite3_column_blob(out->stmt, 2);
+
+  if (id == NULL || rev_str == NULL || doc == NULL) {
+    return MMDB_ERROR;
+  }
+
+  return mmdb_raw_set(out, id, sqlite3_column_bytes(out->stmt, 0), rev_str,
+                      sqlite3_column_bytes(out->stmt, 1), doc,
+                      sqlite3_column_bytes(out->stmt, 2));
+}
+
+// the winning revision's body, with no json parsing; unlike mmdb_get, a
+// missing document is MMDB_NOT_FOUND
+int mmdb_get_raw(mmdb_t *db, mmdb_raw_t *out, const char *id) {
+  sqlite3_int64 docid = 0;
+  int rc;
+
+  db = mmdb_shard(db, id);
+
+  mmdb_raw_release(out);
+
+  if ((rc = mmdb_docid(db, id, &docid)) != MMDB_OK) {
+    return rc;
+  }
+
+  if ((rc = mmdb_raw_query(db, out, query_get, sizeof(query_get), docid,
+                           NULL)) != MMDB_OK) {
+    mmdb_raw_release(out);
+  }
+
+  return rc;
+}
+
+// the same for any stored revision; one kept as a delta is rebuilt, which is
+// the only case that goes through jansson
+int mmdb_get_rev_raw(mmdb_t *db, mmdb_raw_t *out, const char *id,
+                     const char *rev) {
+  sqlite3_int64 docid = 0;
+  mmdb_doc_t doc;
+  size_t id_len, rev_len, n;
+  int rc;
+
+  db = mmdb_shard(db, id);
+
+  mmdb_raw_release(out);
+
+  if ((rc = mmdb_docid(db, id, &docid)) != MMDB_OK) {
+    return rc;
+  }
+
+  rc = mmdb_raw_query(db, out, query_get_rev, sizeof(query_get_rev), docid,
+                      rev);
+  if (rc != MMDB_NOT_FOUND) {
+    if (rc != MMDB_OK) {
+      mmdb_raw_release(out);
+    }
+    return rc;
+  }
+  mmdb_raw_release(out);
+
+  memset(&doc, 0, sizeof(doc));
+  if (mmdb_get_rev_delta(db, &doc, docid, id, rev) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (doc.fields == NULL) {
+    return MMDB_NOT_FOUND;
+  }
+
+  id_len = strlen(id);
+  rev_len = strlen(rev);
+
+  // sized exactly, rather than for the largest document there could be
+  if ((n = json_dumpb(doc.fields, NULL, 0,
+                      JSON_COMPACT | JSON_ENSURE_ASCII | JSON_SORT_KEYS)) ==
+          0 ||
+      n > MMDB_MAX_DATA_LENGTH ||
+      (out->rebuilt = malloc(id_len + rev_len + 2 + n)) == NULL ||
+      json_dumpb(doc.fields, out->rebuilt + id_len + rev_len + 2, n,
+                 JSON_COMPACT | JSON_ENSURE_ASCII | JSON_SORT_KEYS) != n) {
+    mmdb_doc_clear(&doc);
+    mmdb_raw_release(out);
+    return MMDB_ERROR;
+  }
+  mmdb_doc_clear(&doc);
+
+  memcpy(out->rebuilt, id, id_len + 1);
+  memcpy(out->rebuilt + id_len + 1, rev, rev_len + 1);
+
+  if (mmdb_raw_set(out, out->rebuilt, id_len, out->rebuilt + id_len + 1,
+                   rev_len, out->rebuilt + id_len + rev_len + 2,
+                   n) != MMDB_OK) {
+    mmdb_raw_release(out);
+    return MMDB_ERROR;
+  }
+
+  return MMDB_OK;
+}
+
+// keeps buf, so a copying mmdb_raw_t can be reused
+void mmdb_raw_release(mmdb_raw_t *raw) {
+  char *buf = raw->buf;
+  size_t buf_len = raw->buf_len;
+
+  sqlite3_finalize(raw->stmt);
+  free(raw->rebuilt);
+  memset(raw, 0, sizeof(mmdb_raw_t));
+
+  raw->buf = buf;
+  raw->buf_len = buf_len;
+}
+
+typedef struct mmdb_delta_s {
+  // deltas met on the way, the requested revision's first
+  json_t *patches;
+  json_t *fields;
+  char base[MMDB_MAX_REV_LENGTH];
+} mmdb_delta_t;
+
+int mmdb_delta_cb(sqlite3_stmt *stmt, void *ptr) {
+  mmdb_delta_t *state = ptr;
+  json_error_t err;
+  json_t *v = NULL;
+
+  state->base[0] = 0;
+
+  if (stmt == NULL) {
+    return MMDB_OK;
+  }
+
+  if (sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+    state->fields = json_loadb(sqlite3_column_blob(stmt, 0),
+                               sqlite3_column_bytes(stmt, 0), 0, &err);
+    return state->fields != NULL ? MMDB_OK : MMDB_ERROR;
+  }
+
+  // compacted away
+  if (sqlite3_column_type(stmt, 1) == SQLITE_NULL) {
+    return MMDB_OK;
+  }
+
+  if ((v = json_loadb(sqlite3_column_blob(stmt, 1),
+                      sqlite3_column_bytes(stmt, 1), 0, &err)) == NULL ||
+      json_array_append_new(state->patches, v) != 0) {
+    return MMDB_ERROR;
+  }
+
+  if (sqlite3_column_type(stmt, 2) == SQLITE_NULL ||
+      sqlite3_column_bytes(stmt, 2) >= (int)sizeof(state->base)) {
+    return MMDB_ERROR;
+  }
+  memcpy(state->base, sqlite3_column_text(stmt, 2),
+         sqlite3_column_bytes(stmt, 2));
+  state->base[sqlite3_column_bytes(stmt, 2)] = 0;
+
+  return MMDB_OK;
+}
+
+// follows deltas from rev towards the leaf until a full body turns up, then
+// applies them in reverse
+int mmdb_get_rev_delta(mmdb_t *db, mmdb_doc_t *out, sqlite3_int64 docid,
+                       const char *id, const char *rev) {
+  mmdb_delta_t state;
+  char next[MMDB_MAX_REV_LENGTH];
+  size_t i;
+  int hops = 0, rc = MMDB_OK;
+
+  memset(&state, 0, sizeof(state));
+  if ((state.patches = json_array()) == NULL) {
+    return MMDB_ERROR;
+  }
+  snprintf(next, sizeof(next), "%s", rev);
+
+  while (rc == MMDB_OK && state.fields == NULL) {
+    if (hops++ > MMDB_MAX_DELTA_CHAIN ||
+        q_exec1(db->db, query_get_delta, &state, mmdb_delta_cb, "ls", docid,
+                next) != MMDB_OK) {
+      rc = MMDB_ERROR;
+    } else if (state.fields == NULL && state.base[0] == 0) {
+      rc = MMDB_NOT_FOUND;
+    }
+    memcpy(next, state.base, sizeof(next));
+  }
+
+  for (i = json_array_size(state.patches); rc == MMDB_OK && i > 0; i--) {
+    if ((state.fields = patch_merge(state.fields,
+                                    json_array_get(state.patches, i - 1))) ==
+        NULL) {
+      rc = MMDB_ERROR;
+    }
+  }
+
+  json_decref(state.patches);
+  mmdb_doc_clear(out);
+
+  if (rc != MMDB_OK) {
+    json_decref(state.fields);
+    return rc == MMDB_NOT_FOUND ? MMDB_OK : MMDB_ERROR;
+  }
+
+  if (mmdb_doc_set_id(out, id) != MMDB_OK ||
+      mmdb_doc_set_rev(out, rev) != MMDB_OK) {
+    json_decref(state.fields);
+    mmdb_doc_clear(out);
+    return MMDB_ERROR;
+  }
+
+  return mmdb_doc_set_fields_new(out, state.fields);
+}
+
+int mmdb_get_rev(mmdb_t *db, mmdb_doc_t *out, const char *id, const char *rev) {
+  sqlite3_int64 docid = 0;
+
+  db = mmdb_shard(db, id);
+
+  switch (mmdb_docid(db, id, &docid)) {
+    case MMDB_OK:
+      if (q_exec1(db->db, query_get_rev, out, mmdb_get_cb, "ls", docid, rev) !=
+          MMDB_OK) {
+        return MMDB_ERROR;
+      }
+      // no full body, so it may be stored as a delta
+      if (out->rev.seq == 0) {
+        return mmdb_get_rev_delta(db, out, docid, id, rev);
+      }
+      return MMDB_OK;
+    case MMDB_NOT_FOUND:
+      mmdb_doc_clear(out);
+      return MMDB_OK;
+    default:
+      return MMDB_ERROR;
+  }
+}
+
+typedef struct mmdb_get_leaves_s {
+  mmdb_doc_t *out;
+  mmdb_get_options_t *opts;
+  int rows;
+} mmdb_get_leaves_t;
+
+int mmdb_get_leaves_cb(sqlite3_stmt *stmt, void *ptr) {
+  mmdb_get_leaves_t *state = ptr;
+  mmdb_rev_t rev;
+  const char *str = NULL;
+
+  if (state->rows++ == 0) {
+    return mmdb_doc_scan(stmt, state->out);
+  }
+
+  // deleted leaves lose to every live one, so they're never conflicts
+  if (state->opts->conflicts == NULL || sqlite3_column_int(stmt, 3) != 0) {
+    return MMDB_OK;
+  }
+
+  str = (const char *)sqlite3_column_text(stmt, 1);
+  if (mmdb_rev_nparse(&rev, str, sqlite3_column_bytes(stmt, 1)) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  return mmdb_revs_push(state->opts->conflicts, &rev);
+}
+
+int mmdb_get_opts(mmdb_t *db, mmdb_doc_t *out, const char *id,
+                  mmdb_get_options_t *opts) {
+  mmdb_get_leaves_t state = {out, opts, 0};
+  sqlite3_int64 docid = 0;
+  int rc;
+
+  db = mmdb_shard(db, id);
+
+  if (opts == NULL) {
+    return mmdb_get(db, out, id);
+  }
+
+  if (opts->conflicts != NULL) {
+    mmdb_revs_reset(opts->conflicts);
+  }
+
+  mmdb_doc_clear(out);
+
+  if ((rc = mmdb_docid(db, id, &docid)) != MMDB_OK) {
+    return rc == MMDB_NOT_FOUND ? MMDB_OK : MMDB_ERROR;
+  }
+
+  return q_exec2(db->db, query_get_leaves, &state, mmdb_get_leaves_cb, "l",
+                 docid);
+}
+
+// reads the id, rev and body columns of a get query straight out of the
+// statement, without staging them in fixed-size buffers first
+int mmdb_doc_scan(sqlite3_stmt *stmt, mmdb_doc_t *out) {
+  const char *str = NULL;
+  json_t *v = NULL;
+  json_error_t err;
+
+  str = (const char *)sqlite3_column_text(stmt, 0);
+  if (mmdb_doc_nset_id(out, str, sqlite3_column_bytes(stmt, 0)) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  str = (const char *)sqlite3_column_text(stmt, 1);
+  if (mmdb_doc_nset_rev(out, str, sqlite3_column_bytes(stmt, 1)) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  str = sqlite3_column_blob(stmt, 2);
+  if ((v = json_loadb(str, sqlite3_column_bytes(stmt, 2), 0, &err)) == NULL) {
+    return MMDB_ERROR;
+  }
+
+  return mmdb_doc_set_fields_new(out, v);
+}
+
+int mmdb_get_many(mmdb_t *db, mmdb_docs_t *out, const char **ids, int n) {
+  int i = 0, failed = 0;
+  sqlite3_int64 docid = 0;
+  sqlite3_stmt *stmt = NULL;
+
+  mmdb_docs_reset(out);
+
+  if (n <= 0) {
+    return MMDB_OK;
+  }
+
+  // one slot per id, in order; ids that don't exist are left cleared
+  if ((out->docs = mmdb_arena_alloc(&out->arena, sizeof(mmdb_doc_t) * n)) ==
+      NULL) {
+    return MMDB_ERROR;
+  }
+  memset(out->docs, 0, sizeof(mmdb_doc_t) * n);
+  out->total = n;
+
+  for (i = 0; db->shards != NULL && i < n; i++) {
+    if (mmdb_get(db, &out->docs[i], ids[i]) != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+  }
+
+  if (db->shards != NULL) {
+    return MMDB_OK;
+  }
+
+  if (sqlite3_prepare_v2(db->db, query_get, sizeof(query_get), &stmt, NULL) !=
+      SQLITE_OK) {
+    return MMDB_ERROR;
+  }
+
+  for (i = 0; i < n && !failed; i++) {
+    switch (mmdb_docid(db, ids[i], &docid)) {
+      case MMDB_OK:
+        break;
+      case MMDB_NOT_FOUND:
+        continue;
+      default:
+        failed = 1;
+        continue;
+    }
+
+    if (q_bind(stmt, "l", docid) != MMDB_OK) {
+      failed = 1;
+      break;
+    }
+
+    switch (sqlite3_step(stmt)) {
+      case SQLITE_ROW:
+        if (mmdb_doc_scan(stmt, &out->docs[i]) != MMDB_OK) {
+          failed = 1;
+        }
+        break;
+      case SQLITE_DONE:
+        break;
+      default:
+        failed = 1;
+    }
+
+    sqlite3_reset(stmt);
+  }
+
+  if (sqlite3_finalize(stmt) != SQLITE_OK) {
+    failed = 1;
+  }
+
+  return failed ? MMDB_ERROR : MMDB_OK;
+}
+
+// walks current documents in id order from start; on a sharded database each
+// shard is read in order and the streams are merged
+int mmdb_scan(mmdb_t *db, const char *start, int limit, mmdb_scan_cb cb,
+              void *ptr) {
+  mmdb_t **dbs = db->shards != NULL ? db->shards : &db;
+  int total = db->shards != NULL ? db->shards_total : 1;
+  sqlite3_stmt **stmts = NULL;
+  mmdb_doc_t doc;
+  const char *id = NULL, *min_id = NULL;
+  int i, min, n = 0, failed = 0;
+
+  if ((stmts = calloc(total, sizeof(sqlite3_stmt *))) == NULL) {
+    return MMDB_ERROR;
+  }
+  memset(&doc, 0, sizeof(doc));
+
+  for (i = 0; i < total && !failed; i++) {
+    if (sqlite3_prepare_v2(dbs[i]->db, query_scan, sizeof(query_scan),
+                           &stmts[i], NULL) != SQLITE_OK ||
+        q_bind(stmts[i], "si", start != NULL ? start : "",
+               limit > 0 ? limit : -1) != MMDB_OK) {
+      failed = 1;
+      break;
+    }
+
+    switch (sqlite3_step(stmts[i])) {
+      case SQLITE_ROW:
+        break;
+      case SQLITE_DONE:
+        sqlite3_finalize(stmts[i]);
+        stmts[i] = NULL;
+        break;
+      default:
+        failed = 1;
+    }
+  }
+
+  while (!failed && (limit <= 0 || n < limit)) {
+    min = -1;
+    min_id = NULL;
+
+    for (i = 0; i < total; i++) {
+      if (stmts[i] == NULL) {
+        continue;
+      }
+
+      id = (const char *)sqlite3_column_text(stmts[i], 0);
+      if (min_id == NULL || strcmp(id, min_id) < 0) {
+        min = i;
+        min_id = id;
+      }
+    }
+
+    if (min < 0) {
+      break;
+    }
+
+    if (mmdb_doc_scan(stmts[min], &doc) != MMDB_OK ||
+        cb(&doc, ptr) != MMDB_OK) {
+      failed = 1;
+      break;
+    }
+    n++;
+
+    switch (sqlite3_step(stmts[min])) {
+      case SQLITE_ROW:
+        break;
+      case SQLITE_DONE:
+        sqlite3_finalize(stmts[min]);
+        stmts[min] = NULL;
+        break;
+      default:
+        failed = 1;
+    }
+  }
+
+  for (i = 0; i < total; i++) {
+    sqlite3_finalize(stmts[i]);
+  }
+  free(stmts);
+  mmdb_doc_clear(&doc);
+
+  return failed ? MMDB_ERROR : MMDB_OK;
+}
+
+int mmdb_find_explain(mmdb_t *db, find_sql_t *sql, char *out, size_t len) {
+  sqlite3_stmt *stmt = NULL;
+  char *str = NULL;
+  size_t n;
+  int rc;
+
+  if ((str = sqlite3_mprintf("explain query plan %s", sql->str)) == NULL) {
+    return MMDB_ERROR;
+  }
+
+  rc = sqlite3_prepare_v2(db->db, str, -1, &stmt, NULL);
+  sqlite3_free(str);
+  if (rc != SQLITE_OK || find_bind(stmt, sql) != MMDB_OK) {
+    sqlite3_finalize(stmt);
+    return MMDB_ERROR;
+  }
+
+  n = snprintf(out, len, "%s\n", sql->str);
+
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    n += snprintf(out + MMDB_MIN(n, len), len - MMDB_MIN(n, len), "%s\n",
+                  (const char *)sqlite3_column_text(stmt, 3));
+  }
+
+  sqlite3_finalize(stmt);
+
+  return rc == SQLITE_DONE && n < len ? MMDB_OK : MMDB_ERROR;
+}
+
+// runs the selector against every shard and merges the results in sort
+// order, so a sharded handle pages the same way a single file does
+int mmdb_find(mmdb_t *db, json_t *selector, mmdb_find_options_t *opts,
+              mmdb_scan_cb cb, void *ptr) {
+  mmdb_t **dbs = db->shards != NULL ? db->shards : &db;
+  int total = db->shards != NULL ? db->shards_total : 1;
+  int limit = opts != NULL ? opts->limit : 0;
+  sqlite3_stmt **stmts = NULL;
+  find_sql_t sql;
+  mmdb_doc_t doc;
+  json_t *cursor = NULL;
+  int i, min, n = 0, failed = 0;
+
+  if (find_compile(&sql, selector, opts != NULL ? opts->sort : NULL,
+                   opts != NULL ? opts->cursor : NULL, limit) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (opts != NULL && opts->explain != NULL) {
+    failed = mmdb_find_explain(dbs[0], &sql, opts->explain,
+                               opts->explain_len) != MMDB_OK;
+    find_free(&sql);
+    return failed ? MMDB_ERROR : MMDB_OK;
+  }
+
+  if ((stmts = calloc(total, sizeof(sqlite3_stmt *))) == NULL) {
+    find_free(&sql);
+    return MMDB_ERROR;
+  }
+  memset(&doc, 0, sizeof(doc));
+
+  for (i = 0; i < total && !failed; i++) {
+    if (sqlite3_prepare_v2(dbs[i]->db, sql.str, sql.len + 1, &stmts[i],
+                           NULL) != SQLITE_OK ||
+        find_bind(stmts[i], &sql) != MMDB_OK) {
+      failed = 1;
+      break;
+    }
+
+    switch (sqlite3_step(stmts[i])) {
+      case SQLITE_ROW:
+        break;
+      case SQLITE_DONE:
+        sqlite3_finalize(stmts[i]);
+        stmts[i] = NULL;
+        break;
+      default:
+        failed = 1;
+    }
+  }
+
+  while (!failed && (limit <= 0 || n < limit)) {
+    min = -1;
+
+    for (i = 0; i < total; i++) {
+      if (stmts[i] != NULL &&
+          (min < 0 || find_cmp(&sql, stmts[i], stmts[min]) < 0)) {
+        min = i;
+      }
+    }
+
+    if (min < 0) {
+      break;
+    }
+
+    if (mmdb_doc_scan(stmts[min], &doc) != MMDB_OK ||
+        cb(&doc, ptr) != MMDB_OK) {
+      failed = 1;
+      break;
+    }
+
+    if (++n == limit && (cursor = find_cursor(&sql, stmts[min])) == NULL) {
+      failed = 1;
+      break;
+    }
+
+    switch (sqlite3_step(stmts[min])) {
+      case SQLITE_ROW:
+        break;
+      case SQLITE_DONE:
+        sqlite3_finalize(stmts[min]);
+        stmts[min] = NULL;
+        break;
+      default:
+        failed = 1;
+    }
+  }
+
+  for (i = 0; i < total; i++) {
+    sqlite3_finalize(stmts[i]);
+  }
+  free(stmts);
+  mmdb_doc_clear(&doc);
+  find_free(&sql);
+
+  if (failed) {
+    json_decref(cursor);
+    return MMDB_ERROR;
+  }
+
+  if (opts != NULL) {
+    json_decref(opts->cursor);
+    opts->cursor = cursor;
+  }
+
+  return MMDB_OK;
+}
+
+// fields are json paths like a.b; mmdb_find uses the index for selectors and
+// sorts on a prefix of them
+int mmdb_create_index(mmdb_t *db, const char *name, json_t *fields) {
+  find_sql_t sql;
+  int i, failed = 0;
+
+  for (i = 0; i < db->shards_total; i++) {
+    if (mmdb_create_index(db->shards[i], name, fields) != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+  }
+
+  if (db->shards != NULL) {
+    return MMDB_OK;
+  }
+
+  if (find_index(&sql, name, fields) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  failed = q_exec0(db->db, sql.str, "") != MMDB_OK;
+
+  find_free(&sql);
+
+  return failed ? MMDB_ERROR : MMDB_OK;
+}
+
+// fields are json paths like a.b; once created, every write keeps the index
+// in step with the winning revision of each live document
+int mmdb_create_search(mmdb_t *db, const char *name, json_t *fields) {
+  int i, rc;
+
+  for (i = 0; i < db->shards_total; i++) {
+    if ((rc = mmdb_create_search(db->shards[i], name, fields)) != MMDB_OK) {
+      return rc;
+    }
+  }
+
+  if (db->shards != NULL) {
+    return MMDB_OK;
+  }
+
+  if (mmdb_begin(db) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if ((rc = search_create(db, name, fields)) != MMDB_OK) {
+    mmdb_rollback(db);
+    return rc;
+  }
+
+  if (mmdb_commit(db) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  return search_load(db);
+}
+
+// query is in fts5 syntax; matches are passed to cb best first, merged across
+// shards by rank
+int mmdb_search(mmdb_t *db, const char *name, const char *query, int limit,
+                mmdb_search_cb cb, void *ptr) {
+  mmdb_t **dbs = db->shards != NULL ? db->shards : &db;
+  int total = db->shards != NULL ? db->shards_total : 1;
+  sqlite3_stmt **stmts = NULL;
+  const char *sql = NULL;
+  mmdb_rev_t rev;
+  int i, min, n = 0, failed = 0, rc = MMDB_ERROR;
+
+  if ((stmts = calloc(total, sizeof(sqlite3_stmt *))) == NULL) {
+    return MMDB_ERROR;
+  }
+
+  for (i = 0; i < total && !failed; i++) {
+    if ((sql = search_query(dbs[i], name)) == NULL) {
+      rc = MMDB_NOT_FOUND;
+      failed = 1;
+      break;
+    }
+
+    if (sqlite3_prepare_v2(dbs[i]->db, sql, -1, &stmts[i], NULL) !=
+            SQLITE_OK ||
+        q_bind(stmts[i], "si", query, limit > 0 ? limit : -1) != MMDB_OK) {
+      failed = 1;
+      break;
+    }
+
+    switch (sqlite3_step(stmts[i])) {
+      case SQLITE_ROW:
+        break;
+      case SQLITE_DONE:
+        sqlite3_finalize(stmts[i]);
+        stmts[i] = NULL;
+        break;
+      default:
+        failed = 1;
+    }
+  }
+
+  while (!failed && (limit <= 0 || n < limit)) {
+    min = -1;
+
+    for (i = 0; i < total; i++) {
+      if (stmts[i] != NULL &&
+          (min < 0 || sqlite3_column_double(stmts[i], 2) <
+                          sqlite3_column_double(stmts[min], 2))) {
+        min = i;
+      }
+    }
+
+    if (min < 0) {
+      break;
+    }
+
+    if (mmdb_rev_nparse(&rev, (const char *)sqlite3_column_text(stmts[min], 1),
+                        sqlite3_column_bytes(stmts[min], 1)) != MMDB_OK ||
+        cb((const char *)sqlite3_column_text(stmts[min], 0), &rev,
+           sqlite3_column_double(stmts[min], 2), ptr) != MMDB_OK) {
+      failed = 1;
+      break;
+    }
+    n++;
+
+    switch (sqlite3_step(stmts[min])) {
+      case SQLITE_ROW:
+        break;
+      case SQLITE_DONE:
+        sqlite3_finalize(stmts[min]);
+        stmts[min] = NULL;
+        break;
+      default:
+        failed = 1;
+    }
+  }
+
+  for (i = 0; i < total; i++) {
+    sqlite3_finalize(stmts[i]);
+  }
+  free(stmts);
+
+  return failed ? rc : MMDB_OK;
+}
+
+// key is the path documents are grouped by and value, which may be NULL if
+// only counts are wanted, the path of the number they contribute; documents
+// without the key are left out, and non-numbers only count towards count
+int mmdb_create_view(mmdb_t *db, const char *name, const char *key,
+                     const char *value) {
+  int i, rc;
+
+  for (i = 0; i < db->shards_total; i++) {
+    if ((rc = mmdb_create_view(db->shards[i], name, key, value)) != MMDB_OK) {
+      return rc;
+    }
+  }
+
+  if (db->shards != NULL) {
+    return MMDB_OK;
+  }
+
+  if (mmdb_begin(db) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if ((rc = view_create(db, name, key, value)) != MMDB_OK) {
+    mmdb_rollback(db);
+    return rc;
+  }
+
+  if (mmdb_commit(db) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  return view_load(db);
+}
+
+typedef struct mmdb_view_group_s {
+  json_t *key;
+  sqlite3_int64 count;
+  sqlite3_int64 n;
+  json_t *sum;
+  json_t *min;
+  json_t *max;
+} mmdb_view_group_t;
+
+void mmdb_view_group_clear(mmdb_view_group_t *group) {
+  json_decref(group->key);
+  json_decref(group->sum);
+  json_decref(group->min);
+  json_decref(group->max);
+  memset(group, 0, sizeof(mmdb_view_group_t));
+}
+
+// folds one shard's row for a group into the totals so far
+int mmdb_view_group_add(mmdb_view_group_t *group, sqlite3_stmt *stmt) {
+  json_t *v = NULL;
+
+  if (group->key == NULL && (group->key = find_value(stmt, 0)) == NULL) {
+    return MMDB_ERROR;
+  }
+
+  group->count += sqlite3_column_int64(stmt, 1);
+  group->n += sqlite3_column_int64(stmt, 2);
+
+  if ((v = find_value(stmt, 3)) == NULL) {
+    return MMDB_ERROR;
+  }
+  if (group->sum != NULL) {
+    v = json_is_integer(v) && json_is_integer(group->sum)
+            ? json_integer(json_integer_value(group->sum) +
+                           json_integer_value(v))
+            : json_real(json_number_value(group->sum) + json_number_value(v));
+    json_decref(group->sum);
+  }
+  group->sum = v;
+
+  if ((v = find_value(stmt, 4)) == NULL) {
+    return MMDB_ERROR;
+  }
+  if (group->min == NULL || json_is_null(group->min) ||
+      (!json_is_null(v) &&
+       json_number_value(v) < json_number_value(group->min))) {
+    json_decref(group->min);
+    group->min = v;
+  } else {
+    json_decref(v);
+  }
+
+  if ((v = find_value(stmt, 5)) == NULL) {
+    return MMDB_ERROR;
+  }
+  if (group->max == NULL || json_is_null(group->max) ||
+      (!json_is_null(v) &&
+       json_number_value(v) > json_number_value(group->max))) {
+    json_decref(group->max);
+    group->max = v;
+  } else {
+    json_decref(v);
+  }
+
+  return group->sum != NULL ? MMDB_OK : MMDB_ERROR;
+}
+
+int mmdb_view_group_emit(mmdb_view_group_t *group, int reduce,
+                         mmdb_view_cb cb, void *ptr) {
+  json_t *v = NULL;
+  int rc;
+
+  switch (reduce) {
+    case MMDB_REDUCE_COUNT:
+      v = json_integer(group->count);
+      break;
+    case MMDB_REDUCE_SUM:
+      v = json_incref(group->sum);
+      break;
+    case MMDB_REDUCE_MIN:
+      v = json_incref(group->min);
+      break;
+    case MMDB_REDUCE_MAX:
+      v = json_incref(group->max);
+      break;
+    case MMDB_REDUCE_AVG:
+      v = group->n > 0 ? json_real(json_number_value(group->sum) / group->n)
+                       : json_null();
+      break;
+  }
+
+  if (v == NULL) {
+    return MMDB_ERROR;
+  }
+
+  rc = cb(group->key, v, ptr);
+  json_decref(v);
+
+  return rc;
+}
+
+// reads a view one group at a time in key order, reduced one of the
+// MMDB_REDUCE_* ways; min, max and avg are null for groups without numbers.
+// the work depends on the number of groups, not documents
+int mmdb_view(mmdb_t *db, const char *name, int reduce, mmdb_view_cb cb,
+              void *ptr) {
+  mmdb_t **dbs = db->shards != NULL ? db->shards : &db;
+  int total = db->shards != NULL ? db->shards_total : 1;
+  sqlite3_stmt **stmts = NULL;
+  mmdb_view_group_t group;
+  int i, min, failed = 0, rc = MMDB_ERROR;
+
+  if (reduce < MMDB_REDUCE_COUNT || reduce > MMDB_REDUCE_AVG) {
+    return MMDB_ERROR;
+  }
+
+  if ((stmts = calloc(total, sizeof(sqlite3_stmt *))) == NULL) {
+    return MMDB_ERROR;
+  }
+  memset(&group, 0, sizeof(group));
+
+  for (i = 0; i < total && !failed; i++) {
+    if (!view_exists(dbs[i], name)) {
+      rc = MMDB_NOT_FOUND;
+      failed = 1;
+      break;
+    }
+
+    if (sqlite3_prepare_v2(dbs[i]->db, query_view, sizeof(query_view),
+                           &stmts[i], NULL) != SQLITE_OK ||
+        q_bind(stmts[i], "s", name) != MMDB_OK) {
+      failed = 1;
+      break;
+    }
+
+    switch (sqlite3_step(stmts[i])) {
+      case SQLITE_ROW:
+        break;
+      case SQLITE_DONE:
+        sqlite3_finalize(stmts[i]);
+        stmts[i] = NULL;
+        break;
+      default:
+        failed = 1;
+    }
+  }
+
+  while (!failed) {
+    min = -1;
+
+    for (i = 0; i < total; i++) {
+      if (stmts[i] != NULL &&
+          (min < 0 || find_value_cmp(stmts[i], stmts[min], 0) < 0)) {
+        min = i;
+      }
+    }
+
+    if (min < 0) {
+      break;
+    }
+
+    // every shard may have a row for the same key
+    for (i = min + 1; i < total; i++) {
+      if (stmts[i] != NULL && find_value_cmp(stmts[i], stmts[min], 0) == 0) {
+        if (mmdb_view_group_add(&group, stmts[i]) != MMDB_OK) {
+          failed = 1;
+          break;
+        }
+
+        switch (sqlite3_step(stmts[i])) {
+          case SQLITE_ROW:
+            break;
+          case SQLITE_DONE:
+            sqlite3_finalize(stmts[i]);
+            stmts[i] = NULL;
+            break;
+          default:
+            failed = 1;
+        }
+      }
+    }
+
+    if (failed || mmdb_view_group_add(&group, stmts[min]) != MMDB_OK ||
+        mmdb_view_group_emit(&group, reduce, cb, ptr) != MMDB_OK) {
+      failed = 1;
+      break;
+    }
+    mmdb_view_group_clear(&group);
+
+    switch (sqlite3_step(stmts[min])) {
+      case SQLITE_ROW:
+        break;
+      case SQLITE_DONE:
+        sqlite3_finalize(stmts[min]);
+        stmts[min] = NULL;
+        break;
+      default:
+        failed = 1;
+    }
+  }
+
+  for (i = 0; i < total; i++) {
+    sqlite3_finalize(stmts[i]);
+  }
+  free(stmts);
+  mmdb_view_group_clear(&group);
+
+  return failed ? rc : MMDB_OK;
+}
+
+int mmdb_revs_cb(sqlite3_stmt *stmt, void *ptr) {
+  mmdb_revs_t *out = ptr;
+  mmdb_rev_t rev;
+  const char *str = NULL;
+
+  str = (const char *)sqlite3_column_text(stmt, 0);
+  if (mmdb_rev_nparse(&rev, str, sqlite3_column_bytes(stmt, 0)) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  return mmdb_revs_push(out, &rev);
+}
+
+int mmdb_revs(mmdb_t *db, mmdb_revs_t *out, const char *id) {
+  sqlite3_int64 docid = 0;
+  int rc;
+
+  db = mmdb_shard(db, id);
+
+  mmdb_revs_reset(out);
+
+  if ((rc = mmdb_docid(db, id, &docid)) != MMDB_OK) {
+    return rc == MMDB_NOT_FOUND ? MMDB_OK : MMDB_ERROR;
+  }
+
+  return q_exec2(db->db, query_revs, out, mmdb_revs_cb, "l", docid);
+}
+
+// the revision (or the winning one, if rev is NULL) followed by its
+// ancestors, newest first, as far back as they've been kept
+int mmdb_rev_history(mmdb_t *db, mmdb_revs_t *out, const char *id,
+                     const char *rev) {
+  sqlite3_int64 docid = 0;
+  int rc;
+
+  db = mmdb_shard(db, id);
+
+  mmdb_revs_reset(out);
+
+  if ((rc = mmdb_docid(db, id, &docid)) != MMDB_OK) {
+    return rc == MMDB_NOT_FOUND ? MMDB_OK : MMDB_ERROR;
+  }
+
+  if (rev == NULL) {
+    return q_exec2(db->db, query_rev_history_current, out, mmdb_revs_cb, "l",
+                   docid);
+  }
+
+  return q_exec2(db->db, query_rev_history, out, mmdb_revs_cb, "ls", docid,
+                 rev);
+}
+
+// inserts the docs row and hands back the integer key it was given
+int mmdb_insert_doc(mmdb_t *db, sqlite3_int64 *docid, const char *id,
+                    const char *rev) {
+  if (q_exec0(db->db, query_insert_doc, "ss", id, rev) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  *docid = sqlite3_last_insert_rowid(db->db);
+
+  return presence_add(db, id);
+}
+
+int mmdb_insert_rev(mmdb_t *db, sqlite3_int64 docid, const char *rev,
+                    const char *parent, const char *fields, size_t len) {
+  unsigned char hash[16];
+
+  if (mmdb_body_hash(db, hash, fields, len) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (q_exec0(db->db, query_ref_body, "bs", hash, sizeof(hash), fields) !=
+      MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  // only store the body if nobody else references an identical one yet; one
+  // that only shares the hash fails on the primary key
+  if (sqlite3_changes(db->db) == 0 &&
+      q_exec0(db->db, query_insert_body, "bs", hash, sizeof(hash), fields) !=
+          MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  return q_exec0(db->db, query_insert_rev, "lsbs", docid, rev, hash,
+                 sizeof(hash), parent != NULL ? parent : "");
+}
+
+int mmdb_remove_leaf(mmdb_t *db, sqlite3_int64 docid, const char *rev) {
+  return q_exec0(db->db, query_remove_leaf, "ls", docid, rev);
+}
+
+// search indexes and views follow each document's winning revision; a write
+// takes the old winner out of the views before touching anything and puts
+// the new one into everything once it's settled
+int mmdb_unindex_doc(mmdb_t *db, sqlite3_int64 docid) {
+  return view_update(db, docid, -1);
+}
+
+int mmdb_index_doc(mmdb_t *db, sqlite3_int64 docid) {
+  if (search_update(db, docid) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  return view_update(db, docid, 1);
+}
+
+int mmdb_update_doc(mmdb_t *db, sqlite3_int64 docid) {
+  if (q_exec0(db->db, query_update_doc, "l", docid) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  return mmdb_index_doc(db, docid);
+}
+
+int mmdb_put_cb(sqlite3_stmt *stmt, void *ptr) {
+  char str[MMDB_MAX_REV_LENGTH];
+  mmdb_rev_t *current_rev = ptr;
+
+  if (stmt == NULL) {
+    mmdb_rev_clear(current_rev);
+    return MMDB_OK;
+  }
+
+  if (q_scan(stmt, "s", str, sizeof(str)) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (mmdb_rev_new(current_rev, str) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  return MMDB_OK;
+}
+
+int mmdb_put(mmdb_t *db, mmdb_rev_t *out_rev, mmdb_doc_t *doc,
+             mmdb_put_options_t *opts) {
+  int rc = 0, i = 0;
+
+  db = mmdb_shard(db, doc->id);
+
+  for (i = 0; opts != NULL && i < opts->attachments_total; i++) {
+    if (mmdb_attachment_digest(db, &opts->attachments[i]) != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+  }
+
+  if (mmdb_begin(db) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if ((rc = mmdb_put_tx(db, out_rev, doc, opts)) != MMDB_OK ||
+      (rc = mmdb_subs_record(db, doc->id, out_rev)) != MMDB_OK) {
+    mmdb_rollback(db);
+    return rc;
+  }
+
+  return mmdb_commit(db);
+}
+
+int mmdb_put_tx(mmdb_t *db, mmdb_rev_t *out_rev, mmdb_doc_t *doc,
+                mmdb_put_options_t *opts) {
+  mmdb_rev_t current_rev;
+  mmdb_docid_entry_t entry;
+  int rc;
+
+  switch (mmdb_docid_lookup(db, doc->id, &entry)) {
+    case MMDB_OK:
+      break;
+    case MMDB_NOT_FOUND:
+      entry.docid = 0;
+      entry.expires = 0;
+      break;
+    default:
+      return MMDB_ERROR;
+  }
+
+  // an expired document is already gone as far as readers can tell, so it's
+  // cleared out and written again from scratch
+  if (entry.docid != 0 && mmdb_expired(entry.expires)) {
+    if (mmdb_expire_doc(db, entry.docid, doc->id) != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+    entry.docid = 0;
+    entry.expires = 0;
+  }
+
+  if (entry.docid != 0 && q_exec1(db->db, query_rev, &current_rev,
+                                  mmdb_put_cb, "l", entry.docid) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  // the row can only be gone if the lookup was wrong, and writing through it
+  // would lose the revision, so it starts over as a new document
+  if (entry.docid != 0 && current_rev.seq == 0) {
+    mmdb_docid_forget(db, doc->id);
+    entry.docid = 0;
+    entry.expires = 0;
+  }
+
+  if (entry.docid == 0) {
+    rc = mmdb_put_new(db, out_rev, doc, opts);
+  } else {
+    rc = mmdb_put_update(db, entry.docid, out_rev, doc, &current_rev, opts);
+  }
+
+  if (rc != MMDB_OK) {
+    return rc;
+  }
+
+  return mmdb_set_expires(db, doc->id, entry.expires, opts);
+}
+
+// each put replaces the document's expiry, which only costs a write when it
+// actually changes
+int mmdb_set_expires(mmdb_t *db, const char *id, sqlite3_int64 old,
+                     mmdb_put_options_t *opts) {
+  sqlite3_int64 expires = opts != NULL ? opts->expires : 0;
+
+  if (expires == old) {
+    return MMDB_OK;
+  }
+
+  mmdb_docid_forget(db, id);
+
+  return q_exec0(db->db, query_set_expires, "ls", expires, id);
+}
+
+// removes a document and everything only it refers to, as if it had never
+// been written; subscribers see it go with a zeroed revision
+int mmdb_expire_doc(mmdb_t *db, sqlite3_int64 docid, const char *id) {
+  mmdb_rev_t gone;
+
+  // views have to see the rows to take them away, and search indexes have
+  // to see them gone to drop them
+  if (mmdb_unindex_doc(db, docid) != MMDB_OK ||
+      q_exec0(db->db, query_expire_unref_bodies, "l", docid) != MMDB_OK ||
+      q_exec0(db->db, query_expire_delete_bodies, "l", docid) != MMDB_OK ||
+      q_exec0(db->db, query_expire_attachments, "l", docid) != MMDB_OK ||
+      q_exec0(db->db, query_expire_rev_attachments, "l", docid) != MMDB_OK ||
+      q_exec0(db->db, query_expire_revs, "l", docid) != MMDB_OK ||
+      q_exec0(db->db, query_expire_doc, "l", docid) != MMDB_OK ||
+      mmdb_index_doc(db, docid) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  mmdb_docid_forget(db, id);
+
+  mmdb_rev_clear(&gone);
+
+  return mmdb_subs_record(db, id, &gone);
+}
+
+typedef struct mmdb_expired_s {
+  int total;
+  int size;
+  sqlite3_int64 *docids;
+  char (*ids)[MMDB_MAX_ID_LENGTH + 1];
+} mmdb_expired_t;
+
+int mmdb_expired_cb(sqlite3_stmt *stmt, void *ptr) {
+  mmdb_expired_t *out = ptr;
+
+  if (out->total == out->size) {
+    return MMDB_ERROR;
+  }
+
+  if (q_scan(stmt, "ls", &out->docids[out->total], out->ids[out->total],
+             sizeof(out->ids[out->total])) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+  out->total++;
+
+  return MMDB_OK;
+}
+
+// removes up to budget expired documents, those that expired first first, in
+// one transaction; returns MMDB_DONE once there are none left, so it can be
+// called in a loop or from time to time without ever scanning every document
+int mmdb_expire_step(mmdb_t *db, int budget) {
+  mmdb_expired_t expired;
+  int i, rc, done = 1;
+
+  if (budget <= 0) {
+    return MMDB_ERROR;
+  }
+
+  for (i = 0; i < db->shards_total; i++) {
+    if ((rc = mmdb_expire_step(db->shards[i], budget)) == MMDB_ERROR) {
+      return MMDB_ERROR;
+    }
+    done = done && rc == MMDB_DONE;
+  }
+
+  if (db->shards != NULL) {
+    return done ? MMDB_DONE : MMDB_OK;
+  }
+
+  memset(&expired, 0, sizeof(expired));
+  expired.size = budget;
+  expired.docids = calloc(budget, sizeof(sqlite3_int64));
+  expired.ids = calloc(budget, sizeof(*expired.ids));
+  if (expired.docids == NULL || expired.ids == NULL) {
+    free(expired.docids);
+    free(expired.ids);
+    return MMDB_ERROR;
+  }
+
+  if (mmdb_begin(db) != MMDB_OK) {
+    free(expired.docids);
+    free(expired.ids);
+    return MMDB_ERROR;
+  }
+
+  rc = q_exec2(db->db, query_expired, &expired, mmdb_expired_cb, "li",
+               (sqlite3_int64)time(NULL), budget);
+
+  for (i = 0; rc == MMDB_OK && i < expired.total; i++) {
+    rc = mmdb_expire_doc(db, expired.docids[i], expired.ids[i]);
+  }
+
+  if (rc != MMDB_OK) {
+    mmdb_rollback(db);
+  } else {
+    rc = mmdb_commit(db);
+  }
+
+  free(expired.docids);
+  free(expired.ids);
+
+  if (rc != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  return expired.total < budget ? MMDB_DONE : MMDB_OK;
+}
+
+// applies a merge patch (RFC 7386) or a list of json patch operations (RFC
+// 6902) to the winning revision and stores the result as the next one, in a
+// single transaction; base, if given, must be the winner or the patch is a
+// conflict, and a failed json patch "test" is a conflict too
+int mmdb_patch(mmdb_t *db, mmdb_rev_t *out_rev, const char *id,
+               mmdb_rev_t *base, int type, json_t *patch) {
+  int rc = 0;
+
+  db = mmdb_shard(db, id);
+
+  if (mmdb_begin(db) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if ((rc = mmdb_patch_tx(db, out_rev, id, base, type, patch)) != MMDB_OK ||
+      (rc = mmdb_subs_record(db, id, out_rev)) != MMDB_OK) {
+    mmdb_rollback(db);
+    return rc;
+  }
+
+  return mmdb_commit(db);
+}
+
+int mmdb_patch_tx(mmdb_t *db, mmdb_rev_t *out_rev, const char *id,
+                  mmdb_rev_t *base, int type, json_t *patch) {
+  mmdb_doc_t doc;
+  mmdb_docid_entry_t entry;
+  mmdb_put_options_t opts;
+  int rc = MMDB_OK;
+
+  memset(&doc, 0, sizeof(doc));
+  memset(&opts, 0, sizeof(opts));
+
+  if (mmdb_get(db, &doc, id) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (doc.rev.seq == 0 || doc.fields == NULL) {
+    mmdb_doc_clear(&doc);
+    return MMDB_NOT_FOUND;
+  }
+
+  if (base != NULL && mmdb_rev_cmp(base, &doc.rev) != 0) {
+    mmdb_doc_clear(&doc);
+    return MMDB_CONFLICT;
+  }
+
+  switch (type) {
+    case MMDB_PATCH_MERGE:
+      if ((doc.fields = patch_merge(doc.fields, patch)) == NULL) {
+        rc = MMDB_ERROR;
+      }
+      break;
+    case MMDB_PATCH_JSON:
+      rc = patch_apply(&doc.fields, patch);
+      break;
+    default:
+      rc = MMDB_ERROR;
+  }
+
+  if (rc == MMDB_OK && !json_is_object(doc.fields)) {
+    rc = MMDB_ERROR;
+  }
+
+  // a patch only touches the fields, so the document keeps its expiry
+  if (rc == MMDB_OK &&
+      (rc = mmdb_docid_lookup(db, id, &entry)) == MMDB_OK) {
+    opts.expires = entry.expires;
+    rc = mmdb_put_tx(db, out_rev, &doc, &opts);
+  }
+
+  mmdb_doc_clear(&doc);
+
+  return rc;
+}
+
+int mmdb_put_new(mmdb_t *db, mmdb_rev_t *out_rev, mmdb_doc_t *doc,
+                 mmdb_put_options_t *opts) {
+  char rev[MMDB_MAX_REV_LENGTH], fields[MMDB_MAX_DATA_LENGTH];
+  sqlite3_int64 docid = 0;
+  size_t n;
+
+  if ((n = json_dumpb(doc->fields, fields, sizeof(fields) - 1,
+                      JSON_COMPACT | JSON_ENSURE_ASCII | JSON_SORT_KEYS)) >
+      sizeof(fields) - 1) {
+    return MMDB_ERROR;
+  }
+  fields[n] = 0;
+
+  if (mmdb_rev_hash(out_rev, db->hash, doc, fields, n,
+                    opts ? opts->attachments : NULL,
+                    opts ? opts->attachments_total : 0) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (mmdb_rev_format(rev, sizeof(rev), out_rev) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (mmdb_insert_doc(db, &docid, doc->id, rev) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (mmdb_insert_rev(db, docid, rev, NULL, fields, n) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (mmdb_put_attachments(db, docid, rev, NULL, opts) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  return mmdb_index_doc(db, docid);
+}
+
+int mmdb_put_update(mmdb_t *db, sqlite3_int64 docid, mmdb_rev_t *out_rev,
+                    mmdb_doc_t *doc, mmdb_rev_t *current_rev,
+                    mmdb_put_options_t *opts) {
+  char rev[MMDB_MAX_REV_LENGTH], parent_rev[MMDB_MAX_REV_LENGTH],
+      fields[MMDB_MAX_DATA_LENGTH];
+  size_t n;
+
+  if (mmdb_rev_cmp(&doc->rev, current_rev) != 0 &&
+      (opts == NULL || opts->allow_conflict == 0)) {
+    return MMDB_CONFLICT;
+  }
+
+  if ((n = json_dumpb(doc->fields, fields, sizeof(fields) - 1,
+                      JSON_COMPACT | JSON_ENSURE_ASCII | JSON_SORT_KEYS)) >
+      sizeof(fields) - 1) {
+    return MMDB_ERROR;
+  }
+  fields[n] = 0;
+
+  if (mmdb_rev_hash(out_rev, db->hash, doc, fields, n,
+                    opts ? opts->attachments : NULL,
+                    opts ? opts->attachments_total : 0) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (mmdb_rev_format(rev, sizeof(rev), out_rev) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+  if (mmdb_rev_format(parent_rev, sizeof(parent_rev), &doc->rev) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (mmdb_unindex_doc(db, docid) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (mmdb_insert_rev(db, docid, rev, parent_rev, fields, n) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (mmdb_put_attachments(db, docid, rev, parent_rev, opts) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (db->delta_chain > 0 &&
+      mmdb_delta_store(db, docid, parent_rev, rev, doc->fields) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  // the parent stops being a leaf whether or not it was the winner
+  if (mmdb_remove_leaf(db, docid, parent_rev) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (db->revs_limit > 0 && mmdb_stem(db, docid) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (mmdb_update_doc(db, docid) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  return MMDB_OK;
+}
+
+// drops the revisions that have fallen more than revs_limit generations
+// behind every leaf, along with their bodies and attachments once nothing
+// else refers to them
+int mmdb_stem(mmdb_t *db, sqlite3_int64 docid) {
+  mmdb_revs_t revs;
+  char rev[MMDB_MAX_REV_LENGTH];
+  int i, rc = MMDB_OK;
+
+  mmdb_revs_new(&revs);
+
+  if (q_exec2(db->db, query_stem, &revs, mmdb_revs_cb, "li", docid,
+              db->revs_limit) != MMDB_OK) {
+    mmdb_revs_free(&revs);
+    return MMDB_ERROR;
+  }
+
+  for (i = 0; i < revs.total && rc == MMDB_OK; i++) {
+    if (mmdb_revs_format(&revs, i, rev, sizeof(rev)) != MMDB_OK ||
+        q_exec0(db->db, query_stem_unref_body, "ls", docid, rev) != MMDB_OK ||
+        q_exec0(db->db, query_stem_delete_body, "ls", docid, rev) !=
+            MMDB_OK ||
+        q_exec0(db->db, query_stem_attachments, "ls", docid, rev) !=
+            MMDB_OK ||
+        q_exec0(db->db, query_stem_rev_attachments, "ls", docid, rev) !=
+            MMDB_OK ||
+        q_exec0(db->db, query_stem_rev, "ls", docid, rev) != MMDB_OK) {
+      rc = MMDB_ERROR;
+    }
+  }
+
+  mmdb_revs_free(&revs);
+
+  return rc;
+}
+
+typedef struct mmdb_delta_parent_s {
+  json_t *fields;
+  unsigned char body[16];
+  sqlite3_int64 chain;
+} mmdb_delta_parent_t;
+
+int mmdb_delta_parent_cb(sqlite3_stmt *stmt, void *ptr) {
+  mmdb_delta_parent_t *parent = ptr;
+  json_error_t err;
+
+  if (stmt == NULL) {
+    return MMDB_OK;
+  }
+
+  if (q_scan(stmt, "bl", parent->body, sizeof(parent->body),
+             &parent->chain) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if ((parent->fields = json_loadb(sqlite3_column_blob(stmt, 2),
+                                   sqlite3_column_bytes(stmt, 2), 0, &err)) ==
+      NULL) {
+    return MMDB_ERROR;
+  }
+
+  return MMDB_OK;
+}
+
+// swaps the full body of a leaf that's about to be replaced for a merge patch
+// against its replacement; bodies that can't be expressed that way, or would
+// put a revision too many deltas from a full body, are left alone
+int mmdb_delta_store(mmdb_t *db, sqlite3_int64 docid, const char *parent_rev,
+                     const char *rev, json_t *fields) {
+  mmdb_delta_parent_t parent;
+  json_t *diff = NULL;
+  char *delta = NULL;
+  int rc = MMDB_OK;
+
+  memset(&parent, 0, sizeof(parent));
+
+  if (q_exec1(db->db, query_delta_parent, &parent, mmdb_delta_parent_cb, "ls",
+              docid, parent_rev) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (parent.fields == NULL || parent.chain + 1 > db->delta_chain) {
+    json_decref(parent.fields);
+    return MMDB_OK;
+  }
+
+  diff = patch_diff(fields, parent.fields);
+  json_decref(parent.fields);
+  if (diff == NULL) {
+    return MMDB_OK;
+  }
+
+  delta = json_dumps(diff, JSON_COMPACT | JSON_ENSURE_ASCII | JSON_SORT_KEYS);
+  json_decref(diff);
+  if (delta == NULL) {
+    return MMDB_ERROR;
+  }
+
+  if (q_exec0(db->db, query_delta_store, "ssls", delta, rev, docid,
+              parent_rev) != MMDB_OK ||
+      q_exec0(db->db, query_delta_chain, "lls", parent.chain + 1, docid,
+              rev) != MMDB_OK ||
+      q_exec0(db->db, query_unref_body, "b", parent.body,
+              sizeof(parent.body)) != MMDB_OK ||
+      q_exec0(db->db, query_delete_body, "b", parent.body,
+              sizeof(parent.body)) != MMDB_OK) {
+    rc = MMDB_ERROR;
+  }
+
+  free(delta);
+
+  return rc;
+}
+
+int mmdb_has_attachment_cb(sqlite3_stmt *stmt, void *ptr) {
+  int *found = ptr;
+
+  *found = stmt != NULL;
+
+  return MMDB_OK;
+}
+
+int mmdb_put_attachments(mmdb_t *db, sqlite3_int64 docid, const char *rev,
+                         const char *parent, mmdb_put_options_t *opts) {
+  int i = 0, found = 0;
+  mmdb_attachment_t *att = NULL;
+
+  if (parent != NULL &&
+      q_exec0(db->db, query_copy_attachments, "sls", rev, docid, parent) !=
+          MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  for (i = 0; opts != NULL && i < opts->attachments_total; i++) {
+    att = &opts->attachments[i];
+
+    if (q_exec0(db->db, query_remove_rev_attachment, "lss", docid, rev,
+                att->name) != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+
+    if (att->data == NULL) {
+      continue;
+    }
+
+    if (q_exec1(db->db, query_has_attachment, &found, mmdb_has_attachment_cb,
+                "blb", att->digest, sizeof(att->digest),
+                (sqlite3_int64)att->length, att->data,
+                att->length) != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+
+    if (!found && q_exec0(db->db, query_insert_attachment, "blb", att->digest,
+                          sizeof(att->digest), (sqlite3_int64)att->length,
+                          att->data, att->length) != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+
+    if (q_exec0(db->db, query_insert_rev_attachment, "lsssbl", docid, rev,
+                att->name, att->type, att->digest, sizeof(att->digest),
+                (sqlite3_int64)att->length) != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+  }
 
-int mmdb_open(const char *filename, mmdb_t **db) {
-  mmdb_t *r = NULL;
+  return MMDB_OK;
+}
 
-  r = malloc(sizeof(mmdb_t));
-  memset(r, 0, sizeof(mmdb_t));
+int mmdb_attachments_cb(sqlite3_stmt *stmt, void *ptr) {
+  mmdb_attachments_t *out = ptr;
+  mmdb_attachment_t att;
+  sqlite3_int64 length = 0;
 
-  if (sqlite3_open(filename, &r->db) != SQLITE_OK) {
-    return MMDB_ERROR;
-  }
+  memset(&att, 0, sizeof(att));
 
-  if (sqlite3_exec(r->db, query_init, NULL, NULL, NULL) != SQLITE_OK) {
+  if (q_scan(stmt, "ssbl", att.name, sizeof(att.name), att.type,
+             sizeof(att.type), att.digest, sizeof(att.digest),
+             &length) != MMDB_OK) {
     return MMDB_ERROR;
   }
+  att.length = length;
 
-  *db = r;
+  mmdb_attachments_push(out, &att);
 
   return MMDB_OK;
 }
 
-int mmdb_close(mmdb_t *db) {
-  if (db == NULL) {
-    return MMDB_OK;
-  }
+int mmdb_attachments(mmdb_t *db, mmdb_attachments_t *out, const char *id,
+                     const char *rev) {
+  sqlite3_int64 docid = 0;
+  int rc;
 
-  if (db->open == 0) {
-    return MMDB_OK;
+  db = mmdb_shard(db, id);
+
+  if ((rc = mmdb_docid(db, id, &docid)) != MMDB_OK) {
+    return rc == MMDB_NOT_FOUND ? MMDB_OK : MMDB_ERROR;
   }
 
-  switch (sqlite3_close(db->db)) {
-    case SQLITE_BUSY:
-      return MMDB_BUSY;
-    case SQLITE_OK:
-      return MMDB_OK;
-    default:
-      return MMDB_ERROR;
+  if (rev == NULL) {
+    return q_exec2(db->db, query_attachments_current, out, mmdb_attachments_cb,
+                   "l", docid);
   }
+
+  return q_exec2(db->db, query_attachments, out, mmdb_attachments_cb, "ls",
+                 docid, rev);
 }
 
-int mmdb_get_cb(sqlite3_stmt *stmt, void *ptr) {
-  mmdb_doc_t *out = ptr;
-  char id[MMDB_MAX_ID_LENGTH], rev[MMDB_MAX_REV_LENGTH],
-      fields[MMDB_MAX_DATA_LENGTH];
+int mmdb_attachment_open_cb(sqlite3_stmt *stmt, void *ptr) {
+  sqlite3_int64 *row = ptr;
 
   if (stmt == NULL) {
-    mmdb_doc_clear(out);
+    row[0] = 0;
     return MMDB_OK;
   }
 
-  if (q_scan(stmt, "sss", id, sizeof(id), rev, sizeof(rev), fields,
-             sizeof(fields)) != MMDB_OK) {
+  return q_scan(stmt, "ll", &row[0], &row[1]);
+}
+
+int mmdb_attachment_open(mmdb_t *db, mmdb_attachment_stream_t *out,
+                         const char *id, const char *rev, const char *name) {
+  int rc = 0;
+  sqlite3_int64 row[2] = {0, 0}, docid = 0;
+
+  db = mmdb_shard(db, id);
+
+  memset(out, 0, sizeof(mmdb_attachment_stream_t));
+
+  if ((rc = mmdb_docid(db, id, &docid)) != MMDB_OK) {
+    return rc;
+  }
+
+  if (rev == NULL) {
+    rc = q_exec1(db->db, query_attachment_open_current, row,
+                 mmdb_attachment_open_cb, "ls", docid, name);
+  } else {
+    rc = q_exec1(db->db, query_attachment_open, row, mmdb_attachment_open_cb,
+                 "lss", docid, rev, name);
+  }
+
+  if (rc != MMDB_OK) {
     return MMDB_ERROR;
   }
 
-  if (mmdb_doc_new(out, id, rev, fields) != MMDB_OK) {
-    mmdb_doc_clear(out);
+  if (row[0] == 0) {
+    return MMDB_NOT_FOUND;
+  }
+
+  if (sqlite3_blob_open(db->db, "main", "attachments", "data", row[0], 0,
+                        &out->blob) != SQLITE_OK) {
     return MMDB_ERROR;
   }
 
+  out->length = row[1];
+
   return MMDB_OK;
 }
 
-int mmdb_get(mmdb_t *db, mmdb_doc_t *out, const char *id) {
-  return q_exec1(db->db, query_get, out, mmdb_get_cb, "s", id);
-}
+int mmdb_attachment_read(mmdb_attachment_stream_t *stream, void *buf, size_t n,
+                         size_t *nread) {
+  size_t len;
 
-int mmdb_get_rev(mmdb_t *db, mmdb_doc_t *out, const char *id, const char *rev) {
-  return q_exec1(db->db, query_get_rev, out, mmdb_get_cb, "ss", id, rev);
-}
+  *nread = 0;
 
-int mmdb_revs_cb(sqlite3_stmt *stmt, void *ptr) {
-  mmdb_revs_t *out = ptr;
-  const char rev[MMDB_MAX_REV_LENGTH];
+  if (stream->offset >= stream->length) {
+    return MMDB_DONE;
+  }
+
+  // never more than what's left, which sqlite keeps within an int
+  len = (size_t)(stream->length - stream->offset);
+  if (n < len) {
+    len = n;
+  }
 
-  if (q_scan(stmt, "s", rev, sizeof(rev)) != MMDB_OK) {
+  if (sqlite3_blob_read(stream->blob, buf, (int)len, stream->offset) !=
+      SQLITE_OK) {
     return MMDB_ERROR;
   }
 
-  mmdb_revs_push_copyn(out, rev, sizeof(rev));
+  stream->offset += len;
+  *nread = len;
 
   return MMDB_OK;
 }
 
-int mmdb_revs(mmdb_t *db, mmdb_revs_t *out, const char *id) {
-  return q_exec2(db->db, query_revs, out, mmdb_revs_cb, "s", id);
-}
+int mmdb_attachment_close(mmdb_attachment_stream_t *stream) {
+  if (stream->blob == NULL) {
+    return MMDB_OK;
+  }
 
-int mmdb_insert_doc(mmdb_t *db, const char *id, const char *rev) {
-  return q_exec0(db->db, query_insert_doc, "ss", id, rev);
-}
+  if (sqlite3_blob_close(stream->blob) != SQLITE_OK) {
+    return MMDB_ERROR;
+  }
 
-int mmdb_insert_rev(mmdb_t *db, const char *id, const char *rev,
-                    const char *fields) {
-  return q_exec0(db->db, query_insert_rev, "sss", id, rev, fields);
-}
+  stream->blob = NULL;
 
-int mmdb_remove_leaf(mmdb_t *db, const char *id, const char *rev) {
-  return q_exec0(db->db, query_remove_leaf, "ss", id, rev);
+  return MMDB_OK;
 }
 
-int mmdb_update_doc(mmdb_t *db, const char *id, const char *rev) {
-  return q_exec0(db->db, query_update_doc, "ss", rev, id);
-}
+// lines read per round; each round is parsed and hashed across the threads
+// and then inserted in input order
+#define MMDB_IMPORT_BATCH 4096
+
+typedef struct mmdb_import_item_s {
+  char *line;
+  size_t line_len;
+  mmdb_doc_t doc;
+  char rev[MMDB_MAX_REV_LENGTH];
+  char *body;
+  size_t body_len;
+  unsigned char body_hash[16];
+  int rc;
+} mmdb_import_item_t;
+
+typedef struct mmdb_import_worker_s {
+  pthread_t thread;
+  int started;
+  mmdb_t *db;
+  mmdb_import_item_t *items;
+  int total;
+  int offset;
+  int step;
+} mmdb_import_worker_t;
+
+int mmdb_import_prepare(mmdb_t *db, mmdb_import_item_t *item) {
+  json_t *v = NULL, *id = NULL, *rev = NULL;
+  json_error_t err;
+  size_t n;
+  mmdb_rev_t next;
 
-int mmdb_put_cb(sqlite3_stmt *stmt, void *ptr) {
-  char str[MMDB_MAX_REV_LENGTH];
-  mmdb_rev_t *current_rev = ptr;
+  memset(&item->doc, 0, sizeof(item->doc));
 
-  if (stmt == NULL) {
-    mmdb_rev_clear(current_rev);
-    return MMDB_OK;
+  if ((v = json_loadb(item->line, item->line_len, 0, &err)) == NULL ||
+      !json_is_object(v)) {
+    json_decref(v);
+    return MMDB_ERROR;
   }
 
-  if (q_scan(stmt, "s", str, sizeof(str)) != MMDB_OK) {
+  if ((id = json_object_get(v, "_id")) == NULL || !json_is_string(id) ||
+      mmdb_doc_set_id(&item->doc, json_string_value(id)) != MMDB_OK) {
+    json_decref(v);
     return MMDB_ERROR;
   }
 
-  if (mmdb_rev_new(current_rev, str) != MMDB_OK) {
+  // an exported revision is kept as is, so exports round-trip exactly
+  if ((rev = json_object_get(v, "_rev")) != NULL &&
+      (!json_is_string(rev) ||
+       mmdb_rev_parse(&item->doc.rev, json_string_value(rev)) != MMDB_OK)) {
+    json_decref(v);
     return MMDB_ERROR;
   }
 
-  return MMDB_OK;
-}
+  json_object_del(v, "_id");
+  json_object_del(v, "_rev");
+  mmdb_doc_set_fields_new(&item->doc, v);
+
+  // sized exactly, since a whole batch of these is held at once
+  if ((n = json_dumpb(v, NULL, 0,
+                      JSON_COMPACT | JSON_ENSURE_ASCII | JSON_SORT_KEYS)) ==
+          0 ||
+      n > MMDB_MAX_DATA_LENGTH - 1 || (item->body = malloc(n + 1)) == NULL ||
+      json_dumpb(v, item->body, n,
+                 JSON_COMPACT | JSON_ENSURE_ASCII | JSON_SORT_KEYS) != n) {
+    return MMDB_ERROR;
+  }
+  item->body[n] = 0;
+  item->body_len = n;
 
-int mmdb_put(mmdb_t *db, mmdb_rev_t *out_rev, mmdb_doc_t *doc,
-             mmdb_put_options_t *opts) {
-  mmdb_rev_t current_rev;
+  if (mmdb_body_hash(db, item->body_hash, item->body, n) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
 
-  if (q_exec1(db->db, query_rev, &current_rev, mmdb_put_cb, "s", doc->id) !=
+  if (item->doc.rev.seq > 0) {
+    return mmdb_rev_format(item->rev, sizeof(item->rev), &item->doc.rev);
+  }
+
+  if (mmdb_rev_hash(&next, db->hash, &item->doc, item->body, n, NULL, 0) !=
       MMDB_OK) {
     return MMDB_ERROR;
   }
 
-  if (current_rev.seq == 0) {
-    return mmdb_put_new(db, out_rev, doc, opts);
+  return mmdb_rev_format(item->rev, sizeof(item->rev), &next);
+}
+
+void *mmdb_import_worker(void *ptr) {
+  mmdb_import_worker_t *w = ptr;
+  int i;
+
+  for (i = w->offset; i < w->total; i += w->step) {
+    w->items[i].rc = mmdb_import_prepare(w->db, &w->items[i]);
   }
 
-  return mmdb_put_update(db, out_rev, doc, &current_rev, opts);
+  return NULL;
 }
 
-int mmdb_put_new(mmdb_t *db, mmdb_rev_t *out_rev, mmdb_doc_t *doc,
-                 mmdb_put_options_t *opts) {
-  char rev[MMDB_MAX_REV_LENGTH], fields[MMDB_MAX_DATA_LENGTH];
-  size_t n;
-
-  if (mmdb_rev_next(out_rev, doc) != MMDB_OK) {
+// inserts straight into the tables, for an empty database where there's
+// nothing to look up or conflict with; a repeated id trips the unique
+// constraint on docs. search indexes and views are filled once at the end,
+// since without the revs indexes each document's update would scan them all
+int mmdb_import_insert(mmdb_t *db, sqlite3_stmt **stmts,
+                       mmdb_import_item_t *item) {
+  sqlite3_int64 docid = 0;
+  int i;
+
+  if (q_bind(stmts[0], "bs", item->body_hash, sizeof(item->body_hash),
+             item->body) != MMDB_OK ||
+      q_bind(stmts[1], "ss", item->doc.id, item->rev) != MMDB_OK) {
     return MMDB_ERROR;
   }
 
-  if (mmdb_rev_format(rev, sizeof(rev), out_rev) != MMDB_OK) {
-    return MMDB_ERROR;
+  for (i = 0; i < 3; i++) {
+    // the revision needs the key the docs row was just given
+    if (i == 2) {
+      docid = sqlite3_last_insert_rowid(db->db);
+      if (q_bind(stmts[2], "lsb", docid, item->rev, item->body_hash,
+                 sizeof(item->body_hash)) != MMDB_OK) {
+        return MMDB_ERROR;
+      }
+    }
+
+    if (sqlite3_step(stmts[i]) != SQLITE_DONE) {
+      sqlite3_reset(stmts[i]);
+      return MMDB_ERROR;
+    }
+    sqlite3_reset(stmts[i]);
+
+    // the body's hash is taken by different bytes
+    if (i == 0 && sqlite3_changes(db->db) == 0) {
+      return MMDB_ERROR;
+    }
   }
 
-  if ((n = json_dumpb(doc->fields, fields, sizeof(fields) - 1,
-                      JSON_COMPACT | JSON_ENSURE_ASCII | JSON_SORT_KEYS)) >
-      sizeof(fields) - 1) {
-    return MMDB_ERROR;
+  return presence_add(db, item->doc.id);
+}
+
+// the same, but for a database that already has documents; loading one that
+// exists is a conflict rather than an update
+int mmdb_import_checked(mmdb_t *db, mmdb_import_item_t *item) {
+  mmdb_docid_entry_t entry;
+  sqlite3_int64 docid = 0;
+
+  db = mmdb_shard(db, item->doc.id);
+
+  switch (mmdb_docid_lookup(db, item->doc.id, &entry)) {
+    case MMDB_OK:
+      if (!mmdb_expired(entry.expires)) {
+        return MMDB_CONFLICT;
+      }
+      if (mmdb_expire_doc(db, entry.docid, item->doc.id) != MMDB_OK) {
+        return MMDB_ERROR;
+      }
+      break;
+    case MMDB_NOT_FOUND:
+      break;
+    default:
+      return MMDB_ERROR;
   }
-  fields[n] = 0;
 
-  if (mmdb_insert_rev(db, doc->id, rev, fields) != MMDB_OK) {
+  if (mmdb_insert_doc(db, &docid, item->doc.id, item->rev) != MMDB_OK) {
     return MMDB_ERROR;
   }
 
-  if (mmdb_insert_doc(db, doc->id, rev) != MMDB_OK) {
+  if (mmdb_insert_rev(db, docid, item->rev, NULL, item->body,
+                      item->body_len) != MMDB_OK) {
     return MMDB_ERROR;
   }
 
-  return MMDB_OK;
+  return mmdb_index_doc(db, docid);
 }
 
-int mmdb_put_update(mmdb_t *db, mmdb_rev_t *out_rev, mmdb_doc_t *doc,
-                    mmdb_rev_t *current_rev, mmdb_put_options_t *opts) {
-  int cmp = 0;
-  char rev[MMDB_MAX_REV_LENGTH], old_rev[MMDB_MAX_REV_LENGTH],
-      fields[MMDB_MAX_DATA_LENGTH];
-  size_t n;
+int mmdb_import_read(FILE *in, mmdb_import_item_t *items, int *n) {
+  size_t cap = 0;
+  ssize_t len;
+  char *line = NULL;
 
-  cmp = mmdb_rev_cmp(&doc->rev, current_rev);
+  *n = 0;
 
-  if (cmp != 0 && (opts == NULL || opts->allow_conflict == 0)) {
-    return MMDB_CONFLICT;
+  while (*n < MMDB_IMPORT_BATCH) {
+    line = NULL;
+    cap = 0;
+
+    if ((len = getline(&line, &cap, in)) < 0) {
+      free(line);
+      return ferror(in) ? MMDB_ERROR : MMDB_OK;
+    }
+
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      line[--len] = 0;
+    }
+
+    if (len == 0) {
+      free(line);
+      continue;
+    }
+
+    memset(&items[*n], 0, sizeof(mmdb_import_item_t));
+    items[*n].line = line;
+    items[*n].line_len = len;
+    (*n)++;
   }
 
-  if (mmdb_rev_next(out_rev, doc) != MMDB_OK) {
-    return MMDB_ERROR;
+  return MMDB_OK;
+}
+
+// loads new documents from newline-delimited json objects, each with an _id
+// and optionally the _rev written by mmdb_export; all or nothing is loaded
+int mmdb_import(mmdb_t *db, FILE *in, int threads, size_t *total) {
+  mmdb_import_item_t *items = NULL;
+  mmdb_import_worker_t *workers = NULL;
+  sqlite3_stmt *stmts[3] = {NULL, NULL, NULL};
+  const char *sql[3] = {query_import_body, query_insert_doc, query_insert_rev};
+  int i, n = 0, fast = 0, found = 0, failed = 0;
+
+  if (total != NULL) {
+    *total = 0;
   }
 
-  if (mmdb_rev_format(rev, sizeof(rev), out_rev) != MMDB_OK) {
+  if (threads <= 0) {
+    threads = 1;
+  }
+
+  if (db->shards == NULL &&
+      q_exec1(db->db, query_has_docs, &found, mmdb_exists_cb, "") !=
+          MMDB_OK) {
     return MMDB_ERROR;
   }
-  if (mmdb_rev_format(old_rev, sizeof(old_rev), current_rev) != MMDB_OK) {
+  fast = db->shards == NULL && !found;
+
+  items = calloc(MMDB_IMPORT_BATCH, sizeof(mmdb_import_item_t));
+  workers = calloc(threads, sizeof(mmdb_import_worker_t));
+  if (items == NULL || workers == NULL) {
+    free(items);
+    free(workers);
     return MMDB_ERROR;
   }
 
-  if ((n = json_dumpb(doc->fields, fields, sizeof(fields) - 1,
-                      JSON_COMPACT | JSON_ENSURE_ASCII | JSON_SORT_KEYS)) >
-      sizeof(fields) - 1) {
+  for (i = 0; i < db->shards_total; i++) {
+    if (mmdb_begin(db->shards[i]) != MMDB_OK) {
+      for (i--; i >= 0; i--) {
+        mmdb_rollback(db->shards[i]);
+      }
+      free(items);
+      free(workers);
+      return MMDB_ERROR;
+    }
+  }
+
+  if (db->shards == NULL && mmdb_begin(db) != MMDB_OK) {
+    free(items);
+    free(workers);
     return MMDB_ERROR;
   }
-  fields[n] = 0;
 
-  if (mmdb_insert_rev(db, doc->id, rev, fields) != MMDB_OK) {
+  if (fast && sqlite3_exec(db->db, query_import_drop_indexes, NULL, NULL,
+                           NULL) != SQLITE_OK) {
+    failed = 1;
+  }
+
+  for (i = 0; fast && !failed && i < 3; i++) {
+    if (sqlite3_prepare_v2(db->db, sql[i], strlen(sql[i]), &stmts[i], NULL) !=
+        SQLITE_OK) {
+      failed = 1;
+    }
+  }
+
+  while (!failed) {
+    if (mmdb_import_read(in, items, &n) != MMDB_OK) {
+      failed = 1;
+    }
+
+    if (n == 0) {
+      break;
+    }
+
+    for (i = 0; i < threads; i++) {
+      workers[i].db = db->shards != NULL ? db->shards[0] : db;
+      workers[i].items = items;
+      workers[i].total = n;
+      workers[i].offset = i;
+      workers[i].step = threads;
+
+      workers[i].started = pthread_create(&workers[i].thread, NULL,
+                                          mmdb_import_worker,
+                                          &workers[i]) == 0;
+      if (!workers[i].started) {
+        mmdb_import_worker(&workers[i]);
+      }
+    }
+
+    for (i = 0; i < threads; i++) {
+      if (workers[i].started) {
+        pthread_join(workers[i].thread, NULL);
+      }
+    }
+
+    for (i = 0; i < n; i++) {
+      if (!failed && items[i].rc != MMDB_OK) {
+        failed = 1;
+      }
+
+      if (!failed && fast &&
+          mmdb_import_insert(db, stmts, &items[i]) != MMDB_OK) {
+        failed = 1;
+      }
+
+      if (!failed && !fast &&
+          mmdb_import_checked(db, &items[i]) != MMDB_OK) {
+        failed = 1;
+      }
+
+      if (!failed && total != NULL) {
+        (*total)++;
+      }
+
+      free(items[i].line);
+      free(items[i].body);
+      mmdb_doc_clear(&items[i].doc);
+    }
+  }
+
+  for (i = 0; i < 3; i++) {
+    sqlite3_finalize(stmts[i]);
+  }
+
+  if (fast && !failed &&
+      (sqlite3_exec(db->db, query_import_create_indexes, NULL, NULL, NULL) !=
+           SQLITE_OK ||
+       search_fill(db) != MMDB_OK || view_fill(db) != MMDB_OK)) {
+    failed = 1;
+  }
+
+  for (i = 0; i < db->shards_total; i++) {
+    if (failed) {
+      mmdb_rollback(db->shards[i]);
+    } else if (mmdb_commit(db->shards[i]) != MMDB_OK) {
+      failed = 1;
+    }
+  }
+
+  if (db->shards == NULL) {
+    if (failed) {
+      mmdb_rollback(db);
+    } else if (mmdb_commit(db) != MMDB_OK) {
+      failed = 1;
+    }
+  }
+
+  free(items);
+  free(workers);
+
+  return failed ? MMDB_ERROR : MMDB_OK;
+}
+
+int mmdb_export_cb(mmdb_doc_t *doc, void *ptr) {
+  FILE *out = ptr;
+  char rev[MMDB_MAX_REV_LENGTH];
+  json_t *v = NULL;
+  int rc;
+
+  if (mmdb_rev_format(rev, sizeof(rev), &doc->rev) != MMDB_OK) {
     return MMDB_ERROR;
   }
 
-  if (cmp == 0 && mmdb_remove_leaf(db, doc->id, rev) != MMDB_OK) {
+  if ((v = json_copy(doc->fields)) == NULL) {
     return MMDB_ERROR;
   }
 
-  if (cmp >= 0 && mmdb_update_doc(db, doc->id, rev) != MMDB_OK) {
+  json_object_set_new(v, "_id", json_string(doc->id));
+  json_object_set_new(v, "_rev", json_string(rev));
+
+  rc = json_dumpf(v, out, JSON_COMPACT | JSON_SORT_KEYS);
+  json_decref(v);
+
+  if (rc != 0 || fputc('\n', out) == EOF) {
     return MMDB_ERROR;
   }
 
   return MMDB_OK;
 }
 
+// writes the current revision of every document, in id order
+int mmdb_export(mmdb_t *db, FILE *out) {
+  if (mmdb_scan(db, NULL, 0, mmdb_export_cb, out) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  return fflush(out) == 0 ? MMDB_OK : MMDB_ERROR;
+}
+
 int mmdb_doc_new(mmdb_doc_t *out, const char *id, const char *rev,
                  const char *fields) {
   if (mmdb_doc_set_id(out, id) != MMDB_OK) {
@@ -357,33 +3729,193 @@ int mmdb_revs_new(mmdb_revs_t *revs) {
   return MMDB_OK;
 }
 
+void mmdb_revs_reset(mmdb_revs_t *revs) {
+  revs->total = 0;
+  revs->size = 0;
+  revs->revs = NULL;
+  mmdb_arena_reset(&revs->arena);
+}
+
 void mmdb_revs_free(mmdb_revs_t *revs) {
   if (revs == NULL) {
     return;
   }
 
-  while (revs->total > 0) {
-    free((char *)(revs->revs[revs->total - 1]));
-    revs->total--;
+  mmdb_arena_free(&revs->arena);
+  revs->total = 0;
+  revs->size = 0;
+  revs->revs = NULL;
+}
+
+int mmdb_revs_push(mmdb_revs_t *revs, mmdb_rev_t *rev) {
+  int size = 0;
+  mmdb_rev_t *p = NULL;
+
+  if (revs->total == revs->size) {
+    size = revs->size ? revs->size * 2 : 16;
+
+    if ((p = mmdb_arena_grow(&revs->arena, revs->revs,
+                             sizeof(mmdb_rev_t) * revs->size,
+                             sizeof(mmdb_rev_t) * size)) == NULL) {
+      return MMDB_ERROR;
+    }
+
+    revs->revs = p;
+    revs->size = size;
+  }
+
+  mmdb_rev_copy(&revs->revs[revs->total++], rev);
+
+  return MMDB_OK;
+}
+
+int mmdb_revs_format(mmdb_revs_t *revs, int i, char *out, size_t n) {
+  if (i < 0 || i >= revs->total) {
+    return MMDB_ERROR;
+  }
+
+  return mmdb_rev_format(out, n, &revs->revs[i]);
+}
+
+int mmdb_docs_new(mmdb_docs_t *docs) {
+  memset(docs, 0, sizeof(mmdb_docs_t));
+  return MMDB_OK;
+}
+
+void mmdb_docs_reset(mmdb_docs_t *docs) {
+  int i = 0;
+
+  for (i = 0; i < docs->total; i++) {
+    json_decref(docs->docs[i].fields);
+  }
+
+  docs->total = 0;
+  docs->docs = NULL;
+  mmdb_arena_reset(&docs->arena);
+}
+
+void mmdb_docs_free(mmdb_docs_t *docs) {
+  if (docs == NULL) {
+    return;
+  }
+
+  mmdb_docs_reset(docs);
+  mmdb_arena_free(&docs->arena);
+}
+
+void mmdb_arena_init(mmdb_arena_t *arena) { arena->head = NULL; }
+
+void *mmdb_arena_alloc(mmdb_arena_t *arena, size_t n) {
+  mmdb_arena_block_t *block = arena->head;
+  size_t size = 0;
+  void *ptr = NULL;
+
+  n = MMDB_ARENA_ALIGN(n);
+
+  if (block == NULL || block->size - block->used < n) {
+    size = block != NULL ? block->size * 2 : MMDB_ARENA_MIN_BLOCK;
+    while (size < n) {
+      size *= 2;
+    }
+
+    if ((block = malloc(sizeof(mmdb_arena_block_t) + size)) == NULL) {
+      return NULL;
+    }
+
+    block->next = arena->head;
+    block->size = size;
+    block->used = 0;
+    arena->head = block;
+  }
+
+  ptr = block->data + block->used;
+  block->used += n;
+
+  return ptr;
+}
+
+void *mmdb_arena_grow(mmdb_arena_t *arena, void *ptr, size_t old_n,
+                      size_t new_n) {
+  mmdb_arena_block_t *block = arena->head;
+  void *r = NULL;
+
+  old_n = MMDB_ARENA_ALIGN(old_n);
+  new_n = MMDB_ARENA_ALIGN(new_n);
+
+  // the most recent allocation can be extended in place while there's room
+  if (ptr != NULL && block != NULL &&
+      (char *)ptr + old_n == block->data + block->used &&
+      block->size - block->used >= new_n - old_n) {
+    block->used += new_n - old_n;
+    return ptr;
+  }
+
+  if ((r = mmdb_arena_alloc(arena, new_n)) == NULL) {
+    return NULL;
+  }
+
+  if (ptr != NULL) {
+    memcpy(r, ptr, old_n);
+  }
+
+  return r;
+}
+
+void mmdb_arena_reset(mmdb_arena_t *arena) {
+  mmdb_arena_block_t *block = NULL;
+
+  if (arena->head == NULL) {
+    return;
+  }
+
+  // the head block is always the largest, so it's the one worth keeping
+  while ((block = arena->head->next) != NULL) {
+    arena->head->next = block->next;
+    free(block);
   }
 
-  free(revs->revs);
+  arena->head->used = 0;
+}
+
+void mmdb_arena_free(mmdb_arena_t *arena) {
+  mmdb_arena_reset(arena);
+  free(arena->head);
+  arena->head = NULL;
+}
 
-  free(revs);
+int mmdb_attachments_new(mmdb_attachments_t *atts) {
+  memset(atts, 0, sizeof(mmdb_attachments_t));
+  return MMDB_OK;
 }
 
-void mmdb_revs_push(mmdb_revs_t *revs, char const *str) {
-  revs->total++;
-  revs->revs = realloc(revs->revs, sizeof(char const *) * revs->total);
-  revs->revs[revs->total - 1] = str;
+void mmdb_attachments_free(mmdb_attachments_t *atts) {
+  if (atts == NULL) {
+    return;
+  }
+
+  free(atts->attachments);
+  memset(atts, 0, sizeof(mmdb_attachments_t));
 }
 
-void mmdb_revs_push_copyn(mmdb_revs_t *revs, char const *str, size_t n) {
-  mmdb_revs_push(revs, strndup(str, n));
+void mmdb_attachments_push(mmdb_attachments_t *atts, mmdb_attachment_t *att) {
+  atts->total++;
+  atts->attachments = realloc(atts->attachments,
+                              sizeof(mmdb_attachment_t) * atts->total);
+  memcpy(&atts->attachments[atts->total - 1], att, sizeof(mmdb_attachment_t));
+  atts->attachments[atts->total - 1].data = NULL;
 }
 
-void mmdb_revs_push_copy(mmdb_revs_t *revs, char const *str) {
-  mmdb_revs_push(revs, strdup(str));
+int mmdb_attachment_digest(mmdb_t *db, mmdb_attachment_t *att) {
+  if (att->data == NULL) {
+    return MMDB_OK;
+  }
+
+  if (strlen(att->name) == 0) {
+    return MMDB_ERROR;
+  }
+
+  return hash_oneshot(db->hash, att->digest, sizeof(att->digest), att->data,
+                      att->length);
 }
 
 int mmdb_rev_new(mmdb_rev_t *out, const char *str) {
@@ -467,14 +3999,8 @@ int mmdb_rev_cmp(mmdb_rev_t *a, mmdb_rev_t *b) {
 }
 
 int mmdb_rev_next(mmdb_rev_t *out, mmdb_doc_t *doc) {
-  char rev[MMDB_MAX_REV_LENGTH], fields[MMDB_MAX_DATA_LENGTH];
+  char fields[MMDB_MAX_DATA_LENGTH];
   size_t len;
-  MD5_CTX md5;
-  unsigned char digest[16];
-
-  if (mmdb_rev_format(rev, sizeof(rev), &doc->rev) != MMDB_OK) {
-    return MMDB_ERROR;
-  }
 
   if ((len = json_dumpb(doc->fields, fields, sizeof(fields),
                         JSON_COMPACT | JSON_ENSURE_ASCII | JSON_SORT_KEYS)) >
@@ -482,26 +4008,44 @@ int mmdb_rev_next(mmdb_rev_t *out, mmdb_doc_t *doc) {
     return MMDB_ERROR;
   }
 
-  if (MD5_Init(&md5) == 0) {
-    return MMDB_ERROR;
-  }
-  if (MD5_Update(&md5, doc->id, MMDB_MIN(strlen(doc->id), sizeof(doc->id))) ==
-      0) {
-    return MMDB_ERROR;
-  }
-  if (MD5_Update(&md5, ",", 1) == 0) {
-    return MMDB_ERROR;
-  }
-  if (MD5_Update(&md5, rev, MMDB_MIN(strlen(rev), sizeof(rev))) == 0) {
+  // without a database to ask, this is always the compatible algorithm
+  return mmdb_rev_hash(out, MMDB_HASH_MD5, doc, fields, len, NULL, 0);
+}
+
+// fields must be the canonical serialisation of doc->fields; callers that
+// also store the body pass the same buffer so it's only serialised once
+int mmdb_rev_hash(mmdb_rev_t *out, int algorithm, mmdb_doc_t *doc,
+                  const char *fields, size_t len, mmdb_attachment_t *atts,
+                  int atts_total) {
+  char rev[MMDB_MAX_REV_LENGTH];
+  int i, failed = 0;
+  hash_t h;
+
+  if (mmdb_rev_format(rev, sizeof(rev), &doc->rev) != MMDB_OK) {
     return MMDB_ERROR;
   }
-  if (MD5_Update(&md5, ",", 1) == 0) {
+
+  if (hash_init(&h, algorithm) != MMDB_OK) {
     return MMDB_ERROR;
   }
-  if (MD5_Update(&md5, fields, len) == 0) {
-    return MMDB_ERROR;
+
+  // keep going after a failure so the context is always released below
+  failed = failed || hash_update(&h, doc->id, MMDB_MIN(strlen(doc->id),
+                                                       sizeof(doc->id)));
+  failed = failed || hash_update(&h, ",", 1);
+  failed = failed || hash_update(&h, rev, MMDB_MIN(strlen(rev), sizeof(rev)));
+  failed = failed || hash_update(&h, ",", 1);
+  failed = failed || hash_update(&h, fields, len);
+  // attachment changes are part of the revision, so two revisions that only
+  // differ in their attachments don't collide
+  for (i = 0; i < atts_total; i++) {
+    failed = failed || hash_update(&h, ",", 1);
+    failed = failed || hash_update(&h, atts[i].name, strlen(atts[i].name));
+    failed = failed || (atts[i].data != NULL &&
+                        hash_update(&h, atts[i].digest, sizeof(atts[i].digest)));
   }
-  if (MD5_Final(out->hash, &md5) == 0) {
+
+  if (hash_final(&h, out->hash, sizeof(out->hash)) != MMDB_OK || failed) {
     return MMDB_ERROR;
   }
 
@@ -509,3 +4053,26 @@ int mmdb_rev_next(mmdb_rev_t *out, mmdb_doc_t *doc) {
 
   return MMDB_OK;
 }
+
+int mmdb_body_hash(mmdb_t *db, unsigned char *out, const char *fields,
+                   size_t len) {
+  return hash_oneshot(db->hash, out, 16, fields, len);
+}
+
+void mmdb_body_hash_fn(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+  mmdb_t *db = sqlite3_user_data(ctx);
+  unsigned char hash[16];
+
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    sqlite3_result_null(ctx);
+    return;
+  }
+
+  if (mmdb_body_hash(db, hash, (const char *)sqlite3_value_text(argv[0]),
+                     sqlite3_value_bytes(argv[0])) != MMDB_OK) {
+    sqlite3_result_error(ctx, "mmdb_body_hash: couldn't hash body", -1);
+    return;
+  }
+
+  sqlite3_result_blob(ctx, hash, sizeof(hash), SQLITE_TRANSIENT);
+}
@@ -5,15 +5,60 @@
 #define MMDB_NOT_FOUND 100
 #define MMDB_CONFLICT 101
 
+#define MMDB_CHECKPOINT_PASSIVE SQLITE_CHECKPOINT_PASSIVE
+#define MMDB_CHECKPOINT_FULL SQLITE_CHECKPOINT_FULL
+#define MMDB_CHECKPOINT_RESTART SQLITE_CHECKPOINT_RESTART
+#define MMDB_CHECKPOINT_TRUNCATE SQLITE_CHECKPOINT_TRUNCATE
+
+#define MMDB_HASH_MD5 0
+#define MMDB_HASH_BLAKE3 1
+// not cryptographic: collisions can be made on purpose, so it must not be
+// used for content addressing, and revision ids made with it can be forged.
+// only for documents and attachments that are trusted
+#define MMDB_HASH_XXH3 2
+
+#define MMDB_PATCH_MERGE 0
+#define MMDB_PATCH_JSON 1
+
+#define MMDB_REDUCE_COUNT 0
+#define MMDB_REDUCE_SUM 1
+#define MMDB_REDUCE_MIN 2
+#define MMDB_REDUCE_MAX 3
+#define MMDB_REDUCE_AVG 4
+
 #define MMDB_MAX_ID_LENGTH 40
 #define MMDB_MAX_REV_LENGTH 48
 #define MMDB_MAX_DATA_LENGTH 1024 * 1024
+#define MMDB_MAX_NAME_LENGTH 128
+#define MMDB_MAX_TYPE_LENGTH 128
+#define MMDB_MAX_PRAGMA_LENGTH 16
+#define MMDB_MAX_DELTA_CHAIN 256
 
 typedef struct mmdb_s {
   int open;
   sqlite3 *db;
+  int hash;
+  // set when opened with mmdb_open_sharded; db is unused and every call is
+  // routed to the shard owning the document id
+  struct mmdb_s **shards;
+  int shards_total;
+  // recently used id to integer key lookups, allocated on first use
+  struct mmdb_docids_s *docids;
+  // pragma data_version, prepared on first use by mmdb_data_version
+  sqlite3_stmt *data_version;
+  int delta_chain;
+  // generations of ancestry kept per branch, or zero for all of them
+  int revs_limit;
+  struct mmdb_subs_s *subs;
+  // full-text indexes and aggregate views, kept up to date by every write
+  struct mmdb_search_s *search;
+  struct mmdb_views_s *views;
+  // ids known to exist, if opened with an id filter
+  struct mmdb_presence_s *presence;
 } mmdb_t;
 
+typedef sqlite3_snapshot mmdb_snapshot_t;
+
 typedef struct mmdb_rev_s {
   unsigned int seq;
   unsigned char hash[16];
@@ -25,22 +70,247 @@ typedef struct mmdb_doc_s {
   json_t *fields;
 } mmdb_doc_t;
 
+typedef struct mmdb_arena_block_s {
+  struct mmdb_arena_block_s *next;
+  size_t size;
+  size_t used;
+  char data[];
+} mmdb_arena_block_t;
+
+// bump allocator for result sets; blocks grow geometrically and a reset keeps
+// the largest one, so a reused container stops allocating altogether
+typedef struct mmdb_arena_s {
+  mmdb_arena_block_t *head;
+} mmdb_arena_t;
+
 typedef struct mmdb_revs_s {
   int total;
-  const char **revs;
+  int size;
+  mmdb_rev_t *revs;
+  mmdb_arena_t arena;
 } mmdb_revs_t;
 
+typedef struct mmdb_docs_s {
+  int total;
+  mmdb_doc_t *docs;
+  mmdb_arena_t arena;
+} mmdb_docs_t;
+
+typedef struct mmdb_attachment_s {
+  char name[MMDB_MAX_NAME_LENGTH];
+  char type[MMDB_MAX_TYPE_LENGTH];
+  unsigned char digest[16];
+  size_t length;
+  // only used when writing; NULL removes the attachment from the revision
+  const void *data;
+} mmdb_attachment_t;
+
+typedef struct mmdb_attachments_s {
+  int total;
+  mmdb_attachment_t *attachments;
+} mmdb_attachments_t;
+
+typedef struct mmdb_attachment_stream_s {
+  sqlite3_blob *blob;
+  int offset;
+  int length;
+} mmdb_attachment_stream_t;
+
+// zeroed fields keep sqlite's defaults; on a successful open every field is
+// overwritten with the value actually in effect
+typedef struct mmdb_open_options_s {
+  char journal_mode[MMDB_MAX_PRAGMA_LENGTH];
+  char synchronous[MMDB_MAX_PRAGMA_LENGTH];
+  // pages if positive, KiB if negative
+  int cache_size;
+  sqlite3_int64 mmap_size;
+  // only applies to new files
+  int page_size;
+  int busy_timeout;
+  int read_only;
+  // when positive, revisions that stop being leaves are stored as deltas
+  // against their successor, at most this many deltas from a full body
+  int delta_chain;
+  // when positive, bits per id of an in-memory bloom filter over document
+  // ids, built at open, that lets lookups of missing ids skip sqlite; other
+  // handles must not write to the same file while it's open
+  int id_filter;
+} mmdb_open_options_t;
+
+// counters are since open and summed across shards; all zero without an id
+// filter
+typedef struct mmdb_stats_s {
+  size_t filter_bytes;
+  sqlite3_int64 filter_ids;
+  sqlite3_int64 filter_capacity;
+  int filter_hashes;
+  // expected at the current fill, the worst of any shard
+  double filter_fp_rate;
+  sqlite3_int64 filter_lookups;
+  // lookups answered by the filter alone
+  sqlite3_int64 filter_skipped;
+  // lookups the filter let through for ids that didn't exist
+  sqlite3_int64 filter_false_positives;
+} mmdb_stats_t;
+
+// a document as stored, in its canonical form and never parsed. by default
+// the pointers are borrowed from sqlite's copy of the columns, and they (and
+// the statement holding them open) stay valid until mmdb_raw_release; if buf
+// is set before the call, id, rev and doc are instead copied into it, each
+// nul-terminated, and nothing is held. a buf that's too small is
+// MMDB_ERROR with the lengths still filled in. it must start out zeroed
+// (apart from buf), and each call releases what the last one left
+typedef struct mmdb_raw_s {
+  const char *id;
+  size_t id_len;
+  const char *rev;
+  size_t rev_len;
+  const char *doc;
+  size_t doc_len;
+  char *buf;
+  size_t buf_len;
+  sqlite3_stmt *stmt;
+  // a revision stored as a delta has to be rebuilt, and is kept here
+  char *rebuilt;
+} mmdb_raw_t;
+
+typedef struct mmdb_get_options_s {
+  // if set, filled with the live leaves that lost to the returned revision
+  mmdb_revs_t *conflicts;
+} mmdb_get_options_t;
+
 typedef struct mmdb_put_options_s {
   int allow_conflict;
+  // attachments added to (or removed from) the new revision; everything else
+  // is carried over from the parent revision by reference
+  mmdb_attachment_t *attachments;
+  int attachments_total;
+  // unix time from which the document reads as missing until
+  // mmdb_expire_step removes it; every put replaces it (patches keep it), and
+  // zero never expires
+  sqlite3_int64 expires;
 } mmdb_put_options_t;
 
+typedef struct mmdb_find_options_s {
+  // list of fields, each either "field" or {"field": "asc" or "desc"}
+  json_t *sort;
+  int limit;
+  // where the previous page left off; replaced with a cursor for the next
+  // page if limit rows were found, or NULL otherwise, releasing the old one
+  json_t *cursor;
+  // if set, filled with the query and sqlite's plan for it instead of running
+  char *explain;
+  size_t explain_len;
+} mmdb_find_options_t;
+
+// requests are run by a pool of worker threads and completed through
+// mmdb_async_poll, which invokes the callbacks on the calling thread; output
+// arguments must stay valid until then, and a database with requests in
+// flight must not be used directly
+typedef struct mmdb_async_s mmdb_async_t;
+typedef void (*mmdb_async_cb)(int rc, void *ptr);
+
+// changes are queued when the transaction writing them commits and delivered
+// through mmdb_subscription_poll, which invokes the callback on the calling
+// thread; the fd becomes readable whenever something is queued, and a
+// document that expired is delivered with a zeroed revision
+typedef struct mmdb_subscription_s mmdb_subscription_t;
+typedef void (*mmdb_subscription_cb)(const char *id, mmdb_rev_t *rev,
+                                     void *ptr);
+
+typedef int (*mmdb_scan_cb)(mmdb_doc_t *doc, void *ptr);
+
+// rank is fts5's bm25 score, where lower is a better match
+typedef int (*mmdb_search_cb)(const char *id, mmdb_rev_t *rev, double rank,
+                              void *ptr);
+
+// key and value are only valid during the call
+typedef int (*mmdb_view_cb)(json_t *key, json_t *value, void *ptr);
+
+// called after every backup step; returning anything but MMDB_OK aborts
+typedef int (*mmdb_backup_cb)(int remaining, int total, void *ptr);
+
 int mmdb_open(const char *filename, mmdb_t **db);
+int mmdb_open_v2(const char *filename, mmdb_t **db,
+                 mmdb_open_options_t *opts);
+int mmdb_open_sharded(const char *dir, int n, mmdb_t **db,
+                      mmdb_open_options_t *opts);
 int mmdb_close(mmdb_t *db);
+mmdb_t *mmdb_shard(mmdb_t *db, const char *id);
+int mmdb_data_version(mmdb_t *db, sqlite3_int64 *out);
+// groups writes into one transaction; these nest, and subscribers hear about
+// the writes once the outermost mmdb_commit succeeds; not for sharded handles
+int mmdb_begin(mmdb_t *db);
+int mmdb_commit(mmdb_t *db);
+int mmdb_rollback(mmdb_t *db);
+int mmdb_compact(mmdb_t *db);
+int mmdb_expire_step(mmdb_t *db, int budget);
+int mmdb_backup(mmdb_t *db, const char *dest, int pages_per_step,
+                mmdb_backup_cb cb, void *ptr);
+int mmdb_checkpoint(mmdb_t *db, int mode, int *log, int *checkpointed);
+int mmdb_snapshot_begin(mmdb_t *db);
+int mmdb_snapshot_end(mmdb_t *db);
+int mmdb_snapshot_get(mmdb_t *db, mmdb_snapshot_t **out);
+int mmdb_snapshot_open(mmdb_t *db, mmdb_snapshot_t *snapshot);
+void mmdb_snapshot_free(mmdb_snapshot_t *snapshot);
+int mmdb_set_hash(mmdb_t *db, int hash);
+int mmdb_set_revs_limit(mmdb_t *db, int limit);
+int mmdb_stats(mmdb_t *db, mmdb_stats_t *out);
 int mmdb_get(mmdb_t *db, mmdb_doc_t *out, const char *id);
+int mmdb_get_opts(mmdb_t *db, mmdb_doc_t *out, const char *id,
+                  mmdb_get_options_t *opts);
 int mmdb_get_rev(mmdb_t *db, mmdb_doc_t *out, const char *id, const char *rev);
+int mmdb_get_many(mmdb_t *db, mmdb_docs_t *out, const char **ids, int n);
+int mmdb_get_raw(mmdb_t *db, mmdb_raw_t *out, const char *id);
+int mmdb_get_rev_raw(mmdb_t *db, mmdb_raw_t *out, const char *id,
+                     const char *rev);
+void mmdb_raw_release(mmdb_raw_t *raw);
 int mmdb_revs(mmdb_t *db, mmdb_revs_t *out, const char *id);
+int mmdb_rev_history(mmdb_t *db, mmdb_revs_t *out, const char *id,
+                     const char *rev);
+int mmdb_scan(mmdb_t *db, const char *start, int limit, mmdb_scan_cb cb,
+              void *ptr);
+int mmdb_find(mmdb_t *db, json_t *selector, mmdb_find_options_t *opts,
+              mmdb_scan_cb cb, void *ptr);
+int mmdb_create_index(mmdb_t *db, const char *name, json_t *fields);
+int mmdb_create_search(mmdb_t *db, const char *name, json_t *fields);
+int mmdb_search(mmdb_t *db, const char *name, const char *query, int limit,
+                mmdb_search_cb cb, void *ptr);
+int mmdb_create_view(mmdb_t *db, const char *name, const char *key,
+                     const char *value);
+int mmdb_view(mmdb_t *db, const char *name, int reduce, mmdb_view_cb cb,
+              void *ptr);
+int mmdb_import(mmdb_t *db, FILE *in, int threads, size_t *total);
+int mmdb_export(mmdb_t *db, FILE *out);
 int mmdb_put(mmdb_t *db, mmdb_rev_t *out_rev, mmdb_doc_t *doc,
              mmdb_put_options_t *opts);
+int mmdb_patch(mmdb_t *db, mmdb_rev_t *out_rev, const char *id,
+               mmdb_rev_t *base, int type, json_t *patch);
+int mmdb_attachments(mmdb_t *db, mmdb_attachments_t *out, const char *id,
+                     const char *rev);
+int mmdb_attachment_open(mmdb_t *db, mmdb_attachment_stream_t *out,
+                         const char *id, const char *rev, const char *name);
+int mmdb_attachment_read(mmdb_attachment_stream_t *stream, void *buf, size_t n,
+                         size_t *nread);
+int mmdb_attachment_close(mmdb_attachment_stream_t *stream);
+
+int mmdb_async_new(mmdb_async_t **out, int threads);
+void mmdb_async_free(mmdb_async_t *async);
+int mmdb_async_fd(mmdb_async_t *async);
+int mmdb_async_poll(mmdb_async_t *async, int timeout);
+int mmdb_get_async(mmdb_async_t *async, mmdb_t *db, mmdb_doc_t *out,
+                   const char *id, mmdb_async_cb cb, void *ptr);
+int mmdb_put_async(mmdb_async_t *async, mmdb_t *db, mmdb_rev_t *out_rev,
+                   mmdb_doc_t *doc, mmdb_put_options_t *opts, mmdb_async_cb cb,
+                   void *ptr);
+int mmdb_revs_async(mmdb_async_t *async, mmdb_t *db, mmdb_revs_t *out,
+                    const char *id, mmdb_async_cb cb, void *ptr);
+
+int mmdb_subscribe(mmdb_t *db, mmdb_subscription_t **out, const char *prefix,
+                   mmdb_subscription_cb cb, void *ptr);
+void mmdb_unsubscribe(mmdb_t *db, mmdb_subscription_t *sub);
+int mmdb_subscription_fd(mmdb_subscription_t *sub);
+int mmdb_subscription_poll(mmdb_subscription_t *sub, int timeout);
 
 int mmdb_rev_new(mmdb_rev_t *out, const char *str);
 void mmdb_rev_clear(mmdb_rev_t *rev);
@@ -62,8 +332,24 @@ int mmdb_doc_set_fields(mmdb_doc_t *doc, json_t *v);
 int mmdb_doc_set_fields_new(mmdb_doc_t *doc, json_t *v);
 int mmdb_doc_set_fields_str(mmdb_doc_t *doc, const char *str);
 
-int mmdb_revs_new(mmdb_revs_t * revs);
+int mmdb_revs_new(mmdb_revs_t *revs);
+void mmdb_revs_reset(mmdb_revs_t *revs);
 void mmdb_revs_free(mmdb_revs_t *revs);
-void mmdb_revs_push(mmdb_revs_t *revs, const char *str);
-void mmdb_revs_push_copyn(mmdb_revs_t *revs, const char *str, size_t n);
-void mmdb_revs_push_copy(mmdb_revs_t *revs, const char *str);
+int mmdb_revs_push(mmdb_revs_t *revs, mmdb_rev_t *rev);
+int mmdb_revs_format(mmdb_revs_t *revs, int i, char *out, size_t n);
+
+int mmdb_docs_new(mmdb_docs_t *docs);
+void mmdb_docs_reset(mmdb_docs_t *docs);
+void mmdb_docs_free(mmdb_docs_t *docs);
+
+void mmdb_arena_init(mmdb_arena_t *arena);
+void *mmdb_arena_alloc(mmdb_arena_t *arena, size_t n);
+void *mmdb_arena_grow(mmdb_arena_t *arena, void *ptr, size_t old_n,
+                      size_t new_n);
+void mmdb_arena_reset(mmdb_arena_t *arena);
+void mmdb_arena_free(mmdb_arena_t *arena);
+
+int mmdb_attachments_new(mmdb_attachments_t *atts);
+void mmdb_attachments_free(mmdb_attachments_t *atts);
+void mmdb_attachments_push(mmdb_attachments_t *atts, mmdb_attachment_t *att);
+int mmdb_attachment_digest(mmdb_t *db, mmdb_attachment_t *att);
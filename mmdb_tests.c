@@ -1,11 +1,45 @@
 #include "munit/munit.h"
 
+extern MunitSuite mmdb_async_suite;
+extern MunitSuite mmdb_attachments_suite;
+extern MunitSuite mmdb_backup_suite;
+extern MunitSuite mmdb_compact_suite;
+extern MunitSuite mmdb_expire_suite;
+extern MunitSuite mmdb_find_suite;
+extern MunitSuite mmdb_get_suite;
+extern MunitSuite mmdb_import_suite;
+extern MunitSuite mmdb_open_suite;
+extern MunitSuite mmdb_patch_suite;
 extern MunitSuite mmdb_put_suite;
 extern MunitSuite mmdb_rev_parse_suite;
+extern MunitSuite mmdb_revs_suite;
+extern MunitSuite mmdb_search_suite;
+extern MunitSuite mmdb_shard_suite;
+extern MunitSuite mmdb_snapshot_suite;
+extern MunitSuite mmdb_subscribe_suite;
+extern MunitSuite mmdb_view_suite;
+extern MunitSuite server_suite;
 
 int main(int argc, char* const argv[]) {
-  MunitSuite suites[] = {mmdb_put_suite,
+  MunitSuite suites[] = {mmdb_async_suite,
+                         mmdb_attachments_suite,
+                         mmdb_backup_suite,
+                         mmdb_compact_suite,
+                         mmdb_expire_suite,
+                         mmdb_find_suite,
+                         mmdb_get_suite,
+                         mmdb_import_suite,
+                         mmdb_open_suite,
+                         mmdb_patch_suite,
+                         mmdb_put_suite,
                          mmdb_rev_parse_suite,
+                         mmdb_revs_suite,
+                         mmdb_search_suite,
+                         mmdb_shard_suite,
+                         mmdb_snapshot_suite,
+                         mmdb_subscribe_suite,
+                         mmdb_view_suite,
+                         server_suite,
                          {NULL, NULL, NULL, 0, MUNIT_SUITE_OPTION_NONE}};
 
   MunitSuite suite = {"/mmdb", NULL, suites, 1, MUNIT_SUITE_OPTION_NONE};
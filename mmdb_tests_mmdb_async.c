@@ -0,0 +1,97 @@
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mmdb.h"
+
+#include "munit/munit.h"
+
+#define N 64
+
+typedef struct result_s {
+  int total;
+  int failed;
+} result_t;
+
+static void result_cb(int rc, void* ptr) {
+  result_t* r = ptr;
+
+  r->total++;
+  if (rc != MMDB_OK) {
+    r->failed++;
+  }
+}
+
+MunitResult test_mmdb_async_put_get(const MunitParameter params[], void* p) {
+  int rc, i;
+  char id[MMDB_MAX_ID_LENGTH];
+  mmdb_t* dbs[2];
+  mmdb_async_t* async;
+  mmdb_doc_t docs[N], got[N];
+  mmdb_rev_t revs[N];
+  mmdb_revs_t leaves;
+  result_t puts = {0, 0}, gets = {0, 0}, revs_result = {0, 0};
+
+  rc = mmdb_open(NULL, &dbs[0]);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_open(NULL, &dbs[1]);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_async_new(&async, 2);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  for (i = 0; i < N; i++) {
+    snprintf(id, sizeof(id), "doc%d", i);
+    rc = mmdb_doc_new(&docs[i], id, NULL, "{\"a\":1}");
+    munit_assert_int(rc, ==, MMDB_OK);
+    rc = mmdb_put_async(async, dbs[i % 2], &revs[i], &docs[i], NULL,
+                        result_cb, &puts);
+    munit_assert_int(rc, ==, MMDB_OK);
+  }
+
+  // queued behind the puts for the same database, so they see them
+  for (i = 0; i < N; i++) {
+    memset(&got[i], 0, sizeof(got[i]));
+    rc = mmdb_get_async(async, dbs[i % 2], &got[i], docs[i].id, result_cb,
+                        &gets);
+    munit_assert_int(rc, ==, MMDB_OK);
+  }
+
+  rc = mmdb_revs_new(&leaves);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_revs_async(async, dbs[0], &leaves, "doc0", result_cb,
+                       &revs_result);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  while (puts.total + gets.total + revs_result.total < N * 2 + 1) {
+    rc = mmdb_async_poll(async, 100);
+    munit_assert_int(rc, ==, MMDB_OK);
+  }
+
+  munit_assert_int(puts.failed, ==, 0);
+  munit_assert_int(gets.failed, ==, 0);
+  munit_assert_int(revs_result.failed, ==, 0);
+
+  for (i = 0; i < N; i++) {
+    munit_assert_string_equal(got[i].id, docs[i].id);
+    munit_assert_memory_equal(sizeof(revs[i]), &revs[i], &got[i].rev);
+  }
+
+  munit_assert_int(leaves.total, ==, 1);
+  munit_assert_memory_equal(sizeof(revs[0]), &revs[0], &leaves.revs[0]);
+
+  mmdb_async_free(async);
+  mmdb_revs_free(&leaves);
+
+  return MUNIT_OK;
+}
+
+static MunitTest mmdb_async_tests[] = {
+    {"/put_get", test_mmdb_async_put_get, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
+
+MunitSuite mmdb_async_suite = {"/mmdb_async", mmdb_async_tests, NULL, 1,
+                               MUNIT_SUITE_OPTION_NONE};
@@ -0,0 +1,143 @@
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "mmdb.h"
+#include "q.h"
+
+#include "munit/munit.h"
+
+static int count_cb(sqlite3_stmt* stmt, void* ptr) {
+  return q_scan(stmt, "i", ptr);
+}
+
+MunitResult test_mmdb_attachments_put(const MunitParameter params[], void* p) {
+  int rc;
+  mmdb_t* db;
+  mmdb_doc_t doc1, doc1a;
+  mmdb_rev_t rev1;
+  mmdb_attachment_t att = {.name = "photo.png", .type = "image/png"};
+  mmdb_put_options_t opts = {.attachments = &att, .attachments_total = 1};
+  mmdb_attachments_t atts;
+  mmdb_attachment_stream_t stream;
+  char buf[4];
+  size_t nread;
+
+  att.data = "0123456789";
+  att.length = 10;
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc1, "SpaghettiWithMeatballs", NULL, "{}");
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_put(db, &rev1, &doc1, &opts);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_get(db, &doc1a, "SpaghettiWithMeatballs");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_memory_equal(sizeof(rev1), &rev1, &doc1a.rev);
+  munit_assert_size(json_object_size(doc1a.fields), ==, 0);
+
+  rc = mmdb_attachments_new(&atts);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_attachments(db, &atts, "SpaghettiWithMeatballs", NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(atts.total, ==, 1);
+  munit_assert_string_equal(atts.attachments[0].name, "photo.png");
+  munit_assert_string_equal(atts.attachments[0].type, "image/png");
+  munit_assert_size(atts.attachments[0].length, ==, 10);
+  munit_assert_memory_equal(sizeof(att.digest), atts.attachments[0].digest,
+                            att.digest);
+  mmdb_attachments_free(&atts);
+
+  rc = mmdb_attachment_open(db, &stream, "SpaghettiWithMeatballs", NULL,
+                            "photo.png");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_attachment_read(&stream, buf, sizeof(buf), &nread);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_size(nread, ==, 4);
+  munit_assert_memory_equal(4, buf, "0123");
+  rc = mmdb_attachment_read(&stream, buf, sizeof(buf), &nread);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_attachment_read(&stream, buf, sizeof(buf), &nread);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_size(nread, ==, 2);
+  munit_assert_memory_equal(2, buf, "89");
+  rc = mmdb_attachment_read(&stream, buf, sizeof(buf), &nread);
+  munit_assert_int(rc, ==, MMDB_DONE);
+  rc = mmdb_attachment_close(&stream);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_attachment_open(db, &stream, "SpaghettiWithMeatballs", NULL,
+                            "missing.png");
+  munit_assert_int(rc, ==, MMDB_NOT_FOUND);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_attachments_shared(const MunitParameter params[],
+                                         void* p) {
+  int rc, n;
+  mmdb_t* db;
+  mmdb_doc_t doc1, doc1a, doc2;
+  mmdb_rev_t rev1, rev1a, rev2;
+  mmdb_attachment_t att = {.name = "a.txt", .type = "text/plain"};
+  mmdb_put_options_t opts = {.attachments = &att, .attachments_total = 1};
+  mmdb_attachments_t atts;
+
+  att.data = "hello";
+  att.length = 5;
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc1, "SpaghettiWithMeatballs", NULL, "{}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev1, &doc1, &opts);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc2, "LasagneAlForno", NULL, "{}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev2, &doc2, &opts);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = q_exec1(db->db, "select count(*) from attachments", &n, count_cb, "");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(n, ==, 1);
+
+  // a plain update keeps the attachment without storing it again
+  rc = mmdb_get(db, &doc1a, "SpaghettiWithMeatballs");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = json_object_set_new(doc1a.fields, "a", json_string("a"));
+  munit_assert_int(rc, ==, 0);
+  rc = mmdb_put(db, &rev1a, &doc1a, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_attachments_new(&atts);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_attachments(db, &atts, "SpaghettiWithMeatballs", NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(atts.total, ==, 1);
+  munit_assert_string_equal(atts.attachments[0].name, "a.txt");
+  mmdb_attachments_free(&atts);
+
+  rc = q_exec1(db->db, "select count(*) from attachments", &n, count_cb, "");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(n, ==, 1);
+
+  return MUNIT_OK;
+}
+
+static MunitTest mmdb_attachments_tests[] = {
+    {"/put", test_mmdb_attachments_put, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {"/shared", test_mmdb_attachments_shared, NULL, NULL,
+     MUNIT_TEST_OPTION_NONE, NULL},
+    {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
+
+MunitSuite mmdb_attachments_suite = {"/mmdb_attachments",
+                                     mmdb_attachments_tests, NULL, 1,
+                                     MUNIT_SUITE_OPTION_NONE};
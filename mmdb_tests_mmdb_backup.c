@@ -0,0 +1,82 @@
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mmdb.h"
+
+#include "munit/munit.h"
+
+static int steps_cb(int remaining, int total, void* ptr) {
+  int* steps = ptr;
+
+  munit_assert_int(remaining, <=, total);
+  (*steps)++;
+
+  return MMDB_OK;
+}
+
+MunitResult test_mmdb_backup_copy(const MunitParameter params[], void* p) {
+  int rc, i, steps = 0, log = -1, checkpointed = -1;
+  char filename[] = "/tmp/mmdb_tests_XXXXXX", dest[] = "/tmp/mmdb_tests_XXXXXX",
+       id[MMDB_MAX_ID_LENGTH], wal[64];
+  mmdb_t *db, *copy;
+  mmdb_doc_t doc;
+  mmdb_rev_t rev;
+  mmdb_open_options_t opts = {.journal_mode = "wal", .page_size = 1024};
+
+  rc = mkstemp(filename);
+  munit_assert_int(rc, >=, 0);
+  close(rc);
+  rc = mkstemp(dest);
+  munit_assert_int(rc, >=, 0);
+  close(rc);
+
+  rc = mmdb_open_v2(filename, &db, &opts);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  for (i = 0; i < 100; i++) {
+    snprintf(id, sizeof(id), "doc%d", i);
+    rc = mmdb_doc_new(&doc, id, NULL, "{\"padding\":\"................\"}");
+    munit_assert_int(rc, ==, MMDB_OK);
+    rc = mmdb_put(db, &rev, &doc, NULL);
+    munit_assert_int(rc, ==, MMDB_OK);
+  }
+
+  rc = mmdb_backup(db, dest, 1, steps_cb, &steps);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(steps, >, 1);
+
+  rc = mmdb_open(dest, &copy);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_get(copy, &doc, "doc99");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_memory_equal(sizeof(rev), &rev, &doc.rev);
+  rc = mmdb_close(copy);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_checkpoint(db, MMDB_CHECKPOINT_TRUNCATE, &log, &checkpointed);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(log, ==, 0);
+  munit_assert_int(checkpointed, ==, 0);
+
+  snprintf(wal, sizeof(wal), "%s-wal", filename);
+  munit_assert_int(access(wal, F_OK), ==, 0);
+
+  rc = mmdb_close(db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  unlink(filename);
+  unlink(dest);
+
+  return MUNIT_OK;
+}
+
+static MunitTest mmdb_backup_tests[] = {
+    {"/copy", test_mmdb_backup_copy, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
+
+MunitSuite mmdb_backup_suite = {"/mmdb_backup", mmdb_backup_tests, NULL, 1,
+                                MUNIT_SUITE_OPTION_NONE};
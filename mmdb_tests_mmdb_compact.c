@@ -0,0 +1,70 @@
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "mmdb.h"
+#include "q.h"
+
+#include "munit/munit.h"
+
+static int count_cb(sqlite3_stmt* stmt, void* ptr) {
+  return q_scan(stmt, "i", ptr);
+}
+
+MunitResult test_mmdb_compact_bodies(const MunitParameter params[], void* p) {
+  int rc, n;
+  mmdb_t* db;
+  mmdb_doc_t doc1, doc1a, doc2;
+  mmdb_rev_t rev1, rev1a, rev2;
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc1, "SpaghettiWithMeatballs", NULL, "{\"a\":1}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev1, &doc1, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc2, "LasagneAlForno", NULL, "{\"a\":1}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev2, &doc2, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc1a, "SpaghettiWithMeatballs", NULL, "{\"a\":2}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  doc1a.rev = rev1;
+  rc = mmdb_put(db, &rev1a, &doc1a, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = q_exec1(db->db, "select count(*) from bodies", &n, count_cb, "");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(n, ==, 2);
+
+  rc = mmdb_compact(db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  // {"a":1} is still the leaf of LasagneAlForno
+  rc = q_exec1(db->db, "select refs from bodies where doc = '{\"a\":1}'", &n,
+               count_cb, "");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(n, ==, 1);
+
+  rc = mmdb_get(db, &doc2, "LasagneAlForno");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_memory_equal(sizeof(rev2), &rev2, &doc2.rev);
+
+  rc = mmdb_get(db, &doc1, "SpaghettiWithMeatballs");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_memory_equal(sizeof(rev1a), &rev1a, &doc1.rev);
+
+  return MUNIT_OK;
+}
+
+static MunitTest mmdb_compact_tests[] = {
+    {"/bodies", test_mmdb_compact_bodies, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
+
+MunitSuite mmdb_compact_suite = {"/mmdb_compact", mmdb_compact_tests, NULL, 1,
+                                 MUNIT_SUITE_OPTION_NONE};
@@ -0,0 +1,240 @@
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mmdb.h"
+
+#include "munit/munit.h"
+
+static int count_rows(mmdb_t* db, const char* sql) {
+  sqlite3_stmt* stmt = NULL;
+  int n;
+
+  munit_assert_int(sqlite3_prepare_v2(db->db, sql, -1, &stmt, NULL), ==,
+                   SQLITE_OK);
+  munit_assert_int(sqlite3_step(stmt), ==, SQLITE_ROW);
+  n = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+
+  return n;
+}
+
+static void put(mmdb_t* db, const char* id, sqlite3_int64 expires,
+                mmdb_attachment_t* att) {
+  mmdb_doc_t doc;
+  mmdb_rev_t rev;
+  mmdb_put_options_t opts = {.attachments = att,
+                             .attachments_total = att != NULL,
+                             .expires = expires};
+
+  munit_assert_int(mmdb_doc_new(&doc, id, NULL, "{\"kind\":\"session\"}"),
+                   ==, MMDB_OK);
+  munit_assert_int(mmdb_put(db, &rev, &doc, &opts), ==, MMDB_OK);
+  mmdb_doc_clear(&doc);
+}
+
+MunitResult test_mmdb_expire_step(const MunitParameter params[], void* p) {
+  int rc;
+  mmdb_t* db;
+  mmdb_doc_t doc;
+  mmdb_raw_t raw;
+  mmdb_revs_t revs;
+  mmdb_attachment_t att = {.name = "a.txt", .type = "text/plain", .data = "a",
+                           .length = 1};
+  sqlite3_int64 later = (sqlite3_int64)time(NULL) + 3600;
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_create_view(db, "kinds", "kind", NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  put(db, "Stale1", 2, &att);
+  put(db, "Stale2", 1, NULL);
+  put(db, "Fresh", later, NULL);
+  put(db, "Forever", 0, NULL);
+
+  // expired documents read as missing before they're swept
+  rc = mmdb_get(db, &doc, "Stale1");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_null(doc.fields);
+
+  memset(&raw, 0, sizeof(raw));
+  rc = mmdb_get_raw(db, &raw, "Stale2");
+  munit_assert_int(rc, ==, MMDB_NOT_FOUND);
+  rc = mmdb_get_raw(db, &raw, "Fresh");
+  munit_assert_int(rc, ==, MMDB_OK);
+  mmdb_raw_release(&raw);
+
+  mmdb_revs_new(&revs);
+  rc = mmdb_revs(db, &revs, "Stale1");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(revs.total, ==, 0);
+  mmdb_revs_free(&revs);
+
+  // one at a time, the one that expired first going first
+  rc = mmdb_expire_step(db, 1);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(count_rows(db, "select count(*) from docs where id = "
+                                  "'Stale2'"),
+                   ==, 0);
+  munit_assert_int(count_rows(db, "select count(*) from docs"), ==, 3);
+
+  rc = mmdb_expire_step(db, 1);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_expire_step(db, 1);
+  munit_assert_int(rc, ==, MMDB_DONE);
+
+  munit_assert_int(count_rows(db, "select count(*) from docs"), ==, 2);
+  munit_assert_int(count_rows(db, "select count(*) from revs"), ==, 2);
+  munit_assert_int(count_rows(db, "select count(*) from attachments"), ==, 0);
+  munit_assert_int(count_rows(db, "select count(*) from rev_attachments"), ==,
+                   0);
+  munit_assert_int(count_rows(db, "select refs from bodies"), ==, 2);
+  munit_assert_int(count_rows(db, "select count from view_groups"), ==, 2);
+
+  // an expired id can be written again as a new document
+  put(db, "Stale3", 1, NULL);
+  put(db, "Stale3", 0, NULL);
+  rc = mmdb_get(db, &doc, "Stale3");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_not_null(doc.fields);
+  munit_assert_int(doc.rev.seq, ==, 1);
+
+  // and every put replaces the expiry
+  rc = mmdb_put(db, &doc.rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  mmdb_doc_clear(&doc);
+  rc = mmdb_get(db, &doc, "Fresh");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &doc.rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  mmdb_doc_clear(&doc);
+  munit_assert_int(
+      count_rows(db, "select count(*) from docs where expires is not null"),
+      ==, 0);
+
+  rc = mmdb_expire_step(db, 10);
+  munit_assert_int(rc, ==, MMDB_DONE);
+  munit_assert_int(count_rows(db, "select count(*) from docs"), ==, 3);
+
+  mmdb_close(db);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_expire_patch(const MunitParameter params[], void* p) {
+  int rc;
+  mmdb_t* db;
+  mmdb_doc_t doc;
+  mmdb_rev_t rev;
+  json_t* patch;
+  char sql[128];
+  sqlite3_int64 later = (sqlite3_int64)time(NULL) + 3600;
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  put(db, "Fresh", later, NULL);
+
+  patch = json_loads("{\"kind\":\"token\"}", 0, NULL);
+  rc = mmdb_patch(db, &rev, "Fresh", NULL, MMDB_PATCH_MERGE, patch);
+  munit_assert_int(rc, ==, MMDB_OK);
+  json_decref(patch);
+
+  snprintf(sql, sizeof(sql),
+           "select count(*) from docs where id = 'Fresh' and expires = %lld",
+           (long long)later);
+  munit_assert_int(count_rows(db, sql), ==, 1);
+
+  rc = mmdb_get(db, &doc, "Fresh");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_string_equal(
+      json_string_value(json_object_get(doc.fields, "kind")), "token");
+  mmdb_doc_clear(&doc);
+
+  // a put without an expiry still clears it
+  rc = mmdb_doc_new(&doc, "Fresh", NULL, "{\"kind\":\"session\"}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  doc.rev = rev;
+  rc = mmdb_put(db, &rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  mmdb_doc_clear(&doc);
+  munit_assert_int(count_rows(db, sql), ==, 0);
+
+  mmdb_close(db);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_expire_handles(const MunitParameter params[],
+                                     void* p) {
+  int rc;
+  char filename[] = "/tmp/mmdb_tests_XXXXXX";
+  mmdb_t *a, *b;
+  mmdb_doc_t doc;
+  mmdb_rev_t rev;
+  mmdb_put_options_t opts = {.expires = 1};
+
+  rc = mkstemp(filename);
+  munit_assert_int(rc, >=, 0);
+  close(rc);
+
+  rc = mmdb_open(filename, &a);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_open(filename, &b);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  // a reads the document, and so caches its key and expiry
+  put(a, "Session", (sqlite3_int64)time(NULL) + 3600, NULL);
+  rc = mmdb_get(a, &doc, "Session");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_not_null(doc.fields);
+  rev = doc.rev;
+  mmdb_doc_clear(&doc);
+
+  // b moves the expiry into the past, which a has to notice
+  rc = mmdb_doc_new(&doc, "Session", NULL, "{\"kind\":\"session\"}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  doc.rev = rev;
+  rc = mmdb_put(b, &rev, &doc, &opts);
+  munit_assert_int(rc, ==, MMDB_OK);
+  mmdb_doc_clear(&doc);
+
+  rc = mmdb_get(a, &doc, "Session");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_null(doc.fields);
+
+  // then sweeps it away, so a's next write has to start a new document
+  // rather than update one that isn't there
+  rc = mmdb_expire_step(b, 16);
+  munit_assert_int(rc, ==, MMDB_DONE);
+
+  put(a, "Session", 0, NULL);
+  munit_assert_int(count_rows(b, "select count(*) from docs"), ==, 1);
+  rc = mmdb_get(b, &doc, "Session");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_not_null(doc.fields);
+  munit_assert_int(doc.rev.seq, ==, 1);
+  mmdb_doc_clear(&doc);
+
+  mmdb_close(a);
+  mmdb_close(b);
+  unlink(filename);
+
+  return MUNIT_OK;
+}
+
+static MunitTest mmdb_expire_tests[] = {
+    {"/handles", test_mmdb_expire_handles, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {"/patch", test_mmdb_expire_patch, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {"/step", test_mmdb_expire_step, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
+
+MunitSuite mmdb_expire_suite = {"/mmdb_expire", mmdb_expire_tests, NULL, 1,
+                                MUNIT_SUITE_OPTION_NONE};
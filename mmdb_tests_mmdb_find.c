@@ -0,0 +1,241 @@
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "mmdb.h"
+
+#include "munit/munit.h"
+
+typedef struct found_s {
+  int total;
+  char ids[8][MMDB_MAX_ID_LENGTH + 1];
+} found_t;
+
+static int found_cb(mmdb_doc_t* doc, void* ptr) {
+  found_t* found = ptr;
+
+  if (found->total < 8) {
+    strcpy(found->ids[found->total], doc->id);
+  }
+  found->total++;
+
+  return MMDB_OK;
+}
+
+static void put_docs(mmdb_t* db) {
+  static const char* docs[][2] = {
+      {"Carbonara", "{\"course\":\"main\",\"minutes\":20,\"tags\":[\"pork\"]}"},
+      {"Lasagne", "{\"course\":\"main\",\"minutes\":90}"},
+      {"Panzanella", "{\"course\":\"side\",\"minutes\":15}"},
+      {"Risotto", "{\"course\":\"main\",\"minutes\":40,\"cheese\":null}"},
+      {"Tiramisu", "{\"course\":\"dessert\",\"minutes\":20}"},
+  };
+  mmdb_doc_t doc;
+  mmdb_rev_t rev;
+  size_t i;
+  int rc;
+
+  for (i = 0; i < sizeof(docs) / sizeof(docs[0]); i++) {
+    rc = mmdb_doc_new(&doc, docs[i][0], NULL, docs[i][1]);
+    munit_assert_int(rc, ==, MMDB_OK);
+    rc = mmdb_put(db, &rev, &doc, NULL);
+    munit_assert_int(rc, ==, MMDB_OK);
+    mmdb_doc_clear(&doc);
+  }
+}
+
+MunitResult test_mmdb_find_selector(const MunitParameter params[], void* p) {
+  int rc;
+  mmdb_t* db;
+  found_t found;
+  mmdb_find_options_t opts;
+  json_t* selector;
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+  put_docs(db);
+
+  memset(&opts, 0, sizeof(opts));
+  opts.sort = json_loads("[{\"minutes\":\"desc\"}]", 0, NULL);
+
+  memset(&found, 0, sizeof(found));
+  selector = json_loads(
+      "{\"course\":\"main\",\"minutes\":{\"$gte\":20,\"$lt\":60}}", 0, NULL);
+  rc = mmdb_find(db, selector, &opts, found_cb, &found);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(found.total, ==, 2);
+  munit_assert_string_equal(found.ids[0], "Risotto");
+  munit_assert_string_equal(found.ids[1], "Carbonara");
+  json_decref(selector);
+
+  memset(&found, 0, sizeof(found));
+  selector = json_loads(
+      "{\"$or\":[{\"course\":{\"$in\":[\"side\",\"dessert\"]}},"
+      "{\"cheese\":null}],\"tags\":{\"$exists\":false}}",
+      0, NULL);
+  rc = mmdb_find(db, selector, NULL, found_cb, &found);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(found.total, ==, 3);
+  munit_assert_string_equal(found.ids[0], "Panzanella");
+  munit_assert_string_equal(found.ids[1], "Risotto");
+  munit_assert_string_equal(found.ids[2], "Tiramisu");
+  json_decref(selector);
+
+  selector = json_loads("{\"minutes\":{\"$regex\":\"^2\"}}", 0, NULL);
+  rc = mmdb_find(db, selector, NULL, found_cb, &found);
+  munit_assert_int(rc, ==, MMDB_ERROR);
+  json_decref(selector);
+
+  json_decref(opts.sort);
+  mmdb_close(db);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_find_cursor(const MunitParameter params[], void* p) {
+  int rc;
+  mmdb_t* db;
+  found_t found;
+  mmdb_find_options_t opts;
+  json_t* selector;
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+  put_docs(db);
+
+  memset(&opts, 0, sizeof(opts));
+  memset(&found, 0, sizeof(found));
+  opts.sort = json_loads("[\"minutes\"]", 0, NULL);
+  opts.limit = 2;
+  selector = json_object();
+
+  // ties on minutes are broken by id, including across pages
+  rc = mmdb_find(db, selector, &opts, found_cb, &found);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_not_null(opts.cursor);
+  rc = mmdb_find(db, selector, &opts, found_cb, &found);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_not_null(opts.cursor);
+  rc = mmdb_find(db, selector, &opts, found_cb, &found);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_null(opts.cursor);
+
+  munit_assert_int(found.total, ==, 5);
+  munit_assert_string_equal(found.ids[0], "Panzanella");
+  munit_assert_string_equal(found.ids[1], "Carbonara");
+  munit_assert_string_equal(found.ids[2], "Tiramisu");
+  munit_assert_string_equal(found.ids[3], "Risotto");
+  munit_assert_string_equal(found.ids[4], "Lasagne");
+
+  json_decref(selector);
+  json_decref(opts.sort);
+  mmdb_close(db);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_find_index(const MunitParameter params[], void* p) {
+  int rc;
+  mmdb_t* db;
+  found_t found;
+  mmdb_find_options_t opts;
+  json_t *selector, *fields;
+  char explain[4096];
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+  put_docs(db);
+
+  memset(&opts, 0, sizeof(opts));
+  opts.explain = explain;
+  opts.explain_len = sizeof(explain);
+  selector = json_loads("{\"course\":\"side\"}", 0, NULL);
+
+  rc = mmdb_find(db, selector, &opts, found_cb, &found);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_null(strstr(explain, "mmdb_find_course"));
+
+  fields = json_loads("[\"course\"]", 0, NULL);
+  rc = mmdb_create_index(db, "course", fields);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_create_index(db, "no good", fields);
+  munit_assert_int(rc, ==, MMDB_ERROR);
+  json_decref(fields);
+
+  rc = mmdb_find(db, selector, &opts, found_cb, &found);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_not_null(strstr(explain, "mmdb_find_course"));
+
+  opts.explain = NULL;
+  memset(&found, 0, sizeof(found));
+  rc = mmdb_find(db, selector, &opts, found_cb, &found);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(found.total, ==, 1);
+  munit_assert_string_equal(found.ids[0], "Panzanella");
+
+  json_decref(selector);
+  mmdb_close(db);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_find_object(const MunitParameter params[], void* p) {
+  int rc;
+  mmdb_t* db;
+  mmdb_doc_t doc;
+  mmdb_rev_t rev;
+  found_t found;
+  json_t* selector;
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_doc_new(
+      &doc, "Gelato", NULL,
+      "{\"size\":{\"w\":3,\"h\":2},\"by\":{\"name\":\"cr\\u00e8me\"}}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  mmdb_doc_clear(&doc);
+
+  // objects in a selector match whatever order their keys were written in
+  memset(&found, 0, sizeof(found));
+  selector = json_loads("{\"size\":{\"$eq\":{\"w\":3,\"h\":2}}}", 0, NULL);
+  rc = mmdb_find(db, selector, NULL, found_cb, &found);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(found.total, ==, 1);
+  json_decref(selector);
+
+  memset(&found, 0, sizeof(found));
+  selector = json_loads(
+      "{\"size\":{\"$in\":[{\"w\":1,\"h\":1},{\"w\":3,\"h\":2}]}}", 0,
+      NULL);
+  rc = mmdb_find(db, selector, NULL, found_cb, &found);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(found.total, ==, 1);
+  json_decref(selector);
+
+  memset(&found, 0, sizeof(found));
+  selector = json_loads("{\"by\":{\"name\":\"cr\\u00e8me\"}}", 0, NULL);
+  rc = mmdb_find(db, selector, NULL, found_cb, &found);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(found.total, ==, 1);
+  json_decref(selector);
+
+  mmdb_close(db);
+
+  return MUNIT_OK;
+}
+
+static MunitTest mmdb_find_tests[] = {
+    {"/selector", test_mmdb_find_selector, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {"/cursor", test_mmdb_find_cursor, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {"/index", test_mmdb_find_index, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {"/object", test_mmdb_find_object, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
+
+MunitSuite mmdb_find_suite = {"/mmdb_find", mmdb_find_tests, NULL, 1,
+                              MUNIT_SUITE_OPTION_NONE};
@@ -0,0 +1,195 @@
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "mmdb.h"
+#include "q.h"
+
+#include "munit/munit.h"
+
+MunitResult test_mmdb_get_conflicts(const MunitParameter params[], void* p) {
+  int rc;
+  mmdb_t* db;
+  mmdb_doc_t doc, doc_a, doc_b;
+  mmdb_rev_t rev1, rev_a, rev_b, *winner, *loser;
+  mmdb_revs_t conflicts;
+  mmdb_get_options_t get_opts = {.conflicts = &conflicts};
+  mmdb_put_options_t put_opts = {.allow_conflict = 1};
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc, "SpaghettiWithMeatballs", NULL, "{}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev1, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc_a, "SpaghettiWithMeatballs", NULL, "{\"a\":1}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  doc_a.rev = rev1;
+  rc = mmdb_put(db, &rev_a, &doc_a, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc_b, "SpaghettiWithMeatballs", NULL, "{\"b\":1}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  doc_b.rev = rev1;
+  rc = mmdb_put(db, &rev_b, &doc_b, &put_opts);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  // same seq, so the higher hash wins no matter which was written first
+  winner = memcmp(rev_a.hash, rev_b.hash, sizeof(rev_a.hash)) > 0 ? &rev_a
+                                                                   : &rev_b;
+  loser = winner == &rev_a ? &rev_b : &rev_a;
+
+  rc = mmdb_revs_new(&conflicts);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_get_opts(db, &doc, "SpaghettiWithMeatballs", &get_opts);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_memory_equal(sizeof(*winner), winner, &doc.rev);
+  munit_assert_int(conflicts.total, ==, 1);
+  munit_assert_memory_equal(sizeof(*loser), loser, &conflicts.revs[0]);
+
+  rc = mmdb_get(db, &doc, "SpaghettiWithMeatballs");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_memory_equal(sizeof(*winner), winner, &doc.rev);
+
+  // extending the losing branch makes it win on seq instead
+  doc_a.rev = *loser;
+  rc = mmdb_put(db, &rev1, &doc_a, &put_opts);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_get_opts(db, &doc, "SpaghettiWithMeatballs", &get_opts);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_memory_equal(sizeof(rev1), &rev1, &doc.rev);
+  munit_assert_int(conflicts.total, ==, 1);
+  munit_assert_memory_equal(sizeof(*winner), winner, &conflicts.revs[0]);
+
+  mmdb_revs_free(&conflicts);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_get_many(const MunitParameter params[], void* p) {
+  int rc;
+  mmdb_t* db;
+  mmdb_doc_t doc1, doc2;
+  mmdb_rev_t rev1, rev2;
+  mmdb_docs_t docs;
+  const char* ids[] = {"LasagneAlForno", "Missing", "SpaghettiWithMeatballs"};
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc1, "SpaghettiWithMeatballs", NULL, "{\"a\":1}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev1, &doc1, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc2, "LasagneAlForno", NULL, "{\"b\":2}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev2, &doc2, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_docs_new(&docs);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_get_many(db, &docs, ids, 3);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(docs.total, ==, 3);
+
+  munit_assert_string_equal(docs.docs[0].id, "LasagneAlForno");
+  munit_assert_memory_equal(sizeof(rev2), &rev2, &docs.docs[0].rev);
+  munit_assert_int(
+      json_integer_value(json_object_get(docs.docs[0].fields, "b")), ==, 2);
+
+  munit_assert_string_equal(docs.docs[1].id, "");
+  munit_assert_uint(docs.docs[1].rev.seq, ==, 0);
+  munit_assert_null(docs.docs[1].fields);
+
+  munit_assert_string_equal(docs.docs[2].id, "SpaghettiWithMeatballs");
+  munit_assert_memory_equal(sizeof(rev1), &rev1, &docs.docs[2].rev);
+
+  mmdb_docs_free(&docs);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_get_raw(const MunitParameter params[], void* p) {
+  int rc;
+  mmdb_t* db;
+  mmdb_doc_t doc;
+  mmdb_rev_t rev1, rev2;
+  mmdb_raw_t raw;
+  mmdb_open_options_t opts = {.delta_chain = 2};
+  char rev[MMDB_MAX_REV_LENGTH], buf[128];
+
+  rc = mmdb_open_v2(NULL, &db, &opts);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc, "SpaghettiWithMeatballs", NULL,
+                    "{\"sauce\":\"tomato\",\"noodles\":1}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev1, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_doc_set_fields_str(&doc, "{\"sauce\":\"cream\"}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  doc.rev = rev1;
+  rc = mmdb_put(db, &rev2, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  mmdb_doc_clear(&doc);
+
+  // borrowed: the stored canonical bytes, as they are
+  memset(&raw, 0, sizeof(raw));
+  rc = mmdb_get_raw(db, &raw, "SpaghettiWithMeatballs");
+  munit_assert_int(rc, ==, MMDB_OK);
+  mmdb_rev_format(rev, sizeof(rev), &rev2);
+  munit_assert_int(raw.id_len, ==, strlen("SpaghettiWithMeatballs"));
+  munit_assert_memory_equal(raw.id_len, raw.id, "SpaghettiWithMeatballs");
+  munit_assert_int(raw.rev_len, ==, strlen(rev));
+  munit_assert_memory_equal(raw.rev_len, raw.rev, rev);
+  munit_assert_int(raw.doc_len, ==, strlen("{\"sauce\":\"cream\"}"));
+  munit_assert_memory_equal(raw.doc_len, raw.doc, "{\"sauce\":\"cream\"}");
+  munit_assert_not_null(raw.stmt);
+
+  rc = mmdb_get_raw(db, &raw, "LasagneAlForno");
+  munit_assert_int(rc, ==, MMDB_NOT_FOUND);
+
+  // copied: nothing is held once the call returns
+  raw.buf = buf;
+  raw.buf_len = sizeof(buf);
+  rc = mmdb_get_raw(db, &raw, "SpaghettiWithMeatballs");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_null(raw.stmt);
+  munit_assert_ptr_equal(raw.id, buf);
+  munit_assert_string_equal(raw.rev, rev);
+  munit_assert_string_equal(raw.doc, "{\"sauce\":\"cream\"}");
+
+  // the replaced revision is stored as a delta and has to be rebuilt
+  mmdb_rev_format(rev, sizeof(rev), &rev1);
+  rc = mmdb_get_rev_raw(db, &raw, "SpaghettiWithMeatballs", rev);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_null(raw.rebuilt);
+  munit_assert_string_equal(raw.rev, rev);
+  munit_assert_string_equal(raw.doc, "{\"noodles\":1,\"sauce\":\"tomato\"}");
+
+  raw.buf_len = 40;
+  rc = mmdb_get_rev_raw(db, &raw, "SpaghettiWithMeatballs", rev);
+  munit_assert_int(rc, ==, MMDB_ERROR);
+
+  rc = mmdb_get_rev_raw(db, &raw, "SpaghettiWithMeatballs", "9-00");
+  munit_assert_int(rc, ==, MMDB_NOT_FOUND);
+
+  mmdb_raw_release(&raw);
+  mmdb_close(db);
+
+  return MUNIT_OK;
+}
+
+static MunitTest mmdb_get_tests[] = {
+    {"/conflicts", test_mmdb_get_conflicts, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {"/many", test_mmdb_get_many, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {"/raw", test_mmdb_get_raw, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
+
+MunitSuite mmdb_get_suite = {"/mmdb_get", mmdb_get_tests, NULL, 1,
+                             MUNIT_SUITE_OPTION_NONE};
@@ -0,0 +1,199 @@
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mmdb.h"
+
+#include "munit/munit.h"
+
+static const char ndjson[] =
+    "{\"_id\":\"b\",\"x\":2}\n"
+    "\n"
+    "{\"_id\":\"a\",\"_rev\":\"3-0123456789abcdef0123456789abcdef\","
+    "\"x\":1}\n"
+    "{\"_id\":\"c\",\"x\":2}\n";
+
+MunitResult test_mmdb_import_roundtrip(const MunitParameter params[],
+                                       void* p) {
+  int rc;
+  mmdb_t *db, *copy;
+  mmdb_doc_t doc;
+  FILE *in, *out;
+  char *buf = NULL, *buf2 = NULL;
+  size_t len = 0, len2 = 0, total = 0;
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  in = fmemopen((void*)ndjson, strlen(ndjson), "r");
+  rc = mmdb_import(db, in, 2, &total);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_size(total, ==, 3);
+  fclose(in);
+
+  rc = mmdb_get(db, &doc, "a");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_uint(doc.rev.seq, ==, 3);
+  munit_assert_int(json_integer_value(json_object_get(doc.fields, "x")), ==,
+                   1);
+  munit_assert_null(json_object_get(doc.fields, "_id"));
+
+  rc = mmdb_get(db, &doc, "b");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_uint(doc.rev.seq, ==, 1);
+
+  out = open_memstream(&buf, &len);
+  rc = mmdb_export(db, out);
+  munit_assert_int(rc, ==, MMDB_OK);
+  fclose(out);
+  munit_assert_not_null(strstr(buf, "\"_id\":\"a\""));
+  munit_assert_true(strstr(buf, "\"_id\":\"a\"") < strstr(buf, "\"_id\":\"b\""));
+
+  // loading the export elsewhere reproduces it exactly
+  rc = mmdb_open(NULL, &copy);
+  munit_assert_int(rc, ==, MMDB_OK);
+  in = fmemopen(buf, len, "r");
+  rc = mmdb_import(copy, in, 1, &total);
+  munit_assert_int(rc, ==, MMDB_OK);
+  fclose(in);
+
+  out = open_memstream(&buf2, &len2);
+  rc = mmdb_export(copy, out);
+  munit_assert_int(rc, ==, MMDB_OK);
+  fclose(out);
+  munit_assert_string_equal(buf, buf2);
+
+  // documents that already exist conflict, and nothing is loaded
+  in = fmemopen((void*)ndjson, strlen(ndjson), "r");
+  rc = mmdb_import(db, in, 2, &total);
+  munit_assert_int(rc, ==, MMDB_ERROR);
+  fclose(in);
+
+  free(buf);
+  free(buf2);
+
+  return MUNIT_OK;
+}
+
+typedef struct counts_s {
+  int total;
+  char out[64];
+} counts_t;
+
+static int counts_cb(json_t* key, json_t* value, void* ptr) {
+  counts_t* counts = ptr;
+  size_t n = strlen(counts->out);
+
+  snprintf(counts->out + n, sizeof(counts->out) - n, "%s%d=%d",
+           counts->total++ > 0 ? " " : "", (int)json_integer_value(key),
+           (int)json_integer_value(value));
+
+  return MMDB_OK;
+}
+
+static int hits_cb(const char* id, mmdb_rev_t* rev, double rank, void* ptr) {
+  (*(int*)ptr)++;
+
+  return MMDB_OK;
+}
+
+MunitResult test_mmdb_import_indexed(const MunitParameter params[], void* p) {
+  int rc, hits = 0;
+  mmdb_t* db;
+  mmdb_doc_t doc;
+  mmdb_rev_t rev;
+  counts_t counts;
+  json_t* fields;
+  FILE* in;
+  const char docs[] =
+      "{\"_id\":\"a\",\"x\":1,\"title\":\"spaghetti\"}\n"
+      "{\"_id\":\"b\",\"x\":2,\"title\":\"linguine\"}\n"
+      "{\"_id\":\"c\",\"x\":2,\"title\":\"spaghetti\"}\n";
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_create_view(db, "xs", "x", NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  fields = json_loads("[\"title\"]", 0, NULL);
+  rc = mmdb_create_search(db, "titles", fields);
+  munit_assert_int(rc, ==, MMDB_OK);
+  json_decref(fields);
+
+  // views and search indexes defined on an empty database are filled by
+  // the load, just as if each document had been put
+  in = fmemopen((void*)docs, strlen(docs), "r");
+  rc = mmdb_import(db, in, 2, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  fclose(in);
+
+  memset(&counts, 0, sizeof(counts));
+  rc = mmdb_view(db, "xs", MMDB_REDUCE_COUNT, counts_cb, &counts);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_string_equal(counts.out, "1=1 2=2");
+
+  rc = mmdb_search(db, "titles", "spaghetti", 0, hits_cb, &hits);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(hits, ==, 2);
+
+  // and later writes keep them up to date
+  rc = mmdb_get(db, &doc, "a");
+  munit_assert_int(rc, ==, MMDB_OK);
+  json_object_set_new(doc.fields, "x", json_integer(2));
+  json_object_set_new(doc.fields, "title", json_string("linguine"));
+  rc = mmdb_put(db, &rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  mmdb_doc_clear(&doc);
+
+  memset(&counts, 0, sizeof(counts));
+  rc = mmdb_view(db, "xs", MMDB_REDUCE_COUNT, counts_cb, &counts);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_string_equal(counts.out, "2=3");
+
+  hits = 0;
+  rc = mmdb_search(db, "titles", "spaghetti", 0, hits_cb, &hits);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(hits, ==, 1);
+
+  mmdb_close(db);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_import_duplicate(const MunitParameter params[],
+                                       void* p) {
+  int rc;
+  mmdb_t* db;
+  mmdb_doc_t doc;
+  FILE* in;
+  const char dup[] = "{\"_id\":\"a\"}\n{\"_id\":\"b\"}\n{\"_id\":\"a\"}\n";
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  in = fmemopen((void*)dup, strlen(dup), "r");
+  rc = mmdb_import(db, in, 2, NULL);
+  munit_assert_int(rc, ==, MMDB_ERROR);
+  fclose(in);
+
+  rc = mmdb_get(db, &doc, "b");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_uint(doc.rev.seq, ==, 0);
+
+  return MUNIT_OK;
+}
+
+static MunitTest mmdb_import_tests[] = {
+    {"/duplicate", test_mmdb_import_duplicate, NULL, NULL,
+     MUNIT_TEST_OPTION_NONE, NULL},
+    {"/indexed", test_mmdb_import_indexed, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {"/roundtrip", test_mmdb_import_roundtrip, NULL, NULL,
+     MUNIT_TEST_OPTION_NONE, NULL},
+    {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
+
+MunitSuite mmdb_import_suite = {"/mmdb_import", mmdb_import_tests, NULL, 1,
+                                MUNIT_SUITE_OPTION_NONE};
@@ -0,0 +1,207 @@
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mmdb.h"
+#include "q.h"
+
+#include "munit/munit.h"
+
+// schema and contents as written by the first release, before migrations
+static const char legacy_schema[] =
+    "create table meta (rev text not null);"
+    "create table docs (id text not null, rev blob not null);"
+    "create table revs (id text not null, rev blob not null, doc blob, leaf "
+    "integer not null default 1, deleted integer not null default 0);"
+    "insert into docs (id, rev) values ('SpaghettiWithMeatballs', "
+    "'2-7051cbe5c8faecd085a3fa619e6e6337');"
+    "insert into revs (id, rev, doc, leaf) values ('SpaghettiWithMeatballs', "
+    "'1-967a00dff5e02add41819138abb3284d', '{}', 0);"
+    "insert into revs (id, rev, doc) values ('SpaghettiWithMeatballs', "
+    "'2-7051cbe5c8faecd085a3fa619e6e6337', '{\"a\":\"a\"}');";
+
+MunitResult test_mmdb_open_migrate(const MunitParameter params[], void* p) {
+  int rc;
+  char filename[] = "/tmp/mmdb_tests_XXXXXX";
+  sqlite3* legacy;
+  mmdb_t* db;
+  mmdb_doc_t doc;
+  mmdb_revs_t revs;
+
+  rc = mkstemp(filename);
+  munit_assert_int(rc, >=, 0);
+  close(rc);
+
+  rc = sqlite3_open(filename, &legacy);
+  munit_assert_int(rc, ==, SQLITE_OK);
+  rc = sqlite3_exec(legacy, legacy_schema, NULL, NULL, NULL);
+  munit_assert_int(rc, ==, SQLITE_OK);
+  rc = sqlite3_close(legacy);
+  munit_assert_int(rc, ==, SQLITE_OK);
+
+  rc = mmdb_open(filename, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_get(db, &doc, "SpaghettiWithMeatballs");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(doc.rev.seq, ==, 2);
+  munit_assert_string_equal(
+      json_string_value(json_object_get(doc.fields, "a")), "a");
+
+  rc = mmdb_get_rev(db, &doc, "SpaghettiWithMeatballs",
+                    "1-967a00dff5e02add41819138abb3284d");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(doc.rev.seq, ==, 1);
+
+  rc = mmdb_revs_new(&revs);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_revs(db, &revs, "SpaghettiWithMeatballs");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(revs.total, ==, 1);
+
+  unlink(filename);
+
+  return MUNIT_OK;
+}
+
+static int hex_cb(sqlite3_stmt* stmt, void* ptr) {
+  return q_scan(stmt, "s", ptr, (size_t)33);
+}
+
+MunitResult test_mmdb_open_hash(const MunitParameter params[], void* p) {
+  int rc;
+  char filename[] = "/tmp/mmdb_tests_XXXXXX";
+  mmdb_t *db, *md5;
+  mmdb_doc_t doc;
+  mmdb_rev_t rev, rev_md5;
+
+  rc = mkstemp(filename);
+  munit_assert_int(rc, >=, 0);
+  close(rc);
+
+  rc = mmdb_open(filename, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(db->hash, ==, MMDB_HASH_MD5);
+  rc = mmdb_set_hash(db, MMDB_HASH_BLAKE3);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc, "SpaghettiWithMeatballs", NULL, "{\"a\":1}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  // the algorithm is fixed once there are revisions keyed by it
+  rc = mmdb_set_hash(db, MMDB_HASH_MD5);
+  munit_assert_int(rc, ==, MMDB_ERROR);
+
+  rc = mmdb_open(NULL, &md5);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(md5, &rev_md5, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_memory_not_equal(sizeof(rev.hash), rev.hash, rev_md5.hash);
+
+  rc = mmdb_open(filename, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(db->hash, ==, MMDB_HASH_BLAKE3);
+
+  rc = mmdb_get(db, &doc, "SpaghettiWithMeatballs");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_memory_equal(sizeof(rev), &rev, &doc.rev);
+
+  unlink(filename);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_open_options(const MunitParameter params[], void* p) {
+  int rc;
+  char filename[] = "/tmp/mmdb_tests_XXXXXX";
+  mmdb_t *db, *ro;
+  mmdb_doc_t doc;
+  mmdb_rev_t rev;
+  mmdb_open_options_t opts = {.journal_mode = "wal",
+                              .synchronous = "normal",
+                              .cache_size = 500,
+                              .mmap_size = 1 << 20,
+                              .page_size = 8192,
+                              .busy_timeout = 250};
+  mmdb_open_options_t ro_opts = {.read_only = 1};
+
+  rc = mkstemp(filename);
+  munit_assert_int(rc, >=, 0);
+  close(rc);
+
+  rc = mmdb_open_v2(filename, &db, &opts);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_string_equal(opts.journal_mode, "wal");
+  munit_assert_string_equal(opts.synchronous, "normal");
+  munit_assert_int(opts.cache_size, ==, 500);
+  munit_assert_int(opts.mmap_size, ==, 1 << 20);
+  munit_assert_int(opts.page_size, ==, 8192);
+  munit_assert_int(opts.busy_timeout, ==, 250);
+  munit_assert_int(opts.read_only, ==, 0);
+
+  rc = mmdb_doc_new(&doc, "SpaghettiWithMeatballs", NULL, "{}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_open_v2(filename, &ro, &ro_opts);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_string_equal(ro_opts.journal_mode, "wal");
+  munit_assert_int(ro_opts.page_size, ==, 8192);
+  munit_assert_int(ro_opts.read_only, ==, 1);
+
+  rc = mmdb_get(ro, &doc, "SpaghettiWithMeatballs");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_memory_equal(sizeof(rev), &rev, &doc.rev);
+
+  rc = mmdb_put(ro, &rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_ERROR);
+
+  unlink(filename);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_open_hash_xxh3(const MunitParameter params[],
+                                     void* p) {
+  int rc;
+  char hex[33];
+  mmdb_t* db;
+  mmdb_doc_t doc;
+  mmdb_rev_t rev;
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_set_hash(db, MMDB_HASH_XXH3);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc, "SpaghettiWithMeatballs", NULL, "{\"a\":1}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  // XXH3-128 of {"a":1}, in canonical (big endian) order
+  rc = q_exec1(db->db, "select lower(hex(hash)) from bodies", hex, hex_cb, "");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_string_equal(hex, "3c8c141663acf5a1b6b7137162fa70fb");
+
+  return MUNIT_OK;
+}
+
+static MunitTest mmdb_open_tests[] = {
+    {"/hash", test_mmdb_open_hash, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {"/hash_xxh3", test_mmdb_open_hash_xxh3, NULL, NULL,
+     MUNIT_TEST_OPTION_NONE, NULL},
+    {"/migrate", test_mmdb_open_migrate, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {"/options", test_mmdb_open_options, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
+
+MunitSuite mmdb_open_suite = {"/mmdb_open", mmdb_open_tests, NULL, 1,
+                              MUNIT_SUITE_OPTION_NONE};
@@ -0,0 +1,127 @@
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "mmdb.h"
+
+#include "munit/munit.h"
+
+MunitResult test_mmdb_patch_merge(const MunitParameter params[], void* p) {
+  int rc;
+  mmdb_t* db;
+  mmdb_doc_t doc;
+  mmdb_rev_t rev1, rev2;
+  json_t* patch;
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc, "SpaghettiWithMeatballs", NULL,
+                    "{\"count\":1,\"a\":{\"b\":\"c\",\"d\":\"e\"},\"f\":1}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev1, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  patch = json_loads("{\"count\":2,\"a\":{\"b\":null,\"g\":\"h\"},\"f\":null}",
+                     0, NULL);
+  munit_assert_not_null(patch);
+
+  rc = mmdb_patch(db, &rev2, "SpaghettiWithMeatballs", NULL,
+                  MMDB_PATCH_MERGE, patch);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(rev2.seq, ==, 2);
+
+  rc = mmdb_get(db, &doc, "SpaghettiWithMeatballs");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_memory_equal(sizeof(rev2), &rev2, &doc.rev);
+  munit_assert_int(json_integer_value(json_object_get(doc.fields, "count")),
+                   ==, 2);
+  munit_assert_null(json_object_get(doc.fields, "f"));
+  munit_assert_null(json_object_get(json_object_get(doc.fields, "a"), "b"));
+  munit_assert_string_equal(
+      json_string_value(json_object_get(json_object_get(doc.fields, "a"), "d")),
+      "e");
+  munit_assert_string_equal(
+      json_string_value(json_object_get(json_object_get(doc.fields, "a"), "g")),
+      "h");
+
+  // patching from a revision that's no longer the winner is a conflict
+  rc = mmdb_patch(db, &rev2, "SpaghettiWithMeatballs", &rev1,
+                  MMDB_PATCH_MERGE, patch);
+  munit_assert_int(rc, ==, MMDB_CONFLICT);
+
+  rc = mmdb_patch(db, &rev2, "LasagneAlForno", NULL, MMDB_PATCH_MERGE, patch);
+  munit_assert_int(rc, ==, MMDB_NOT_FOUND);
+
+  json_decref(patch);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_patch_json(const MunitParameter params[], void* p) {
+  int rc;
+  mmdb_t* db;
+  mmdb_doc_t doc;
+  mmdb_rev_t rev1, rev2;
+  json_t *patch, *tags;
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc, "SpaghettiWithMeatballs", NULL,
+                    "{\"count\":1,\"tags\":[\"a\",\"c\"],\"a/b\":1}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev1, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  patch = json_loads(
+      "[{\"op\":\"test\",\"path\":\"/count\",\"value\":1},"
+      "{\"op\":\"replace\",\"path\":\"/count\",\"value\":2},"
+      "{\"op\":\"add\",\"path\":\"/tags/1\",\"value\":\"b\"},"
+      "{\"op\":\"add\",\"path\":\"/tags/-\",\"value\":\"d\"},"
+      "{\"op\":\"move\",\"from\":\"/a~1b\",\"path\":\"/moved\"},"
+      "{\"op\":\"copy\",\"from\":\"/count\",\"path\":\"/copied\"}]",
+      0, NULL);
+  munit_assert_not_null(patch);
+
+  rc = mmdb_patch(db, &rev2, "SpaghettiWithMeatballs", &rev1, MMDB_PATCH_JSON,
+                  patch);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_get(db, &doc, "SpaghettiWithMeatballs");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_memory_equal(sizeof(rev2), &rev2, &doc.rev);
+  munit_assert_int(json_integer_value(json_object_get(doc.fields, "count")),
+                   ==, 2);
+  munit_assert_int(json_integer_value(json_object_get(doc.fields, "copied")),
+                   ==, 2);
+  munit_assert_int(json_integer_value(json_object_get(doc.fields, "moved")),
+                   ==, 1);
+  munit_assert_null(json_object_get(doc.fields, "a/b"));
+  tags = json_object_get(doc.fields, "tags");
+  munit_assert_int(json_array_size(tags), ==, 4);
+  munit_assert_string_equal(json_string_value(json_array_get(tags, 1)), "b");
+  munit_assert_string_equal(json_string_value(json_array_get(tags, 3)), "d");
+
+  // the test op now fails, and nothing is written
+  rc = mmdb_patch(db, &rev1, "SpaghettiWithMeatballs", NULL, MMDB_PATCH_JSON,
+                  patch);
+  munit_assert_int(rc, ==, MMDB_CONFLICT);
+
+  rc = mmdb_get(db, &doc, "SpaghettiWithMeatballs");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_memory_equal(sizeof(rev2), &rev2, &doc.rev);
+
+  json_decref(patch);
+
+  return MUNIT_OK;
+}
+
+static MunitTest mmdb_patch_tests[] = {
+    {"/merge", test_mmdb_patch_merge, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {"/json", test_mmdb_patch_json, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
+
+MunitSuite mmdb_patch_suite = {"/mmdb_patch", mmdb_patch_tests, NULL, 1,
+                               MUNIT_SUITE_OPTION_NONE};
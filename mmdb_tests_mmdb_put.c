@@ -1,7 +1,9 @@
 #include <jansson.h>
 #include <sqlite3.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "mmdb.h"
 #include "q.h"
@@ -169,6 +171,285 @@ MunitResult test_mmdb_put_conflict_good(const MunitParameter params[],
   return MUNIT_OK;
 }
 
+static int count_cb(sqlite3_stmt* stmt, void* ptr) {
+  return q_scan(stmt, "i", ptr);
+}
+
+MunitResult test_mmdb_put_dedup(const MunitParameter params[], void* p) {
+  int rc, n;
+  mmdb_t* db;
+  mmdb_doc_t doc1, doc2;
+  mmdb_rev_t rev1, rev2;
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc1, "SpaghettiWithMeatballs", NULL, "{\"a\":1}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev1, &doc1, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc2, "LasagneAlForno", NULL, "{\"a\":1}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev2, &doc2, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = q_exec1(db->db, "select count(*) from bodies", &n, count_cb, "");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(n, ==, 1);
+
+  rc = q_exec1(db->db, "select refs from bodies", &n, count_cb, "");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(n, ==, 2);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_put_collision(const MunitParameter params[],
+                                    void* p) {
+  int rc, n;
+  mmdb_t* db;
+  mmdb_doc_t doc;
+  mmdb_rev_t rev;
+  mmdb_attachment_t att = {.name = "a.txt", .type = "text/plain"};
+  mmdb_put_options_t opts = {.attachments = &att, .attachments_total = 1};
+  FILE* in;
+  const char ndjson[] = "{\"_id\":\"LasagneAlForno\",\"a\":1}\n";
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  // stands in for a different body whose hash collides with {"a":1}'s
+  rc = q_exec0(db->db,
+               "insert into bodies (hash, doc, refs) values "
+               "(mmdb_body_hash('{\"a\":1}'), '{\"a\":2}', 1)",
+               "");
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  // a body is never taken to be one that only shares its hash
+  rc = mmdb_doc_new(&doc, "SpaghettiWithMeatballs", NULL, "{\"a\":1}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_ERROR);
+
+  in = fmemopen((void*)ndjson, strlen(ndjson), "r");
+  rc = mmdb_import(db, in, 1, NULL);
+  munit_assert_int(rc, ==, MMDB_ERROR);
+  fclose(in);
+
+  rc = q_exec1(db->db, "select refs from bodies", &n, count_cb, "");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(n, ==, 1);
+
+  // and the same goes for attachments
+  att.data = "hello";
+  att.length = 5;
+  rc = mmdb_doc_new(&doc, "SpaghettiWithMeatballs", NULL, "{}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev, &doc, &opts);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = q_exec0(db->db, "update attachments set data = 'jello'", "");
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc, "LasagneAlForno", NULL, "{}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev, &doc, &opts);
+  munit_assert_int(rc, ==, MMDB_ERROR);
+
+  mmdb_close(db);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_put_docid(const MunitParameter params[], void* p) {
+  int rc, n;
+  mmdb_t* db;
+  mmdb_doc_t doc, out;
+  mmdb_rev_t rev;
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc, "SpaghettiWithMeatballs", NULL, "{\"a\":1}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  // looked up once, then served from the handle's cache
+  rc = mmdb_get(db, &out, "SpaghettiWithMeatballs");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_doc_new(&doc, "SpaghettiWithMeatballs", NULL, "{\"a\":2}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  doc.rev = rev;
+  rc = mmdb_put(db, &rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_get(db, &out, "SpaghettiWithMeatballs");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_memory_equal(sizeof(rev), &rev, &out.rev);
+
+  rc = q_exec1(db->db,
+               "select count(*) from revs r join docs d on d.docid = r.docid "
+               "where d.id = 'SpaghettiWithMeatballs'",
+               &n, count_cb, "");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(n, ==, 2);
+
+  // a document created and read inside a transaction that rolls back must
+  // not leave its key behind
+  rc = sqlite3_exec(db->db, "savepoint t", NULL, NULL, NULL);
+  munit_assert_int(rc, ==, SQLITE_OK);
+  rc = mmdb_doc_new(&doc, "LasagneAlForno", NULL, "{}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_get(db, &out, "LasagneAlForno");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(out.rev.seq, ==, 1);
+  rc = sqlite3_exec(db->db, "rollback to t; release t", NULL, NULL, NULL);
+  munit_assert_int(rc, ==, SQLITE_OK);
+
+  rc = mmdb_get(db, &out, "LasagneAlForno");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(out.rev.seq, ==, 0);
+  rc = mmdb_put(db, &rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_get(db, &out, "LasagneAlForno");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(out.rev.seq, ==, 1);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_put_delta(const MunitParameter params[], void* p) {
+  int rc, n, i;
+  mmdb_t* db;
+  mmdb_doc_t doc, out;
+  mmdb_rev_t revs[4];
+  mmdb_open_options_t opts = {.delta_chain = 2};
+  char fields[64];
+
+  rc = mmdb_open_v2(NULL, &db, &opts);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(opts.delta_chain, ==, 2);
+
+  for (i = 0; i < 4; i++) {
+    snprintf(fields, sizeof(fields), "{\"n\":%d,\"tags\":[\"a\",\"b\"]}",
+             i);
+    rc = mmdb_doc_new(&doc, "SpaghettiWithMeatballs", NULL, fields);
+    munit_assert_int(rc, ==, MMDB_OK);
+    if (i > 0) {
+      doc.rev = revs[i - 1];
+    }
+    rc = mmdb_put(db, &revs[i], &doc, NULL);
+    munit_assert_int(rc, ==, MMDB_OK);
+  }
+
+  // the third revision would be three deltas from the leaf, so it stays whole
+  rc = q_exec1(db->db, "select count(*) from revs where delta is not null", &n,
+               count_cb, "");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(n, ==, 2);
+
+  rc = q_exec1(db->db, "select count(*) from bodies", &n, count_cb, "");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(n, ==, 2);
+
+  for (i = 0; i < 4; i++) {
+    char rev[MMDB_MAX_REV_LENGTH];
+
+    rc = mmdb_rev_format(rev, sizeof(rev), &revs[i]);
+    munit_assert_int(rc, ==, MMDB_OK);
+    rc = mmdb_get_rev(db, &out, "SpaghettiWithMeatballs", rev);
+    munit_assert_int(rc, ==, MMDB_OK);
+    munit_assert_memory_equal(sizeof(revs[i]), &revs[i], &out.rev);
+    munit_assert_int(json_integer_value(json_object_get(out.fields, "n")), ==,
+                     i);
+    munit_assert_int(json_array_size(json_object_get(out.fields, "tags")), ==,
+                     2);
+  }
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_put_filter(const MunitParameter params[], void* p) {
+  int rc, i;
+  char filename[] = "/tmp/mmdb_tests_XXXXXX", id[MMDB_MAX_ID_LENGTH];
+  mmdb_t* db;
+  mmdb_doc_t doc;
+  mmdb_rev_t rev;
+  mmdb_stats_t stats;
+  mmdb_open_options_t opts = {.id_filter = 10};
+
+  rc = mkstemp(filename);
+  munit_assert_int(rc, >=, 0);
+  close(rc);
+
+  rc = mmdb_open_v2(filename, &db, &opts);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(opts.id_filter, ==, 10);
+
+  // enough new ids to outgrow the filter's starting size
+  for (i = 0; i < 1500; i++) {
+    snprintf(id, sizeof(id), "Spaghetti%d", i);
+    rc = mmdb_doc_new(&doc, id, NULL, "{}");
+    munit_assert_int(rc, ==, MMDB_OK);
+    rc = mmdb_put(db, &rev, &doc, NULL);
+    munit_assert_int(rc, ==, MMDB_OK);
+    mmdb_doc_clear(&doc);
+  }
+
+  rc = mmdb_stats(db, &stats);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(stats.filter_ids, ==, 1500);
+  munit_assert_int(stats.filter_capacity, ==, 2048);
+  munit_assert_int(stats.filter_hashes, ==, 7);
+  munit_assert_int(stats.filter_lookups, ==, 1500);
+  munit_assert_int(stats.filter_skipped + stats.filter_false_positives, ==,
+                   1500);
+  munit_assert_size(stats.filter_bytes, >=, 2048 * 10 / 8);
+  munit_assert_double(stats.filter_fp_rate, <, 0.01);
+
+  // updates still find the documents they replace
+  rc = mmdb_get(db, &doc, "Spaghetti7");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_not_null(doc.fields);
+  rc = mmdb_put(db, &rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(rev.seq, ==, 2);
+  mmdb_doc_clear(&doc);
+
+  rc = mmdb_close(db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  // and a reopened handle builds its filter from what's stored
+  rc = mmdb_open_v2(filename, &db, &opts);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_get(db, &doc, "Spaghetti1499");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_not_null(doc.fields);
+  mmdb_doc_clear(&doc);
+
+  for (i = 0; i < 100; i++) {
+    snprintf(id, sizeof(id), "Meatballs%d", i);
+    rc = mmdb_get(db, &doc, id);
+    munit_assert_int(rc, ==, MMDB_OK);
+    munit_assert_null(doc.fields);
+  }
+
+  rc = mmdb_stats(db, &stats);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(stats.filter_ids, ==, 1500);
+  munit_assert_int(stats.filter_capacity, ==, 3000);
+  munit_assert_int(stats.filter_lookups, ==, 101);
+  munit_assert_int(stats.filter_skipped, >, 90);
+
+  mmdb_close(db);
+  unlink(filename);
+
+  return MUNIT_OK;
+}
+
 static MunitTest mmdb_put_tests[] = {
     {"/new", test_mmdb_put_new, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
     {"/update", test_mmdb_put_update, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
@@ -176,6 +457,12 @@ static MunitTest mmdb_put_tests[] = {
      MUNIT_TEST_OPTION_NONE, NULL},
     {"/conflict_good", test_mmdb_put_conflict_good, NULL, NULL,
      MUNIT_TEST_OPTION_NONE, NULL},
+    {"/dedup", test_mmdb_put_dedup, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {"/collision", test_mmdb_put_collision, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {"/docid", test_mmdb_put_docid, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {"/delta", test_mmdb_put_delta, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {"/filter", test_mmdb_put_filter, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
     {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
 
 MunitSuite mmdb_put_suite = {"/mmdb_put", mmdb_put_tests, NULL, 1,
@@ -0,0 +1,255 @@
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "mmdb.h"
+#include "q.h"
+
+#include "munit/munit.h"
+
+MunitResult test_mmdb_revs_leaves(const MunitParameter params[], void* p) {
+  int rc;
+  mmdb_t* db;
+  mmdb_doc_t doc1, doc2a, doc2b;
+  mmdb_rev_t rev1, rev2a, rev2b;
+  mmdb_put_options_t opts = {.allow_conflict = 1};
+  mmdb_revs_t revs;
+  char str[MMDB_MAX_REV_LENGTH], expected[MMDB_MAX_REV_LENGTH];
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc1, "SpaghettiWithMeatballs", NULL, "{}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev1, &doc1, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_revs_new(&revs);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_revs(db, &revs, "SpaghettiWithMeatballs");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(revs.total, ==, 1);
+  munit_assert_memory_equal(sizeof(rev1), &revs.revs[0], &rev1);
+
+  rc = mmdb_revs_format(&revs, 0, str, sizeof(str));
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_rev_format(expected, sizeof(expected), &rev1);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_string_equal(str, expected);
+
+  rc = mmdb_revs_format(&revs, 1, str, sizeof(str));
+  munit_assert_int(rc, ==, MMDB_ERROR);
+
+  rc = mmdb_doc_copy(&doc2a, &doc1);
+  munit_assert_int(rc, ==, MMDB_OK);
+  doc2a.rev = rev1;
+  rc = json_object_set_new(doc2a.fields, "a", json_string("a"));
+  munit_assert_int(rc, ==, 0);
+  rc = mmdb_put(db, &rev2a, &doc2a, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_copy(&doc2b, &doc1);
+  munit_assert_int(rc, ==, MMDB_OK);
+  doc2b.rev = rev1;
+  rc = json_object_set_new(doc2b.fields, "b", json_string("b"));
+  munit_assert_int(rc, ==, 0);
+  rc = mmdb_put(db, &rev2b, &doc2b, &opts);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  // the same container is reused and replaces the previous result
+  rc = mmdb_revs(db, &revs, "SpaghettiWithMeatballs");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(revs.total, ==, 2);
+  munit_assert_int(revs.revs[0].seq, ==, 2);
+  munit_assert_int(revs.revs[1].seq, ==, 2);
+
+  mmdb_revs_free(&revs);
+  munit_assert_int(revs.total, ==, 0);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_revs_grow(const MunitParameter params[], void* p) {
+  int rc, i;
+  mmdb_revs_t revs;
+  mmdb_rev_t rev;
+
+  rc = mmdb_revs_new(&revs);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  for (i = 1; i <= 1000; i++) {
+    mmdb_rev_clear(&rev);
+    rev.seq = i;
+    rc = mmdb_revs_push(&revs, &rev);
+    munit_assert_int(rc, ==, MMDB_OK);
+  }
+
+  munit_assert_int(revs.total, ==, 1000);
+  for (i = 0; i < 1000; i++) {
+    munit_assert_uint(revs.revs[i].seq, ==, i + 1);
+  }
+
+  // after a reset only one block is kept around for the next result
+  mmdb_revs_reset(&revs);
+  munit_assert_int(revs.total, ==, 0);
+  munit_assert_not_null(revs.arena.head);
+  munit_assert_null(revs.arena.head->next);
+
+  mmdb_revs_free(&revs);
+  munit_assert_null(revs.arena.head);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_revs_history(const MunitParameter params[], void* p) {
+  int rc, i;
+  mmdb_t* db;
+  mmdb_doc_t doc;
+  mmdb_rev_t revs_put[5];
+  mmdb_revs_t revs;
+  char str[MMDB_MAX_REV_LENGTH];
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc, "SpaghettiWithMeatballs", NULL, "{}");
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  for (i = 0; i < 5; i++) {
+    rc = json_object_set_new(doc.fields, "n", json_integer(i));
+    munit_assert_int(rc, ==, 0);
+    rc = mmdb_put(db, &revs_put[i], &doc, NULL);
+    munit_assert_int(rc, ==, MMDB_OK);
+    doc.rev = revs_put[i];
+  }
+  mmdb_doc_clear(&doc);
+
+  rc = mmdb_revs_new(&revs);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_rev_history(db, &revs, "SpaghettiWithMeatballs", NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(revs.total, ==, 5);
+  for (i = 0; i < 5; i++) {
+    munit_assert_memory_equal(sizeof(mmdb_rev_t), &revs.revs[i],
+                              &revs_put[4 - i]);
+  }
+
+  rc = mmdb_rev_format(str, sizeof(str), &revs_put[2]);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_rev_history(db, &revs, "SpaghettiWithMeatballs", str);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(revs.total, ==, 3);
+  munit_assert_memory_equal(sizeof(mmdb_rev_t), &revs.revs[0], &revs_put[2]);
+  munit_assert_memory_equal(sizeof(mmdb_rev_t), &revs.revs[2], &revs_put[0]);
+
+  rc = mmdb_rev_history(db, &revs, "SpaghettiWithMeatballs", "9-00");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(revs.total, ==, 0);
+
+  rc = mmdb_rev_history(db, &revs, "LasagneAlForno", NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(revs.total, ==, 0);
+
+  mmdb_revs_free(&revs);
+  mmdb_close(db);
+
+  return MUNIT_OK;
+}
+
+static int count_rows(mmdb_t* db, const char* sql) {
+  sqlite3_stmt* stmt = NULL;
+  int n;
+
+  munit_assert_int(sqlite3_prepare_v2(db->db, sql, -1, &stmt, NULL), ==,
+                   SQLITE_OK);
+  munit_assert_int(sqlite3_step(stmt), ==, SQLITE_ROW);
+  n = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+
+  return n;
+}
+
+MunitResult test_mmdb_revs_stem(const MunitParameter params[], void* p) {
+  int rc, i;
+  mmdb_t* db;
+  mmdb_doc_t doc, out;
+  mmdb_rev_t revs_put[6];
+  mmdb_revs_t revs;
+  mmdb_open_options_t opts = {.delta_chain = 2};
+  mmdb_attachment_t att = {.name = "photo.png", .type = "image/png"};
+  mmdb_put_options_t put_opts = {.attachments = &att, .attachments_total = 1};
+  char str[MMDB_MAX_REV_LENGTH];
+
+  rc = mmdb_open_v2(NULL, &db, &opts);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_set_revs_limit(db, 3);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(db->revs_limit, ==, 3);
+
+  rc = mmdb_doc_new(&doc, "SpaghettiWithMeatballs", NULL, "{}");
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  // the first two revisions each bring their own attachment, and the rest
+  // carry the second one over
+  for (i = 0; i < 6; i++) {
+    rc = json_object_set_new(doc.fields, "n", json_integer(i));
+    munit_assert_int(rc, ==, 0);
+    att.data = i == 0 ? "before" : "after";
+    att.length = strlen(att.data);
+    rc = mmdb_put(db, &revs_put[i], &doc, i < 2 ? &put_opts : NULL);
+    munit_assert_int(rc, ==, MMDB_OK);
+    doc.rev = revs_put[i];
+  }
+  mmdb_doc_clear(&doc);
+
+  rc = mmdb_revs_new(&revs);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_rev_history(db, &revs, "SpaghettiWithMeatballs", NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(revs.total, ==, 3);
+  munit_assert_memory_equal(sizeof(mmdb_rev_t), &revs.revs[2], &revs_put[3]);
+  mmdb_revs_free(&revs);
+
+  munit_assert_int(count_rows(db, "select count(*) from revs"), ==, 3);
+  munit_assert_int(count_rows(db, "select count(*) from rev_attachments"), ==,
+                   3);
+  munit_assert_int(count_rows(db, "select count(*) from attachments"), ==, 1);
+  munit_assert_int(
+      count_rows(db, "select count(*) from bodies where refs != (select "
+                     "count(*) from revs where body = bodies.hash)"),
+      ==, 0);
+
+  rc = mmdb_rev_format(str, sizeof(str), &revs_put[1]);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_get_rev(db, &out, "SpaghettiWithMeatballs", str);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_null(out.fields);
+
+  // kept revisions stored as deltas can still be rebuilt
+  rc = mmdb_rev_format(str, sizeof(str), &revs_put[3]);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_get_rev(db, &out, "SpaghettiWithMeatballs", str);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_not_null(out.fields);
+  munit_assert_int(json_integer_value(json_object_get(out.fields, "n")), ==,
+                   3);
+  mmdb_doc_clear(&out);
+
+  mmdb_close(db);
+
+  return MUNIT_OK;
+}
+
+static MunitTest mmdb_revs_tests[] = {
+    {"/leaves", test_mmdb_revs_leaves, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {"/grow", test_mmdb_revs_grow, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {"/history", test_mmdb_revs_history, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {"/stem", test_mmdb_revs_stem, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
+
+MunitSuite mmdb_revs_suite = {"/mmdb_revs", mmdb_revs_tests, NULL, 1,
+                              MUNIT_SUITE_OPTION_NONE};
@@ -0,0 +1,159 @@
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mmdb.h"
+
+#include "munit/munit.h"
+
+typedef struct hits_s {
+  int total;
+  char ids[4][MMDB_MAX_ID_LENGTH + 1];
+  mmdb_rev_t revs[4];
+} hits_t;
+
+static int hits_cb(const char* id, mmdb_rev_t* rev, double rank, void* ptr) {
+  hits_t* hits = ptr;
+
+  if (hits->total < 4) {
+    strcpy(hits->ids[hits->total], id);
+    hits->revs[hits->total] = *rev;
+  }
+  hits->total++;
+
+  return MMDB_OK;
+}
+
+static void put_doc(mmdb_t* db, mmdb_rev_t* rev, const char* id,
+                    mmdb_rev_t* parent, const char* fields) {
+  mmdb_doc_t doc;
+  int rc;
+
+  rc = mmdb_doc_new(&doc, id, NULL, fields);
+  munit_assert_int(rc, ==, MMDB_OK);
+  if (parent != NULL) {
+    doc.rev = *parent;
+  }
+  rc = mmdb_put(db, rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  mmdb_doc_clear(&doc);
+}
+
+MunitResult test_mmdb_search_update(const MunitParameter params[], void* p) {
+  int rc;
+  mmdb_t* db;
+  mmdb_rev_t rev1, rev2, rev3;
+  hits_t hits;
+  json_t* fields;
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  // documents written before the index exists are picked up when it's made
+  put_doc(db, &rev1, "Carbonara", NULL,
+          "{\"title\":\"Spaghetti carbonara\",\"recipe\":{\"text\":\"eggs, "
+          "pecorino and guanciale\"}}");
+
+  fields = json_loads("[\"title\",\"recipe.text\"]", 0, NULL);
+  rc = mmdb_create_search(db, "recipes", fields);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_create_search(db, "recipes", fields);
+  munit_assert_int(rc, ==, MMDB_CONFLICT);
+  json_decref(fields);
+
+  put_doc(db, &rev2, "Bolognese", NULL,
+          "{\"title\":\"Spaghetti bolognese\",\"recipe\":{\"text\":\"beef "
+          "and spaghetti, spaghetti and beef\"}}");
+
+  memset(&hits, 0, sizeof(hits));
+  rc = mmdb_search(db, "recipes", "spaghetti", 0, hits_cb, &hits);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(hits.total, ==, 2);
+  munit_assert_string_equal(hits.ids[0], "Bolognese");
+  munit_assert_memory_equal(sizeof(rev2), &rev2, &hits.revs[0]);
+  munit_assert_string_equal(hits.ids[1], "Carbonara");
+
+  // only the winning revision is searchable
+  put_doc(db, &rev3, "Carbonara", &rev1,
+          "{\"title\":\"Linguine carbonara\",\"recipe\":{\"text\":\"eggs\"}}");
+
+  memset(&hits, 0, sizeof(hits));
+  rc = mmdb_search(db, "recipes", "spaghetti", 0, hits_cb, &hits);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(hits.total, ==, 1);
+  munit_assert_string_equal(hits.ids[0], "Bolognese");
+
+  memset(&hits, 0, sizeof(hits));
+  rc = mmdb_search(db, "recipes", "linguine OR beef", 1, hits_cb, &hits);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(hits.total, ==, 1);
+
+  memset(&hits, 0, sizeof(hits));
+  rc = mmdb_search(db, "recipes", "linguine", 0, hits_cb, &hits);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(hits.total, ==, 1);
+  munit_assert_memory_equal(sizeof(rev3), &rev3, &hits.revs[0]);
+
+  rc = mmdb_search(db, "desserts", "linguine", 0, hits_cb, &hits);
+  munit_assert_int(rc, ==, MMDB_NOT_FOUND);
+
+  mmdb_close(db);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_search_handles(const MunitParameter params[], void* p) {
+  int rc;
+  char filename[] = "/tmp/mmdb_tests_XXXXXX";
+  mmdb_t *a, *b;
+  mmdb_rev_t rev;
+  hits_t hits;
+  json_t* fields;
+
+  rc = mkstemp(filename);
+  munit_assert_int(rc, >=, 0);
+  close(rc);
+
+  rc = mmdb_open(filename, &a);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_open(filename, &b);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  // an index made on b after a was opened is kept up to date by a's writes
+  fields = json_loads("[\"title\"]", 0, NULL);
+  rc = mmdb_create_search(b, "recipes", fields);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_create_search(a, "recipes", fields);
+  munit_assert_int(rc, ==, MMDB_CONFLICT);
+  json_decref(fields);
+
+  put_doc(a, &rev, "Carbonara", NULL, "{\"title\":\"Spaghetti carbonara\"}");
+
+  memset(&hits, 0, sizeof(hits));
+  rc = mmdb_search(b, "recipes", "spaghetti", 0, hits_cb, &hits);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(hits.total, ==, 1);
+
+  memset(&hits, 0, sizeof(hits));
+  rc = mmdb_search(a, "recipes", "spaghetti", 0, hits_cb, &hits);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(hits.total, ==, 1);
+
+  mmdb_close(a);
+  mmdb_close(b);
+  unlink(filename);
+
+  return MUNIT_OK;
+}
+
+static MunitTest mmdb_search_tests[] = {
+    {"/handles", test_mmdb_search_handles, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {"/update", test_mmdb_search_update, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
+
+MunitSuite mmdb_search_suite = {"/mmdb_search", mmdb_search_tests, NULL, 1,
+                                MUNIT_SUITE_OPTION_NONE};
@@ -0,0 +1,106 @@
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mmdb.h"
+
+#include "munit/munit.h"
+
+#define N 50
+
+static int scan_cb(mmdb_doc_t* doc, void* ptr) {
+  char* last = ptr;
+
+  munit_assert_int(strcmp(last, doc->id), <, 0);
+  strcpy(last, doc->id);
+
+  return MMDB_OK;
+}
+
+MunitResult test_mmdb_shard_route(const MunitParameter params[], void* p) {
+  int rc, i, j, used[4] = {0, 0, 0, 0};
+  char dir[] = "/tmp/mmdb_tests_XXXXXX", id[MMDB_MAX_ID_LENGTH],
+      last[MMDB_MAX_ID_LENGTH], cmd[64];
+  mmdb_t *db, *again;
+  mmdb_doc_t doc;
+  mmdb_rev_t revs[N];
+  mmdb_revs_t leaves;
+
+  munit_assert_not_null(mkdtemp(dir));
+
+  rc = mmdb_open_sharded(dir, 4, &db, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  for (i = 0; i < N; i++) {
+    snprintf(id, sizeof(id), "doc%02d", i);
+    rc = mmdb_doc_new(&doc, id, NULL, "{}");
+    munit_assert_int(rc, ==, MMDB_OK);
+    rc = mmdb_put(db, &revs[i], &doc, NULL);
+    munit_assert_int(rc, ==, MMDB_OK);
+  }
+
+  for (i = 0; i < N; i++) {
+    snprintf(id, sizeof(id), "doc%02d", i);
+    rc = mmdb_get(db, &doc, id);
+    munit_assert_int(rc, ==, MMDB_OK);
+    munit_assert_memory_equal(sizeof(revs[i]), &revs[i], &doc.rev);
+
+    for (j = 0; j < 4; j++) {
+      used[j] += mmdb_shard(db, id) == db->shards[j];
+    }
+  }
+
+  for (j = 0; j < 4; j++) {
+    munit_assert_int(used[j], >, 0);
+  }
+
+  rc = mmdb_revs_new(&leaves);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_revs(db, &leaves, "doc07");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(leaves.total, ==, 1);
+  mmdb_revs_free(&leaves);
+
+  // merged across shards back into a single id order
+  last[0] = 0;
+  rc = mmdb_scan(db, NULL, 0, scan_cb, last);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_string_equal(last, "doc49");
+
+  last[0] = 0;
+  rc = mmdb_scan(db, "doc10", 5, scan_cb, last);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_string_equal(last, "doc14");
+
+  rc = mmdb_close(db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  // the shard count is fixed when the directory is created
+  rc = mmdb_open_sharded(dir, 3, &again, NULL);
+  munit_assert_int(rc, ==, MMDB_ERROR);
+
+  rc = mmdb_open_sharded(dir, 4, &again, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_get(again, &doc, "doc33");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_memory_equal(sizeof(revs[33]), &revs[33], &doc.rev);
+  rc = mmdb_close(again);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+  munit_assert_int(system(cmd), ==, 0);
+
+  return MUNIT_OK;
+}
+
+static MunitTest mmdb_shard_tests[] = {
+    {"/route", test_mmdb_shard_route, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
+
+MunitSuite mmdb_shard_suite = {"/mmdb_shard", mmdb_shard_tests, NULL, 1,
+                               MUNIT_SUITE_OPTION_NONE};
@@ -0,0 +1,70 @@
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mmdb.h"
+
+#include "munit/munit.h"
+
+MunitResult test_mmdb_snapshot_isolation(const MunitParameter params[],
+                                         void* p) {
+  int rc;
+  char filename[] = "/tmp/mmdb_tests_XXXXXX";
+  mmdb_t *reader, *writer;
+  mmdb_doc_t doc;
+  mmdb_rev_t rev1, rev2;
+  mmdb_open_options_t opts = {.journal_mode = "wal", .busy_timeout = 1000};
+
+  rc = mkstemp(filename);
+  munit_assert_int(rc, >=, 0);
+  close(rc);
+
+  rc = mmdb_open_v2(filename, &writer, &opts);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_open_v2(filename, &reader, &opts);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_doc_new(&doc, "SpaghettiWithMeatballs", NULL, "{\"a\":1}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(writer, &rev1, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_snapshot_begin(reader);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_get(reader, &doc, "SpaghettiWithMeatballs");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_memory_equal(sizeof(rev1), &rev1, &doc.rev);
+
+  // the writer isn't blocked by the open snapshot
+  rc = mmdb_doc_set_fields_str(&doc, "{\"a\":2}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(writer, &rev2, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_get(reader, &doc, "SpaghettiWithMeatballs");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_memory_equal(sizeof(rev1), &rev1, &doc.rev);
+
+  rc = mmdb_snapshot_end(reader);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_get(reader, &doc, "SpaghettiWithMeatballs");
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_memory_equal(sizeof(rev2), &rev2, &doc.rev);
+
+  unlink(filename);
+
+  return MUNIT_OK;
+}
+
+static MunitTest mmdb_snapshot_tests[] = {
+    {"/isolation", test_mmdb_snapshot_isolation, NULL, NULL,
+     MUNIT_TEST_OPTION_NONE, NULL},
+    {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
+
+MunitSuite mmdb_snapshot_suite = {"/mmdb_snapshot", mmdb_snapshot_tests, NULL,
+                                  1, MUNIT_SUITE_OPTION_NONE};
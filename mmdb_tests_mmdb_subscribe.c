@@ -0,0 +1,283 @@
+#include <jansson.h>
+#include <poll.h>
+#include <sqlite3.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mmdb.h"
+
+#include "munit/munit.h"
+
+typedef struct changes_s {
+  int total;
+  char id[MMDB_MAX_ID_LENGTH + 1];
+  mmdb_rev_t rev;
+} changes_t;
+
+static void changes_cb(const char* id, mmdb_rev_t* rev, void* ptr) {
+  changes_t* changes = ptr;
+
+  changes->total++;
+  strcpy(changes->id, id);
+  changes->rev = *rev;
+}
+
+MunitResult test_mmdb_subscribe_commit(const MunitParameter params[],
+                                       void* p) {
+  int rc;
+  mmdb_t* db;
+  mmdb_doc_t doc;
+  mmdb_rev_t rev1, rev2, rev3;
+  mmdb_subscription_t* sub;
+  changes_t changes;
+  struct pollfd pfd;
+
+  memset(&changes, 0, sizeof(changes));
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_subscribe(db, &sub, "Spaghetti", changes_cb, &changes);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  // two writes to one document in a transaction arrive as one change, and
+  // documents outside the prefix aren't seen at all
+  rc = mmdb_begin(db);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_doc_new(&doc, "SpaghettiWithMeatballs", NULL, "{\"a\":1}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev1, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  doc.rev = rev1;
+  rc = mmdb_put(db, &rev2, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_doc_new(&doc, "LasagneAlForno", NULL, "{}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev3, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_subscription_poll(sub, 0);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(changes.total, ==, 0);
+
+  rc = mmdb_commit(db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  pfd.fd = mmdb_subscription_fd(sub);
+  pfd.events = POLLIN;
+  munit_assert_int(poll(&pfd, 1, 0), ==, 1);
+
+  rc = mmdb_subscription_poll(sub, 0);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(changes.total, ==, 1);
+  munit_assert_string_equal(changes.id, "SpaghettiWithMeatballs");
+  munit_assert_memory_equal(sizeof(rev2), &rev2, &changes.rev);
+
+  mmdb_unsubscribe(db, sub);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_subscribe_rollback(const MunitParameter params[],
+                                         void* p) {
+  int rc;
+  mmdb_t* db;
+  mmdb_doc_t doc;
+  mmdb_rev_t rev;
+  mmdb_subscription_t* sub;
+  changes_t changes;
+
+  memset(&changes, 0, sizeof(changes));
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_subscribe(db, &sub, NULL, changes_cb, &changes);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_begin(db);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_doc_new(&doc, "SpaghettiWithMeatballs", NULL, "{}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_rollback(db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_subscription_poll(sub, 0);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(changes.total, ==, 0);
+
+  // a plain put commits by itself
+  rc = mmdb_put(db, &rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_subscription_poll(sub, 100);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(changes.total, ==, 1);
+  munit_assert_memory_equal(sizeof(rev), &rev, &changes.rev);
+
+  mmdb_unsubscribe(db, sub);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_subscribe_nested(const MunitParameter params[],
+                                       void* p) {
+  int rc;
+  mmdb_t* db;
+  mmdb_doc_t doc;
+  mmdb_rev_t rev1, rev2, rev3;
+  mmdb_subscription_t* sub;
+  changes_t changes;
+
+  memset(&changes, 0, sizeof(changes));
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_subscribe(db, &sub, NULL, changes_cb, &changes);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  // rolling back an inner transaction forgets what it wrote, including its
+  // write over a document the outer one had already written
+  rc = mmdb_begin(db);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_doc_new(&doc, "SpaghettiWithMeatballs", NULL, "{\"a\":1}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev1, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_begin(db);
+  munit_assert_int(rc, ==, MMDB_OK);
+  doc.rev = rev1;
+  rc = mmdb_put(db, &rev2, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_doc_new(&doc, "LasagneAlForno", NULL, "{}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev3, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_rollback(db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_commit(db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_subscription_poll(sub, 100);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(changes.total, ==, 1);
+  munit_assert_string_equal(changes.id, "SpaghettiWithMeatballs");
+  munit_assert_memory_equal(sizeof(rev1), &rev1, &changes.rev);
+
+  // while one that's committed replaces the outer one's write
+  rc = mmdb_begin(db);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_doc_new(&doc, "SpaghettiWithMeatballs", NULL, "{\"a\":2}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  doc.rev = rev1;
+  rc = mmdb_put(db, &rev2, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_begin(db);
+  munit_assert_int(rc, ==, MMDB_OK);
+  doc.rev = rev2;
+  rc = mmdb_put(db, &rev3, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_commit(db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_commit(db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_subscription_poll(sub, 100);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(changes.total, ==, 2);
+  munit_assert_memory_equal(sizeof(rev3), &rev3, &changes.rev);
+
+  rc = mmdb_subscription_poll(sub, 0);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(changes.total, ==, 2);
+
+  mmdb_unsubscribe(db, sub);
+  mmdb_close(db);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_subscribe_busy(const MunitParameter params[],
+                                     void* p) {
+  int rc;
+  char filename[] = "/tmp/mmdb_tests_XXXXXX";
+  mmdb_t* db;
+  sqlite3* reader;
+  mmdb_doc_t doc;
+  mmdb_rev_t rev;
+  mmdb_subscription_t* sub;
+  changes_t changes;
+
+  memset(&changes, 0, sizeof(changes));
+
+  rc = mkstemp(filename);
+  munit_assert_int(rc, >=, 0);
+  close(rc);
+
+  rc = mmdb_open(filename, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_subscribe(db, &sub, NULL, changes_cb, &changes);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  // another connection reading the file keeps the commit from going through
+  rc = sqlite3_open(filename, &reader);
+  munit_assert_int(rc, ==, SQLITE_OK);
+  rc = sqlite3_exec(reader, "begin; select count(*) from docs", NULL, NULL,
+                    NULL);
+  munit_assert_int(rc, ==, SQLITE_OK);
+
+  rc = mmdb_begin(db);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_doc_new(&doc, "SpaghettiWithMeatballs", NULL, "{}");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, &rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  mmdb_doc_clear(&doc);
+  rc = mmdb_commit(db);
+  munit_assert_int(rc, ==, MMDB_ERROR);
+
+  rc = mmdb_subscription_poll(sub, 0);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(changes.total, ==, 0);
+
+  // and once it's out of the way, the retry is what subscribers hear about
+  rc = sqlite3_exec(reader, "commit", NULL, NULL, NULL);
+  munit_assert_int(rc, ==, SQLITE_OK);
+  sqlite3_close(reader);
+
+  rc = mmdb_commit(db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  rc = mmdb_subscription_poll(sub, 0);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(changes.total, ==, 1);
+  munit_assert_memory_equal(sizeof(rev), &rev, &changes.rev);
+
+  mmdb_unsubscribe(db, sub);
+  mmdb_close(db);
+  unlink(filename);
+
+  return MUNIT_OK;
+}
+
+static MunitTest mmdb_subscribe_tests[] = {
+    {"/busy", test_mmdb_subscribe_busy, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {"/commit", test_mmdb_subscribe_commit, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {"/nested", test_mmdb_subscribe_nested, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {"/rollback", test_mmdb_subscribe_rollback, NULL, NULL,
+     MUNIT_TEST_OPTION_NONE, NULL},
+    {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
+
+MunitSuite mmdb_subscribe_suite = {"/mmdb_subscribe", mmdb_subscribe_tests,
+                                   NULL, 1, MUNIT_SUITE_OPTION_NONE};
@@ -0,0 +1,159 @@
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mmdb.h"
+
+#include "munit/munit.h"
+
+typedef struct rows_s {
+  int total;
+  char out[256];
+} rows_t;
+
+// appends key=value for every group
+static int rows_cb(json_t* key, json_t* value, void* ptr) {
+  rows_t* rows = ptr;
+  char* k = json_dumps(key, JSON_ENCODE_ANY);
+  char* v = json_dumps(value, JSON_ENCODE_ANY);
+  size_t n = strlen(rows->out);
+
+  snprintf(rows->out + n, sizeof(rows->out) - n, "%s%s=%s",
+           rows->total > 0 ? " " : "", k, v);
+  rows->total++;
+
+  free(k);
+  free(v);
+
+  return MMDB_OK;
+}
+
+static const char* view_rows(mmdb_t* db, const char* name, int reduce,
+                             rows_t* rows) {
+  int rc;
+
+  memset(rows, 0, sizeof(rows_t));
+  rc = mmdb_view(db, name, reduce, rows_cb, rows);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  return rows->out;
+}
+
+static void put_doc(mmdb_t* db, mmdb_rev_t* rev, const char* id,
+                    mmdb_rev_t* parent, const char* fields) {
+  mmdb_doc_t doc;
+  int rc;
+
+  rc = mmdb_doc_new(&doc, id, NULL, fields);
+  munit_assert_int(rc, ==, MMDB_OK);
+  if (parent != NULL) {
+    doc.rev = *parent;
+  }
+  rc = mmdb_put(db, rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+  mmdb_doc_clear(&doc);
+}
+
+MunitResult test_mmdb_view_reduce(const MunitParameter params[], void* p) {
+  int rc;
+  mmdb_t* db;
+  mmdb_rev_t rev1, rev2, rev3;
+  rows_t rows;
+
+  rc = mmdb_open(NULL, &db);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  put_doc(db, &rev1, "Order1", NULL, "{\"customer\":\"ann\",\"amount\":10}");
+  put_doc(db, &rev2, "Order2", NULL, "{\"customer\":\"bob\",\"amount\":4}");
+
+  // existing documents are added when the view is made
+  rc = mmdb_create_view(db, "spend", "customer", "amount");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_create_view(db, "spend", "customer", "amount");
+  munit_assert_int(rc, ==, MMDB_CONFLICT);
+
+  put_doc(db, &rev3, "Order3", NULL, "{\"customer\":\"ann\",\"amount\":2.5}");
+  put_doc(db, &rev3, "Order4", NULL, "{\"customer\":\"cat\",\"amount\":\"?\"}");
+
+  munit_assert_string_equal(view_rows(db, "spend", MMDB_REDUCE_COUNT, &rows),
+                            "\"ann\"=2 \"bob\"=1 \"cat\"=1");
+  munit_assert_string_equal(view_rows(db, "spend", MMDB_REDUCE_SUM, &rows),
+                            "\"ann\"=12.5 \"bob\"=4 \"cat\"=0");
+  munit_assert_string_equal(view_rows(db, "spend", MMDB_REDUCE_MIN, &rows),
+                            "\"ann\"=2.5 \"bob\"=4 \"cat\"=null");
+  munit_assert_string_equal(view_rows(db, "spend", MMDB_REDUCE_MAX, &rows),
+                            "\"ann\"=10 \"bob\"=4 \"cat\"=null");
+  munit_assert_string_equal(view_rows(db, "spend", MMDB_REDUCE_AVG, &rows),
+                            "\"ann\"=6.25 \"bob\"=4.0 \"cat\"=null");
+
+  // an update moves the document's contribution, and emptied groups go away
+  put_doc(db, &rev1, "Order1", &rev1, "{\"customer\":\"bob\",\"amount\":1}");
+  put_doc(db, &rev3, "Order4", &rev3, "{\"amount\":1}");
+
+  munit_assert_string_equal(view_rows(db, "spend", MMDB_REDUCE_COUNT, &rows),
+                            "\"ann\"=1 \"bob\"=2");
+  munit_assert_string_equal(view_rows(db, "spend", MMDB_REDUCE_MAX, &rows),
+                            "\"ann\"=2.5 \"bob\"=4");
+  munit_assert_string_equal(view_rows(db, "spend", MMDB_REDUCE_MIN, &rows),
+                            "\"ann\"=2.5 \"bob\"=1");
+
+  rc = mmdb_view(db, "nope", MMDB_REDUCE_COUNT, rows_cb, &rows);
+  munit_assert_int(rc, ==, MMDB_NOT_FOUND);
+
+  mmdb_close(db);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_mmdb_view_handles(const MunitParameter params[], void* p) {
+  int rc;
+  char filename[] = "/tmp/mmdb_tests_XXXXXX";
+  mmdb_t *a, *b;
+  mmdb_rev_t rev1, rev2;
+  rows_t rows;
+
+  rc = mkstemp(filename);
+  munit_assert_int(rc, >=, 0);
+  close(rc);
+
+  rc = mmdb_open(filename, &a);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_open(filename, &b);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  put_doc(a, &rev1, "Order1", NULL, "{\"customer\":\"ann\",\"amount\":10}");
+
+  // a view made on b after a was opened is kept up to date by a's writes,
+  // including ones that take a document's old contribution away
+  rc = mmdb_create_view(b, "spend", "customer", "amount");
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_create_view(a, "spend", "customer", "amount");
+  munit_assert_int(rc, ==, MMDB_CONFLICT);
+
+  put_doc(a, &rev2, "Order1", &rev1, "{\"customer\":\"bob\",\"amount\":4}");
+  put_doc(a, &rev2, "Order2", NULL, "{\"customer\":\"bob\",\"amount\":1}");
+
+  munit_assert_string_equal(view_rows(b, "spend", MMDB_REDUCE_SUM, &rows),
+                            "\"bob\"=5");
+  munit_assert_string_equal(view_rows(a, "spend", MMDB_REDUCE_SUM, &rows),
+                            "\"bob\"=5");
+
+  mmdb_close(a);
+  mmdb_close(b);
+  unlink(filename);
+
+  return MUNIT_OK;
+}
+
+static MunitTest mmdb_view_tests[] = {
+    {"/handles", test_mmdb_view_handles, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {"/reduce", test_mmdb_view_reduce, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
+
+MunitSuite mmdb_view_suite = {"/mmdb_view", mmdb_view_tests, NULL, 1,
+                              MUNIT_SUITE_OPTION_NONE};
@@ -0,0 +1,280 @@
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "mmdb.h"
+#include "server.h"
+
+#include "munit/munit.h"
+
+// a server with one connection on one end of a socketpair, and the test
+// playing the client on the other
+typedef struct pair_s {
+  server_t server;
+  server_conn_t *conn;
+  int peer;
+} pair_t;
+
+static void pair_open(pair_t *pair, int sndbuf) {
+  int sv[2], rc;
+
+  memset(pair, 0, sizeof(*pair));
+
+  rc = mmdb_open(NULL, &pair->server.db);
+  munit_assert_int(rc, ==, MMDB_OK);
+  pair->server.epoll = epoll_create1(EPOLL_CLOEXEC);
+  munit_assert_int(pair->server.epoll, >=, 0);
+  pair->server.listen = -1;
+  pair->server.conns_cap = 4096;
+  pair->server.conns = calloc(pair->server.conns_cap, sizeof(server_conn_t *));
+  munit_assert_not_null(pair->server.conns);
+
+  rc = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv);
+  munit_assert_int(rc, ==, 0);
+  if (sndbuf > 0) {
+    rc = setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    munit_assert_int(rc, ==, 0);
+  }
+
+  pair->conn = calloc(1, sizeof(server_conn_t));
+  munit_assert_not_null(pair->conn);
+  pair->conn->server = &pair->server;
+  pair->conn->fd = sv[0];
+  pair->server.conns[sv[0]] = pair->conn;
+  pair->peer = sv[1];
+
+  rc = server_arm(pair->conn, EPOLL_CTL_ADD);
+  munit_assert_int(rc, ==, MMDB_OK);
+}
+
+static void pair_close(pair_t *pair) {
+  if (pair->conn != NULL) {
+    server_close(pair->conn);
+  }
+  close(pair->peer);
+  close(pair->server.epoll);
+  free(pair->server.conns);
+  mmdb_close(pair->server.db);
+}
+
+static size_t get_u32(const unsigned char *in) {
+  return (size_t)in[0] << 24 | (size_t)in[1] << 16 | (size_t)in[2] << 8 |
+         (size_t)in[3];
+}
+
+static size_t get_frame(unsigned char *out, const char *id) {
+  size_t len = strlen(id);
+
+  out[0] = 0;
+  out[1] = 0;
+  out[2] = (3 + len) >> 8;
+  out[3] = 3 + len;
+  out[4] = SERVER_OP_GET;
+  out[5] = len >> 8;
+  out[6] = len;
+  memcpy(out + 7, id, len);
+
+  return 7 + len;
+}
+
+// everything the server has sent so far
+static size_t drain(int fd, unsigned char *out, size_t cap) {
+  size_t total = 0;
+  ssize_t n;
+
+  while (total < cap && (n = read(fd, out + total, cap - total)) > 0) {
+    total += n;
+  }
+
+  return total;
+}
+
+// checks buf holds exactly one successful get response for doc
+static void assert_get_response(const unsigned char *buf, size_t len,
+                                const char *doc) {
+  size_t rev_len, doc_len;
+
+  munit_assert_size(len, >=, 8);
+  munit_assert_size(get_u32(buf), ==, len - 4);
+  munit_assert_int(buf[4], ==, SERVER_OP_GET);
+  munit_assert_int(buf[5], ==, MMDB_OK);
+  rev_len = (size_t)buf[6] << 8 | buf[7];
+  munit_assert_size(len, >=, 12 + rev_len);
+  doc_len = get_u32(buf + 8 + rev_len);
+  munit_assert_size(len, ==, 12 + rev_len + doc_len);
+  munit_assert_memory_equal(doc_len, buf + 12 + rev_len, doc);
+}
+
+static void put(mmdb_t *db, mmdb_rev_t *rev, const char *id,
+                const char *data) {
+  mmdb_doc_t doc;
+  int rc;
+
+  rc = mmdb_doc_new(&doc, id, NULL, data);
+  munit_assert_int(rc, ==, MMDB_OK);
+  rc = mmdb_put(db, rev, &doc, NULL);
+  munit_assert_int(rc, ==, MMDB_OK);
+}
+
+MunitResult test_server_split(const MunitParameter params[], void *p) {
+  unsigned char req[64], buf[256];
+  size_t i, len;
+  mmdb_rev_t rev;
+  pair_t pair;
+  int rc;
+
+  pair_open(&pair, 0);
+  put(pair.server.db, &rev, "SpaghettiWithMeatballs", "{\"a\":1}");
+
+  // a request trickling in a byte at a time is only answered once whole
+  len = get_frame(req, "SpaghettiWithMeatballs");
+  for (i = 0; i < len; i++) {
+    munit_assert_int(write(pair.peer, req + i, 1), ==, 1);
+    rc = server_read(pair.conn);
+    munit_assert_int(rc, ==, MMDB_OK);
+    if (i + 1 < len) {
+      munit_assert_size(drain(pair.peer, buf, sizeof(buf)), ==, 0);
+    }
+  }
+  assert_get_response(buf, drain(pair.peer, buf, sizeof(buf)), "{\"a\":1}");
+
+  // and the end of one request arriving with the start of the next
+  len = get_frame(req, "SpaghettiWithMeatballs");
+  get_frame(req + len, "SpaghettiWithMeatballs");
+  munit_assert_int(write(pair.peer, req, len + 3), ==, len + 3);
+  rc = server_read(pair.conn);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_int(write(pair.peer, req + len + 3, len - 3), ==, len - 3);
+  rc = server_read(pair.conn);
+  munit_assert_int(rc, ==, MMDB_OK);
+
+  len = drain(pair.peer, buf, sizeof(buf));
+  munit_assert_size(len % 2, ==, 0);
+  assert_get_response(buf, len / 2, "{\"a\":1}");
+  assert_get_response(buf + len / 2, len / 2, "{\"a\":1}");
+
+  pair_close(&pair);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_server_oversized(const MunitParameter params[], void *p) {
+  size_t len = SERVER_MAX_FRAME + 1;
+  unsigned char req[4];
+  pair_t pair;
+  int rc;
+
+  // the header alone is enough to turn a frame away, before any of its body
+  pair_open(&pair, 0);
+  req[0] = len >> 24;
+  req[1] = len >> 16;
+  req[2] = len >> 8;
+  req[3] = len;
+  munit_assert_int(write(pair.peer, req, 4), ==, 4);
+  rc = server_read(pair.conn);
+  munit_assert_int(rc, ==, MMDB_ERROR);
+  pair_close(&pair);
+
+  // as is an empty one, which hasn't even got an opcode
+  pair_open(&pair, 0);
+  memset(req, 0, sizeof(req));
+  munit_assert_int(write(pair.peer, req, 4), ==, 4);
+  rc = server_read(pair.conn);
+  munit_assert_int(rc, ==, MMDB_ERROR);
+  pair_close(&pair);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_server_partial(const MunitParameter params[], void *p) {
+  size_t doc_len = 256 * 1024, len, total = 0, cap = doc_len + 4096;
+  unsigned char req[64], *buf;
+  mmdb_rev_t rev;
+  pair_t pair;
+  char *doc;
+  int rc, rounds = 0;
+
+  doc = malloc(doc_len + 1);
+  buf = malloc(cap);
+  munit_assert_not_null(doc);
+  munit_assert_not_null(buf);
+  memset(doc, 'x', doc_len);
+  memcpy(doc, "{\"a\":\"", 6);
+  memcpy(doc + doc_len - 2, "\"}", 3);
+
+  pair_open(&pair, 4096);
+  put(pair.server.db, &rev, "SpaghettiWithMeatballs", doc);
+
+  // the socket takes a little of the response and the rest waits
+  len = get_frame(req, "SpaghettiWithMeatballs");
+  munit_assert_int(write(pair.peer, req, len), ==, len);
+  rc = server_read(pair.conn);
+  munit_assert_int(rc, ==, MMDB_OK);
+  munit_assert_size(pair.conn->out_len - pair.conn->out_off, >, 0);
+
+  // then goes out as the client reads, without anything lost or repeated
+  while (pair.conn->out_len > pair.conn->out_off) {
+    total += drain(pair.peer, buf + total, cap - total);
+    rc = server_flush(pair.conn);
+    munit_assert_int(rc, ==, MMDB_OK);
+    rounds++;
+  }
+  total += drain(pair.peer, buf + total, cap - total);
+  munit_assert_int(rounds, >, 1);
+  assert_get_response(buf, total, doc);
+
+  pair_close(&pair);
+  free(buf);
+  free(doc);
+
+  return MUNIT_OK;
+}
+
+MunitResult test_server_watch(const MunitParameter params[], void *p) {
+  unsigned char buf[4096];
+  size_t i, pending = 0;
+  mmdb_rev_t rev;
+  pair_t pair;
+
+  pair_open(&pair, 4096);
+  put(pair.server.db, &rev, "SpaghettiWithMeatballs", "{}");
+
+  // changes for a watcher that reads them are sent as they come
+  server_change_cb("SpaghettiWithMeatballs", &rev, pair.conn);
+  munit_assert_int(pair.conn->closing, ==, 0);
+  munit_assert_size(drain(pair.peer, buf, sizeof(buf)), >, 0);
+
+  // but one that never reads is marked for closing once it's too far behind,
+  // instead of having them piled up for it forever
+  for (i = 0; i < SERVER_MAX_PENDING && !pair.conn->closing; i++) {
+    server_change_cb("SpaghettiWithMeatballs", &rev, pair.conn);
+    munit_assert_size(pair.conn->out_len - pair.conn->out_off, >=, pending);
+    pending = pair.conn->out_len - pair.conn->out_off;
+  }
+  munit_assert_int(pair.conn->closing, ==, 1);
+  munit_assert_size(pending, <, SERVER_MAX_PENDING + sizeof(buf));
+
+  // and nothing more is queued after that
+  server_change_cb("SpaghettiWithMeatballs", &rev, pair.conn);
+  munit_assert_size(pair.conn->out_len - pair.conn->out_off, ==, pending);
+
+  pair_close(&pair);
+
+  return MUNIT_OK;
+}
+
+static MunitTest server_tests[] = {
+    {"/oversized", test_server_oversized, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {"/partial", test_server_partial, NULL, NULL, MUNIT_TEST_OPTION_NONE,
+     NULL},
+    {"/split", test_server_split, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {"/watch", test_server_watch, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
+
+MunitSuite server_suite = {"/server", server_tests, NULL, 1,
+                           MUNIT_SUITE_OPTION_NONE};
@@ -0,0 +1,354 @@
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mmdb.h"
+#include "patch.h"
+
+// longest single object key a json pointer may address
+#define PATCH_MAX_KEY_LENGTH 1024
+
+// RFC 7386 merge patch; takes ownership of target, which is changed in place
+// where possible, and returns the result
+json_t *patch_merge(json_t *target, json_t *patch) {
+  const char *key;
+  json_t *value, *merged;
+
+  if (!json_is_object(patch)) {
+    json_decref(target);
+    return json_deep_copy(patch);
+  }
+
+  if (!json_is_object(target)) {
+    json_decref(target);
+    if ((target = json_object()) == NULL) {
+      return NULL;
+    }
+  }
+
+  json_object_foreach(patch, key, value) {
+    if (json_is_null(value)) {
+      json_object_del(target, key);
+      continue;
+    }
+
+    merged = patch_merge(json_incref(json_object_get(target, key)), value);
+    if (merged == NULL || json_object_set_new(target, key, merged) != 0) {
+      json_decref(target);
+      return NULL;
+    }
+  }
+
+  return target;
+}
+
+// copies the next reference token of a json pointer into key, undoing the
+// ~0 and ~1 escapes, and returns what follows it
+const char *patch_pointer_token(const char *path, char *key, size_t len) {
+  size_t n = 0;
+
+  for (path++; *path != 0 && *path != '/'; path++) {
+    if (n + 1 >= len) {
+      return NULL;
+    }
+
+    if (*path == '~') {
+      switch (*++path) {
+        case '0':
+          key[n++] = '~';
+          break;
+        case '1':
+          key[n++] = '/';
+          break;
+        default:
+          return NULL;
+      }
+      continue;
+    }
+
+    key[n++] = *path;
+  }
+  key[n] = 0;
+
+  return path;
+}
+
+// array indexes are plain decimal, without sign or leading zeros
+int patch_pointer_index(const char *key, size_t *out) {
+  char *end = NULL;
+
+  if (key[0] < '0' || key[0] > '9' || (key[0] == '0' && key[1] != 0)) {
+    return MMDB_ERROR;
+  }
+
+  *out = strtoul(key, &end, 10);
+
+  return *end == 0 ? MMDB_OK : MMDB_ERROR;
+}
+
+// finds the container holding the last token of path, which goes in key
+int patch_pointer_parent(json_t *doc, const char *path, json_t **parent,
+                         char *key, size_t len) {
+  size_t index;
+
+  if (path[0] != '/') {
+    return MMDB_ERROR;
+  }
+
+  while (1) {
+    if ((path = patch_pointer_token(path, key, len)) == NULL) {
+      return MMDB_ERROR;
+    }
+
+    if (*path == 0) {
+      *parent = doc;
+      return MMDB_OK;
+    }
+
+    if (json_is_object(doc)) {
+      doc = json_object_get(doc, key);
+    } else if (json_is_array(doc) && patch_pointer_index(key, &index) ==
+                                         MMDB_OK) {
+      doc = json_array_get(doc, index);
+    } else {
+      return MMDB_ERROR;
+    }
+
+    if (doc == NULL) {
+      return MMDB_ERROR;
+    }
+  }
+}
+
+json_t *patch_pointer_get(json_t *doc, const char *path) {
+  char key[PATCH_MAX_KEY_LENGTH];
+  json_t *parent = NULL;
+  size_t index;
+
+  if (path[0] == 0) {
+    return doc;
+  }
+
+  if (patch_pointer_parent(doc, path, &parent, key, sizeof(key)) != MMDB_OK) {
+    return NULL;
+  }
+
+  if (json_is_object(parent)) {
+    return json_object_get(parent, key);
+  }
+
+  if (json_is_array(parent) && patch_pointer_index(key, &index) == MMDB_OK) {
+    return json_array_get(parent, index);
+  }
+
+  return NULL;
+}
+
+// takes ownership of value
+int patch_add(json_t **doc, const char *path, json_t *value) {
+  char key[PATCH_MAX_KEY_LENGTH];
+  json_t *parent = NULL;
+  size_t index;
+  int rc = -1;
+
+  if (path[0] == 0) {
+    json_decref(*doc);
+    *doc = value;
+    return MMDB_OK;
+  }
+
+  if (patch_pointer_parent(*doc, path, &parent, key, sizeof(key)) == MMDB_OK) {
+    if (json_is_object(parent)) {
+      rc = json_object_set_new(parent, key, value);
+      value = NULL;
+    } else if (json_is_array(parent) && strcmp(key, "-") == 0) {
+      rc = json_array_append_new(parent, value);
+      value = NULL;
+    } else if (json_is_array(parent) &&
+               patch_pointer_index(key, &index) == MMDB_OK &&
+               index <= json_array_size(parent)) {
+      rc = json_array_insert_new(parent, index, value);
+      value = NULL;
+    }
+  }
+
+  json_decref(value);
+
+  return rc == 0 ? MMDB_OK : MMDB_ERROR;
+}
+
+int patch_remove(json_t **doc, const char *path) {
+  char key[PATCH_MAX_KEY_LENGTH];
+  json_t *parent = NULL;
+  size_t index;
+
+  if (path[0] == 0 ||
+      patch_pointer_parent(*doc, path, &parent, key, sizeof(key)) !=
+          MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (json_is_object(parent)) {
+    return json_object_del(parent, key) == 0 ? MMDB_OK : MMDB_ERROR;
+  }
+
+  if (json_is_array(parent) && patch_pointer_index(key, &index) == MMDB_OK) {
+    return json_array_remove(parent, index) == 0 ? MMDB_OK : MMDB_ERROR;
+  }
+
+  return MMDB_ERROR;
+}
+
+int patch_op(json_t **doc, json_t *op) {
+  const char *name = NULL, *path = NULL, *from = NULL;
+  json_t *value = NULL, *found = NULL;
+  size_t len;
+
+  name = json_string_value(json_object_get(op, "op"));
+  path = json_string_value(json_object_get(op, "path"));
+  from = json_string_value(json_object_get(op, "from"));
+  value = json_object_get(op, "value");
+
+  if (name == NULL || path == NULL) {
+    return MMDB_ERROR;
+  }
+
+  if (strcmp(name, "add") == 0) {
+    return value == NULL ? MMDB_ERROR
+                         : patch_add(doc, path, json_deep_copy(value));
+  }
+
+  if (strcmp(name, "remove") == 0) {
+    return patch_remove(doc, path);
+  }
+
+  if (strcmp(name, "replace") == 0) {
+    if (value == NULL || patch_pointer_get(*doc, path) == NULL) {
+      return MMDB_ERROR;
+    }
+    if (path[0] != 0 && patch_remove(doc, path) != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+    return patch_add(doc, path, json_deep_copy(value));
+  }
+
+  // a failed test leaves the document alone, like a stale revision would
+  if (strcmp(name, "test") == 0) {
+    if (value == NULL) {
+      return MMDB_ERROR;
+    }
+    found = patch_pointer_get(*doc, path);
+    return found != NULL && json_equal(found, value) ? MMDB_OK
+                                                     : MMDB_CONFLICT;
+  }
+
+  if (from == NULL || (found = patch_pointer_get(*doc, from)) == NULL) {
+    return MMDB_ERROR;
+  }
+
+  if (strcmp(name, "copy") == 0) {
+    return patch_add(doc, path, json_deep_copy(found));
+  }
+
+  if (strcmp(name, "move") == 0) {
+    // a value can't be moved into one of its own children
+    len = strlen(from);
+    if (strncmp(path, from, len) == 0 && path[len] == '/') {
+      return MMDB_ERROR;
+    }
+    if (strcmp(path, from) == 0) {
+      return MMDB_OK;
+    }
+    json_incref(found);
+    if (patch_remove(doc, from) != MMDB_OK) {
+      json_decref(found);
+      return MMDB_ERROR;
+    }
+    return patch_add(doc, path, found);
+  }
+
+  return MMDB_ERROR;
+}
+
+// RFC 6902 operations, applied in order; on failure *doc may be partially
+// changed, so callers work on a copy they can throw away
+int patch_apply(json_t **doc, json_t *ops) {
+  size_t i;
+  json_t *op;
+  int rc;
+
+  if (!json_is_array(ops)) {
+    return MMDB_ERROR;
+  }
+
+  json_array_foreach(ops, i, op) {
+    if ((rc = patch_op(doc, op)) != MMDB_OK) {
+      return rc;
+    }
+  }
+
+  return MMDB_OK;
+}
+
+// whether an object has a null member anywhere outside of arrays, which a
+// merge patch can't express
+int patch_has_null(json_t *v) {
+  const char *key;
+  json_t *value;
+
+  json_object_foreach(v, key, value) {
+    if (json_is_null(value) || (json_is_object(value) &&
+                                patch_has_null(value))) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// the merge patch that turns from into to, or NULL if there isn't one; arrays
+// are only ever replaced whole
+json_t *patch_diff(json_t *from, json_t *to) {
+  const char *key;
+  json_t *value, *old, *sub, *r;
+
+  if (json_is_null(to)) {
+    return NULL;
+  }
+
+  if (!json_is_object(to)) {
+    return json_deep_copy(to);
+  }
+
+  if (!json_is_object(from)) {
+    return patch_has_null(to) ? NULL : json_deep_copy(to);
+  }
+
+  if ((r = json_object()) == NULL) {
+    return NULL;
+  }
+
+  json_object_foreach(from, key, value) {
+    if (json_object_get(to, key) == NULL &&
+        json_object_set_new(r, key, json_null()) != 0) {
+      json_decref(r);
+      return NULL;
+    }
+  }
+
+  json_object_foreach(to, key, value) {
+    old = json_object_get(from, key);
+    if (old != NULL && json_equal(old, value)) {
+      continue;
+    }
+
+    if ((sub = patch_diff(old, value)) == NULL ||
+        json_object_set_new(r, key, sub) != 0) {
+      json_decref(r);
+      return NULL;
+    }
+  }
+
+  return r;
+}
@@ -0,0 +1,3 @@
+json_t *patch_merge(json_t *target, json_t *patch);
+int patch_apply(json_t **doc, json_t *ops);
+json_t *patch_diff(json_t *from, json_t *to);
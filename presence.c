@@ -0,0 +1,238 @@
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mmdb.h"
+#include "presence.h"
+#include "q.h"
+
+// a bloom filter over every document id this handle has seen, so lookups of
+// ids that don't exist (most puts, and gets that miss) never reach sqlite.
+// ids that expire, or are added by a transaction that rolls back, only cost
+// false positives, so the filter only ever has to grow; it's rebuilt twice
+// the size whenever it fills up
+
+#define PRESENCE_MIN_CAPACITY 1024
+#define PRESENCE_MAX_HASHES 16
+
+typedef struct mmdb_presence_s {
+  uint64_t *bits;
+  uint64_t nbits;
+  uint64_t set;
+  int hashes;
+  int bits_per_id;
+  sqlite3_int64 ids;
+  sqlite3_int64 capacity;
+  sqlite3_int64 lookups;
+  sqlite3_int64 skipped;
+  sqlite3_int64 false_positives;
+} mmdb_presence_t;
+
+const char query_presence_count[] = "select count(*) from docs";
+
+const char query_presence_ids[] = "select id from docs";
+
+// fnv-1a with a final mix, split into the two halves used for double hashing
+void presence_hash(const char *id, size_t len, uint64_t *h1, uint64_t *h2) {
+  uint64_t h = 14695981039346656037ull;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)id[i]) * 1099511628211ull;
+  }
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+
+  *h1 = h & 0xffffffffull;
+  *h2 = (h >> 32) | 1;
+}
+
+void presence_set(mmdb_presence_t *filter, const char *id, size_t len) {
+  uint64_t h1, h2, bit;
+  int i;
+
+  presence_hash(id, len, &h1, &h2);
+
+  for (i = 0; i < filter->hashes; i++) {
+    bit = (h1 + i * h2) % filter->nbits;
+    if ((filter->bits[bit / 64] & (1ull << (bit % 64))) == 0) {
+      filter->bits[bit / 64] |= 1ull << (bit % 64);
+      filter->set++;
+    }
+  }
+
+  filter->ids++;
+}
+
+int presence_count_cb(sqlite3_stmt *stmt, void *ptr) {
+  sqlite3_int64 *count = ptr;
+
+  if (stmt == NULL) {
+    *count = 0;
+    return MMDB_OK;
+  }
+
+  return q_scan(stmt, "l", count);
+}
+
+int presence_ids_cb(sqlite3_stmt *stmt, void *ptr) {
+  presence_set(ptr, (const char *)sqlite3_column_text(stmt, 0),
+               sqlite3_column_bytes(stmt, 0));
+
+  return MMDB_OK;
+}
+
+// fills a new filter sized for capacity ids from the docs table, replacing
+// the old one only if that works
+int presence_build(mmdb_t *db, int bits_per_id, sqlite3_int64 capacity) {
+  mmdb_presence_t *filter = NULL;
+
+  if ((filter = calloc(1, sizeof(mmdb_presence_t))) == NULL) {
+    return MMDB_ERROR;
+  }
+
+  filter->bits_per_id = bits_per_id;
+  filter->capacity = capacity;
+  filter->nbits = ((uint64_t)capacity * bits_per_id + 63) / 64 * 64;
+  // bits per id times ln 2 is the count that minimises false positives
+  filter->hashes = (bits_per_id * 693 + 500) / 1000;
+  if (filter->hashes < 1) filter->hashes = 1;
+  if (filter->hashes > PRESENCE_MAX_HASHES) {
+    filter->hashes = PRESENCE_MAX_HASHES;
+  }
+
+  if ((filter->bits = calloc(filter->nbits / 64, sizeof(uint64_t))) == NULL) {
+    free(filter);
+    return MMDB_ERROR;
+  }
+
+  if (q_exec2(db->db, query_presence_ids, filter, presence_ids_cb, "") !=
+      MMDB_OK) {
+    free(filter->bits);
+    free(filter);
+    return MMDB_ERROR;
+  }
+
+  if (db->presence != NULL) {
+    filter->lookups = db->presence->lookups;
+    filter->skipped = db->presence->skipped;
+    filter->false_positives = db->presence->false_positives;
+  }
+
+  presence_free(db);
+  db->presence = filter;
+
+  return MMDB_OK;
+}
+
+// builds the filter from the ids already stored, leaving room for as many
+// again; a handle opened without one (bits_per_id of zero) checks nothing
+int presence_load(mmdb_t *db, int bits_per_id) {
+  sqlite3_int64 count = 0;
+
+  presence_free(db);
+
+  if (bits_per_id <= 0) {
+    return MMDB_OK;
+  }
+
+  if (q_exec1(db->db, query_presence_count, &count, presence_count_cb, "") !=
+      MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  return presence_build(db, bits_per_id,
+                        count * 2 > PRESENCE_MIN_CAPACITY
+                            ? count * 2
+                            : PRESENCE_MIN_CAPACITY);
+}
+
+void presence_free(mmdb_t *db) {
+  if (db->presence == NULL) return;
+
+  free(db->presence->bits);
+  free(db->presence);
+  db->presence = NULL;
+}
+
+// called once the id's docs row has been written, so a rebuild picks it up
+int presence_add(mmdb_t *db, const char *id) {
+  if (db->presence == NULL) {
+    return MMDB_OK;
+  }
+
+  if (db->presence->ids >= db->presence->capacity) {
+    return presence_build(db, db->presence->bits_per_id,
+                          db->presence->capacity * 2);
+  }
+
+  presence_set(db->presence, id, strlen(id));
+
+  return MMDB_OK;
+}
+
+// zero if the id definitely doesn't exist, otherwise it might
+int presence_check(mmdb_t *db, const char *id) {
+  uint64_t h1, h2, bit;
+  int i;
+
+  if (db->presence == NULL) {
+    return 1;
+  }
+
+  db->presence->lookups++;
+
+  presence_hash(id, strlen(id), &h1, &h2);
+
+  for (i = 0; i < db->presence->hashes; i++) {
+    bit = (h1 + i * h2) % db->presence->nbits;
+    if ((db->presence->bits[bit / 64] & (1ull << (bit % 64))) == 0) {
+      db->presence->skipped++;
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// records that an id the filter let through turned out not to exist
+void presence_miss(mmdb_t *db) {
+  if (db->presence != NULL) {
+    db->presence->false_positives++;
+  }
+}
+
+int presence_bits_per_id(mmdb_t *db) {
+  return db->presence != NULL ? db->presence->bits_per_id : 0;
+}
+
+// adds this handle's numbers to out; the expected false positive rate is the
+// chance that every probed bit is already set
+void presence_stats(mmdb_t *db, mmdb_stats_t *out) {
+  double fill, rate = 1;
+  int i;
+
+  if (db->presence == NULL) {
+    return;
+  }
+
+  fill = (double)db->presence->set / db->presence->nbits;
+  for (i = 0; i < db->presence->hashes; i++) {
+    rate *= fill;
+  }
+
+  out->filter_bytes += db->presence->nbits / 8 + sizeof(mmdb_presence_t);
+  out->filter_ids += db->presence->ids;
+  out->filter_capacity += db->presence->capacity;
+  out->filter_hashes = db->presence->hashes;
+  out->filter_fp_rate = rate > out->filter_fp_rate ? rate : out->filter_fp_rate;
+  out->filter_lookups += db->presence->lookups;
+  out->filter_skipped += db->presence->skipped;
+  out->filter_false_positives += db->presence->false_positives;
+}
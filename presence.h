@@ -0,0 +1,7 @@
+int presence_load(mmdb_t *db, int bits_per_id);
+void presence_free(mmdb_t *db);
+int presence_add(mmdb_t *db, const char *id);
+int presence_check(mmdb_t *db, const char *id);
+void presence_miss(mmdb_t *db);
+int presence_bits_per_id(mmdb_t *db);
+void presence_stats(mmdb_t *db, mmdb_stats_t *out);
@@ -139,8 +139,11 @@ int q_bind(sqlite3_stmt *stmt, const char *fmt, ...) {
 }
 
 int q_bind_va(sqlite3_stmt *stmt, const char *fmt, va_list ap) {
-  int i = 0;
+  int i = 0, in_i = 0;
+  sqlite3_int64 in_l = 0;
   const char *in_s = NULL;
+  const void *in_b = NULL;
+  size_t in_len = 0;
 
   while (*fmt) {
     i++;
@@ -153,6 +156,28 @@ int q_bind_va(sqlite3_stmt *stmt, const char *fmt, va_list ap) {
           return MMDB_ERROR;
         }
         break;
+      case 'b':
+        in_b = va_arg(ap, const void *);
+        in_len = va_arg(ap, size_t);
+        DEBUG_SQL("q_bind: %d blob=(%ld bytes)\n", i, in_len);
+        if (sqlite3_bind_blob(stmt, i, in_b, in_len, NULL) != SQLITE_OK) {
+          return MMDB_ERROR;
+        }
+        break;
+      case 'i':
+        in_i = va_arg(ap, int);
+        DEBUG_SQL("q_bind: %d int=%d\n", i, in_i);
+        if (sqlite3_bind_int(stmt, i, in_i) != SQLITE_OK) {
+          return MMDB_ERROR;
+        }
+        break;
+      case 'l':
+        in_l = va_arg(ap, sqlite3_int64);
+        DEBUG_SQL("q_bind: %d int64=%lld\n", i, in_l);
+        if (sqlite3_bind_int64(stmt, i, in_l) != SQLITE_OK) {
+          return MMDB_ERROR;
+        }
+        break;
       default:
         return MMDB_ERROR;
     }
@@ -173,6 +198,9 @@ int q_scan(sqlite3_stmt *stmt, const char *fmt, ...) {
 int q_scan_va(sqlite3_stmt *stmt, const char *fmt, va_list ap) {
   int i = 0, len = 0;
   char *out_s = NULL;
+  void *out_b = NULL;
+  int *out_i = NULL;
+  sqlite3_int64 *out_l = NULL;
   size_t out_len = 0;
   const char *ptr = NULL;
 
@@ -194,6 +222,31 @@ int q_scan_va(sqlite3_stmt *stmt, const char *fmt, va_list ap) {
         strncpy(out_s, ptr, len);
         out_s[len] = 0;
 
+        break;
+      case 'b':
+        out_b = va_arg(ap, void *);
+        out_len = va_arg(ap, size_t);
+
+        ptr = sqlite3_column_blob(stmt, i);
+        len = sqlite3_column_bytes(stmt, i);
+
+        if (len > out_len) {
+          return MMDB_ERROR;
+        }
+
+        memset(out_b, 0, out_len);
+        if (len > 0) {
+          memcpy(out_b, ptr, len);
+        }
+
+        break;
+      case 'i':
+        out_i = va_arg(ap, int *);
+        *out_i = sqlite3_column_int(stmt, i);
+        break;
+      case 'l':
+        out_l = va_arg(ap, sqlite3_int64 *);
+        *out_l = sqlite3_column_int64(stmt, i);
         break;
       default:
         return MMDB_ERROR;
@@ -0,0 +1,304 @@
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "find.h"
+#include "mmdb.h"
+#include "q.h"
+#include "search.h"
+
+// each search index is an fts5 table named search_<name>, with one column
+// per field and the document's integer id as its rowid; it holds the text of
+// the winning revision of every live document
+
+typedef struct search_index_s {
+  char name[MMDB_MAX_NAME_LENGTH + 1];
+  // fills the table from winning revisions, all of them or (with " and
+  // d.docid = $1" on the end) just one
+  char *fill;
+  char *fill_one;
+  char *remove;
+  char *query;
+} search_index_t;
+
+typedef struct mmdb_search_s {
+  search_index_t *indexes;
+  int total;
+  // every index registered bumps search_generation in meta, so another
+  // handle's new index is noticed by comparing it, which is only worth doing
+  // once the file has changed under this handle
+  sqlite3_int64 generation;
+  sqlite3_int64 data_version;
+} mmdb_search_t;
+
+const char query_search_list[] = "select name, fields from search_indexes";
+
+const char query_search_register[] =
+    "insert into search_indexes (name, fields) values ($1, $2)";
+
+const char query_search_bump[] =
+    "insert into meta (key, value) values ('search_generation', 1) on "
+    "conflict (key) do update set value = value + 1";
+
+const char query_search_generation[] =
+    "select coalesce((select cast(value as integer) from meta where key = "
+    "'search_generation'), 0)";
+
+const char query_search_fill[] =
+    "insert into search_%s (rowid%s) select d.docid%s from docs d join revs r "
+    "on r.docid = d.docid and r.rev = d.rev join bodies b on b.hash = r.body "
+    "where r.deleted = 0";
+
+const char query_search_remove[] = "delete from search_%s where rowid = $1";
+
+const char query_search_match[] =
+    "select d.id, d.rev, search_%s.rank from search_%s join docs d on "
+    "d.docid = search_%s.rowid where search_%s match $1 order by "
+    "search_%s.rank limit $2";
+
+void search_index_free(search_index_t *index) {
+  sqlite3_free(index->fill);
+  sqlite3_free(index->fill_one);
+  sqlite3_free(index->remove);
+  sqlite3_free(index->query);
+}
+
+// builds the statements for an index over fields, a list of json paths
+int search_index_init(search_index_t *index, const char *name,
+                      json_t *fields) {
+  char path[FIND_MAX_PATH_LENGTH];
+  char *cols = NULL, *exprs = NULL;
+  size_t i;
+  json_t *v;
+
+  memset(index, 0, sizeof(search_index_t));
+
+  if (find_name(name) != MMDB_OK || !json_is_array(fields) ||
+      json_array_size(fields) == 0) {
+    return MMDB_ERROR;
+  }
+  strcpy(index->name, name);
+
+  json_array_foreach(fields, i, v) {
+    if (!json_is_string(v) ||
+        find_path(path, sizeof(path), json_string_value(v)) != MMDB_OK) {
+      sqlite3_free(cols);
+      sqlite3_free(exprs);
+      return MMDB_ERROR;
+    }
+
+    cols = sqlite3_mprintf("%z, f%d", cols, (int)i);
+    exprs = sqlite3_mprintf("%z, json_extract(b.doc, %s)", exprs, path);
+    if (cols == NULL || exprs == NULL) {
+      sqlite3_free(cols);
+      sqlite3_free(exprs);
+      return MMDB_ERROR;
+    }
+  }
+
+  index->fill = sqlite3_mprintf(query_search_fill, name, cols, exprs);
+  index->fill_one = sqlite3_mprintf("%s and d.docid = $1", index->fill);
+  index->remove = sqlite3_mprintf(query_search_remove, name);
+  index->query =
+      sqlite3_mprintf(query_search_match, name, name, name, name, name);
+
+  sqlite3_free(cols);
+  sqlite3_free(exprs);
+
+  if (index->fill == NULL || index->fill_one == NULL ||
+      index->remove == NULL || index->query == NULL) {
+    search_index_free(index);
+    return MMDB_ERROR;
+  }
+
+  return MMDB_OK;
+}
+
+int search_load_cb(sqlite3_stmt *stmt, void *ptr) {
+  mmdb_search_t *search = ptr;
+  search_index_t *indexes = NULL;
+  json_t *fields = NULL;
+  int rc;
+
+  if ((fields = json_loadb((const char *)sqlite3_column_text(stmt, 1),
+                           sqlite3_column_bytes(stmt, 1), 0, NULL)) == NULL) {
+    return MMDB_ERROR;
+  }
+
+  if ((indexes = realloc(search->indexes, sizeof(search_index_t) *
+                                              (search->total + 1))) == NULL) {
+    json_decref(fields);
+    return MMDB_ERROR;
+  }
+  search->indexes = indexes;
+
+  rc = search_index_init(&search->indexes[search->total],
+                         (const char *)sqlite3_column_text(stmt, 0), fields);
+  json_decref(fields);
+  if (rc != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+  search->total++;
+
+  return MMDB_OK;
+}
+
+int search_generation_cb(sqlite3_stmt *stmt, void *ptr) {
+  return q_scan(stmt, "l", ptr);
+}
+
+// reads the index definitions, replacing any already loaded
+int search_load(mmdb_t *db) {
+  search_free(db);
+
+  if ((db->search = calloc(1, sizeof(mmdb_search_t))) == NULL) {
+    return MMDB_ERROR;
+  }
+
+  if (mmdb_data_version(db, &db->search->data_version) != MMDB_OK ||
+      q_exec1(db->db, query_search_generation, &db->search->generation,
+              search_generation_cb, "") != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  return q_exec2(db->db, query_search_list, db->search, search_load_cb, "");
+}
+
+// reloads the definitions if another handle has registered an index since
+// they were read
+int search_refresh(mmdb_t *db) {
+  sqlite3_int64 version, generation;
+
+  if (mmdb_data_version(db, &version) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (version == db->search->data_version) {
+    return MMDB_OK;
+  }
+
+  if (q_exec1(db->db, query_search_generation, &generation,
+              search_generation_cb, "") != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (generation != db->search->generation) {
+    return search_load(db);
+  }
+
+  db->search->data_version = version;
+
+  return MMDB_OK;
+}
+
+void search_free(mmdb_t *db) {
+  int i;
+
+  if (db->search == NULL) return;
+
+  for (i = 0; i < db->search->total; i++) {
+    search_index_free(&db->search->indexes[i]);
+  }
+  free(db->search->indexes);
+  free(db->search);
+  db->search = NULL;
+}
+
+// creates, registers and fills a new index; the caller owns the transaction
+// and reloads the definitions once it commits
+int search_create(mmdb_t *db, const char *name, json_t *fields) {
+  search_index_t index;
+  char *sql = NULL, *str = NULL;
+  size_t i;
+  int failed = 0;
+
+  if (search_refresh(db) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (search_query(db, name) != NULL) {
+    return MMDB_CONFLICT;
+  }
+
+  if (search_index_init(&index, name, fields) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  sql = sqlite3_mprintf("create virtual table search_%s using fts5(", name);
+  for (i = 0; sql != NULL && i < json_array_size(fields); i++) {
+    sql = sqlite3_mprintf("%z%sf%d", sql, i > 0 ? ", " : "", (int)i);
+  }
+  sql = sqlite3_mprintf("%z)", sql);
+
+  if ((str = json_dumps(fields, JSON_COMPACT)) == NULL || sql == NULL ||
+      sqlite3_exec(db->db, sql, NULL, NULL, NULL) != SQLITE_OK ||
+      q_exec0(db->db, query_search_register, "ss", name, str) != MMDB_OK ||
+      q_exec0(db->db, query_search_bump, "") != MMDB_OK ||
+      q_exec0(db->db, index.fill, "") != MMDB_OK) {
+    failed = 1;
+  }
+
+  free(str);
+  sqlite3_free(sql);
+  search_index_free(&index);
+
+  return failed ? MMDB_ERROR : MMDB_OK;
+}
+
+// brings every index up to date with the document's winning revision, inside
+// the transaction that changed it
+int search_update(mmdb_t *db, sqlite3_int64 docid) {
+  int i;
+
+  if (search_refresh(db) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  for (i = 0; i < db->search->total; i++) {
+    if (q_exec0(db->db, db->search->indexes[i].remove, "l", docid) !=
+            MMDB_OK ||
+        q_exec0(db->db, db->search->indexes[i].fill_one, "l", docid) !=
+            MMDB_OK) {
+      return MMDB_ERROR;
+    }
+  }
+
+  return MMDB_OK;
+}
+
+// fills every index from scratch, for a bulk load into an empty database that
+// skipped search_update for each document
+int search_fill(mmdb_t *db) {
+  int i;
+
+  if (search_refresh(db) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  for (i = 0; i < db->search->total; i++) {
+    if (q_exec0(db->db, db->search->indexes[i].fill, "") != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+  }
+
+  return MMDB_OK;
+}
+
+// the query that matches against an index, or NULL if there's no such index;
+// it returns id, rev and rank, best first
+const char *search_query(mmdb_t *db, const char *name) {
+  int i;
+
+  if (search_refresh(db) != MMDB_OK) {
+    return NULL;
+  }
+
+  for (i = 0; i < db->search->total; i++) {
+    if (strcmp(db->search->indexes[i].name, name) == 0) {
+      return db->search->indexes[i].query;
+    }
+  }
+
+  return NULL;
+}
@@ -0,0 +1,6 @@
+int search_load(mmdb_t *db);
+void search_free(mmdb_t *db);
+int search_create(mmdb_t *db, const char *name, json_t *fields);
+int search_update(mmdb_t *db, sqlite3_int64 docid);
+int search_fill(mmdb_t *db);
+const char *search_query(mmdb_t *db, const char *name);
@@ -0,0 +1,688 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <jansson.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <yder.h>
+
+#include "mmdb.h"
+#include "server.h"
+
+// frames in both directions are a 4 byte big-endian length followed by that
+// many bytes: an opcode, then (responses only) a status, which is one of the
+// MMDB_* codes, then the body. strings in a body are a 2 byte length and the
+// bytes, documents a 4 byte length and the bytes, counts 2 bytes
+//
+//   get       id            -> rev doc
+//   put       id rev doc    -> rev             (rev is empty for a new doc)
+//   revs      id            -> count rev...
+//   get_many  count id...   -> count (status rev doc)...
+//   watch     prefix        -> nothing, then a change frame holding id and
+//                              rev for every committed write under prefix
+//
+// responses come back in request order, with change frames in between. the
+// opcodes and limits are in server.h
+// expired documents removed per sweep; sweeps run once a second, or
+// back to back while there's a backlog
+#define SERVER_EXPIRE_BUDGET 128
+
+#define SERVER_MAX_MANY 64
+#define SERVER_READ_SIZE 65536
+
+typedef struct server_buf_s {
+  const unsigned char *p;
+  size_t left;
+} server_buf_t;
+
+volatile sig_atomic_t server_stopped = 0;
+
+void server_stop(int sig) { server_stopped = 1; }
+
+void server_put_u16(unsigned char *out, size_t v) {
+  out[0] = v >> 8;
+  out[1] = v;
+}
+
+void server_put_u32(unsigned char *out, size_t v) {
+  out[0] = v >> 24;
+  out[1] = v >> 16;
+  out[2] = v >> 8;
+  out[3] = v;
+}
+
+size_t server_get_u32(const unsigned char *in) {
+  return (size_t)in[0] << 24 | (size_t)in[1] << 16 | (size_t)in[2] << 8 |
+         (size_t)in[3];
+}
+
+int server_take(server_buf_t *b, size_t width, const char **out,
+                size_t *len) {
+  if (b->left < width) {
+    return MMDB_ERROR;
+  }
+
+  *len = width == 2 ? (size_t)b->p[0] << 8 | b->p[1] : server_get_u32(b->p);
+  b->p += width;
+  b->left -= width;
+
+  if (b->left < *len) {
+    return MMDB_ERROR;
+  }
+
+  *out = (const char *)b->p;
+  b->p += *len;
+  b->left -= *len;
+
+  return MMDB_OK;
+}
+
+// ids arrive without a terminator, so they're the one thing that gets copied
+int server_take_id(server_buf_t *b, char *out, size_t max) {
+  const char *str = NULL;
+  size_t len;
+
+  if (server_take(b, 2, &str, &len) != MMDB_OK || len > max) {
+    return MMDB_ERROR;
+  }
+  memcpy(out, str, len);
+  out[len] = 0;
+
+  return MMDB_OK;
+}
+
+int server_arm(server_conn_t *conn, int op) {
+  struct epoll_event ev;
+  size_t pending = conn->out_len - conn->out_off;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = (pending < SERVER_MAX_PENDING ? EPOLLIN : 0) |
+              (pending > 0 ? EPOLLOUT : 0);
+  ev.data.fd = conn->fd;
+
+  return epoll_ctl(conn->server->epoll, op, conn->fd, &ev) == 0 ? MMDB_OK
+                                                                : MMDB_ERROR;
+}
+
+int server_queue(server_conn_t *conn, const void *buf, size_t n) {
+  unsigned char *out = NULL;
+  size_t cap;
+
+  if (conn->out_off > 0 && conn->out_len + n > conn->out_cap) {
+    memmove(conn->out, conn->out + conn->out_off,
+            conn->out_len - conn->out_off);
+    conn->out_len -= conn->out_off;
+    conn->out_off = 0;
+  }
+
+  if (conn->out_len + n > conn->out_cap) {
+    for (cap = conn->out_cap > 0 ? conn->out_cap : 4096;
+         cap < conn->out_len + n; cap *= 2)
+      ;
+    if ((out = realloc(conn->out, cap)) == NULL) {
+      return MMDB_ERROR;
+    }
+    conn->out = out;
+    conn->out_cap = cap;
+  }
+
+  memcpy(conn->out + conn->out_len, buf, n);
+  conn->out_len += n;
+
+  return MMDB_OK;
+}
+
+// gathers a response straight from where its pieces already are; only what
+// the socket doesn't take right away is copied, to be sent once it drains
+int server_send(server_conn_t *conn, struct iovec *iov, int n) {
+  struct msghdr msg;
+  ssize_t sent = 0;
+  int i, was_pending = conn->out_len > conn->out_off;
+
+  if (!was_pending) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+
+    if ((sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL)) < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        return MMDB_ERROR;
+      }
+      sent = 0;
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    if ((size_t)sent >= iov[i].iov_len) {
+      sent -= iov[i].iov_len;
+      continue;
+    }
+
+    if (server_queue(conn, (char *)iov[i].iov_base + sent,
+                     iov[i].iov_len - sent) != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+    sent = 0;
+  }
+
+  if (!was_pending && conn->out_len > conn->out_off) {
+    return server_arm(conn, EPOLL_CTL_MOD);
+  }
+
+  return MMDB_OK;
+}
+
+int server_flush(server_conn_t *conn) {
+  ssize_t n;
+
+  while (conn->out_off < conn->out_len) {
+    n = send(conn->fd, conn->out + conn->out_off,
+             conn->out_len - conn->out_off, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return server_arm(conn, EPOLL_CTL_MOD);
+    }
+    if (n < 0) {
+      return MMDB_ERROR;
+    }
+    conn->out_off += n;
+  }
+
+  conn->out_off = 0;
+  conn->out_len = 0;
+
+  return server_arm(conn, EPOLL_CTL_MOD);
+}
+
+// sends the header, then the body as it is, which is empty for errors
+int server_respond(server_conn_t *conn, int op, int status,
+                   struct iovec *body, int n) {
+  struct iovec iov[1 + 4 * SERVER_MAX_MANY + 1];
+  unsigned char head[6];
+  size_t len = 2;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    len += body[i].iov_len;
+    iov[i + 1] = body[i];
+  }
+
+  server_put_u32(head, len);
+  head[4] = op;
+  head[5] = status;
+  iov[0].iov_base = head;
+  iov[0].iov_len = sizeof(head);
+
+  return server_send(conn, iov, n + 1);
+}
+
+int server_get(server_conn_t *conn, server_buf_t *b) {
+  char id[MMDB_MAX_ID_LENGTH + 1];
+  unsigned char rev_len[2], doc_len[4];
+  struct iovec iov[4];
+  mmdb_raw_t raw;
+  int rc;
+
+  memset(&raw, 0, sizeof(raw));
+
+  if (server_take_id(b, id, MMDB_MAX_ID_LENGTH) != MMDB_OK) {
+    return server_respond(conn, SERVER_OP_GET, MMDB_ERROR, NULL, 0);
+  }
+
+  if ((rc = mmdb_get_raw(conn->server->db, &raw, id)) != MMDB_OK) {
+    return server_respond(conn, SERVER_OP_GET, rc, NULL, 0);
+  }
+
+  server_put_u16(rev_len, raw.rev_len);
+  server_put_u32(doc_len, raw.doc_len);
+  iov[0] = (struct iovec){rev_len, sizeof(rev_len)};
+  iov[1] = (struct iovec){(void *)raw.rev, raw.rev_len};
+  iov[2] = (struct iovec){doc_len, sizeof(doc_len)};
+  iov[3] = (struct iovec){(void *)raw.doc, raw.doc_len};
+
+  rc = server_respond(conn, SERVER_OP_GET, MMDB_OK, iov, 4);
+
+  mmdb_raw_release(&raw);
+
+  return rc;
+}
+
+int server_get_many(server_conn_t *conn, server_buf_t *b) {
+  char id[MMDB_MAX_ID_LENGTH + 1];
+  unsigned char count[2], heads[SERVER_MAX_MANY][3],
+      doc_lens[SERVER_MAX_MANY][4];
+  struct iovec iov[1 + 4 * SERVER_MAX_MANY];
+  mmdb_raw_t raws[SERVER_MAX_MANY];
+  size_t i, n;
+  int rc;
+
+  if (b->left < 2 || (n = (size_t)b->p[0] << 8 | b->p[1]) > SERVER_MAX_MANY) {
+    return server_respond(conn, SERVER_OP_GET_MANY, MMDB_ERROR, NULL, 0);
+  }
+  b->p += 2;
+  b->left -= 2;
+
+  memset(raws, 0, sizeof(raws));
+  server_put_u16(count, n);
+  iov[0] = (struct iovec){count, sizeof(count)};
+
+  for (i = 0; i < n; i++) {
+    if (server_take_id(b, id, MMDB_MAX_ID_LENGTH) != MMDB_OK) {
+      rc = MMDB_ERROR;
+    } else {
+      rc = mmdb_get_raw(conn->server->db, &raws[i], id);
+    }
+
+    heads[i][0] = rc;
+    server_put_u16(heads[i] + 1, raws[i].rev_len);
+    server_put_u32(doc_lens[i], raws[i].doc_len);
+    iov[1 + i * 4] = (struct iovec){heads[i], sizeof(heads[i])};
+    iov[2 + i * 4] = (struct iovec){(void *)raws[i].rev, raws[i].rev_len};
+    iov[3 + i * 4] = (struct iovec){doc_lens[i], sizeof(doc_lens[i])};
+    iov[4 + i * 4] = (struct iovec){(void *)raws[i].doc, raws[i].doc_len};
+  }
+
+  rc = server_respond(conn, SERVER_OP_GET_MANY, MMDB_OK, iov, 1 + 4 * n);
+
+  for (i = 0; i < n; i++) {
+    mmdb_raw_release(&raws[i]);
+  }
+
+  return rc;
+}
+
+int server_put(server_conn_t *conn, server_buf_t *b) {
+  char id[MMDB_MAX_ID_LENGTH + 1], rev[MMDB_MAX_REV_LENGTH];
+  unsigned char rev_len[2];
+  const char *str = NULL, *body = NULL;
+  size_t len, body_len;
+  struct iovec iov[2];
+  mmdb_doc_t doc;
+  mmdb_rev_t out;
+  json_t *v = NULL;
+  int rc;
+
+  memset(&doc, 0, sizeof(doc));
+
+  if (server_take_id(b, id, MMDB_MAX_ID_LENGTH) != MMDB_OK ||
+      server_take(b, 2, &str, &len) != MMDB_OK ||
+      server_take(b, 4, &body, &body_len) != MMDB_OK ||
+      mmdb_doc_set_id(&doc, id) != MMDB_OK ||
+      (len > 0 && mmdb_rev_nparse(&doc.rev, str, len) != MMDB_OK) ||
+      (v = json_loadb(body, body_len, 0, NULL)) == NULL ||
+      !json_is_object(v) || mmdb_doc_set_fields_new(&doc, v) != MMDB_OK) {
+    json_decref(v);
+    mmdb_doc_clear(&doc);
+    return server_respond(conn, SERVER_OP_PUT, MMDB_ERROR, NULL, 0);
+  }
+
+  rc = mmdb_put(conn->server->db, &out, &doc, NULL);
+  mmdb_doc_clear(&doc);
+
+  if (rc != MMDB_OK || mmdb_rev_format(rev, sizeof(rev), &out) != MMDB_OK) {
+    return server_respond(conn, SERVER_OP_PUT, rc != MMDB_OK ? rc : MMDB_ERROR,
+                          NULL, 0);
+  }
+
+  server_put_u16(rev_len, strlen(rev));
+  iov[0] = (struct iovec){rev_len, sizeof(rev_len)};
+  iov[1] = (struct iovec){rev, strlen(rev)};
+
+  return server_respond(conn, SERVER_OP_PUT, MMDB_OK, iov, 2);
+}
+
+int server_revs(server_conn_t *conn, server_buf_t *b) {
+  char id[MMDB_MAX_ID_LENGTH + 1];
+  unsigned char *out = NULL;
+  size_t n = 2, len;
+  struct iovec iov[1];
+  mmdb_revs_t revs;
+  int i, rc;
+
+  if (server_take_id(b, id, MMDB_MAX_ID_LENGTH) != MMDB_OK) {
+    return server_respond(conn, SERVER_OP_REVS, MMDB_ERROR, NULL, 0);
+  }
+
+  mmdb_revs_new(&revs);
+
+  if ((rc = mmdb_revs(conn->server->db, &revs, id)) != MMDB_OK ||
+      (out = malloc(2 + revs.total * (2 + MMDB_MAX_REV_LENGTH))) == NULL) {
+    mmdb_revs_free(&revs);
+    return server_respond(conn, SERVER_OP_REVS,
+                          rc != MMDB_OK ? rc : MMDB_ERROR, NULL, 0);
+  }
+
+  server_put_u16(out, revs.total);
+  for (i = 0; i < revs.total; i++) {
+    if (mmdb_revs_format(&revs, i, (char *)out + n + 2,
+                         MMDB_MAX_REV_LENGTH) != MMDB_OK) {
+      free(out);
+      mmdb_revs_free(&revs);
+      return server_respond(conn, SERVER_OP_REVS, MMDB_ERROR, NULL, 0);
+    }
+    len = strlen((char *)out + n + 2);
+    server_put_u16(out + n, len);
+    n += 2 + len;
+  }
+  mmdb_revs_free(&revs);
+
+  iov[0] = (struct iovec){out, n};
+  rc = server_respond(conn, SERVER_OP_REVS, MMDB_OK, iov, 1);
+  free(out);
+
+  return rc;
+}
+
+void server_change_cb(const char *id, mmdb_rev_t *rev, void *ptr) {
+  server_conn_t *conn = ptr;
+  char str[MMDB_MAX_REV_LENGTH];
+  unsigned char id_len[2], rev_len[2];
+  struct iovec iov[4];
+
+  if (mmdb_rev_format(str, sizeof(str), rev) != MMDB_OK) {
+    return;
+  }
+
+  server_put_u16(id_len, strlen(id));
+  server_put_u16(rev_len, strlen(str));
+  iov[0] = (struct iovec){id_len, sizeof(id_len)};
+  iov[1] = (struct iovec){(void *)id, strlen(id)};
+  iov[2] = (struct iovec){rev_len, sizeof(rev_len)};
+  iov[3] = (struct iovec){str, strlen(str)};
+
+  // a watcher that stops reading is dropped rather than buffered for; it
+  // can't be closed from in here, so the event loop does it after the poll
+  if (conn->closing ||
+      conn->out_len - conn->out_off >= SERVER_MAX_PENDING ||
+      server_respond(conn, SERVER_OP_CHANGE, MMDB_OK, iov, 4) != MMDB_OK) {
+    conn->closing = 1;
+  }
+}
+
+int server_watch(server_conn_t *conn, server_buf_t *b) {
+  server_t *server = conn->server;
+  char prefix[MMDB_MAX_ID_LENGTH + 1];
+  struct epoll_event ev;
+  int fd;
+
+  if (conn->sub != NULL ||
+      server_take_id(b, prefix, MMDB_MAX_ID_LENGTH) != MMDB_OK ||
+      mmdb_subscribe(server->db, &conn->sub, prefix, server_change_cb,
+                     conn) != MMDB_OK) {
+    return server_respond(conn, SERVER_OP_WATCH, MMDB_ERROR, NULL, 0);
+  }
+
+  fd = mmdb_subscription_fd(conn->sub);
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+
+  if (fd >= server->conns_cap ||
+      epoll_ctl(server->epoll, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    mmdb_unsubscribe(server->db, conn->sub);
+    conn->sub = NULL;
+    return server_respond(conn, SERVER_OP_WATCH, MMDB_ERROR, NULL, 0);
+  }
+  server->conns[fd] = conn;
+
+  return server_respond(conn, SERVER_OP_WATCH, MMDB_OK, NULL, 0);
+}
+
+int server_handle(server_conn_t *conn, int op, server_buf_t *b) {
+  switch (op) {
+    case SERVER_OP_GET:
+      return server_get(conn, b);
+    case SERVER_OP_PUT:
+      return server_put(conn, b);
+    case SERVER_OP_REVS:
+      return server_revs(conn, b);
+    case SERVER_OP_GET_MANY:
+      return server_get_many(conn, b);
+    case SERVER_OP_WATCH:
+      return server_watch(conn, b);
+    default:
+      return server_respond(conn, op, MMDB_ERROR, NULL, 0);
+  }
+}
+
+// reads whatever has arrived and answers every complete frame in it; a frame
+// split across reads waits in the buffer for the rest
+int server_read(server_conn_t *conn) {
+  unsigned char *in = NULL;
+  size_t off = 0, len, want;
+  server_buf_t b;
+  ssize_t n;
+
+  while (1) {
+    if (conn->in_cap - conn->in_len < SERVER_READ_SIZE / 4) {
+      want = conn->in_cap > 0 ? conn->in_cap * 2 : SERVER_READ_SIZE;
+      if (want > SERVER_MAX_FRAME + 4 + SERVER_READ_SIZE) {
+        want = SERVER_MAX_FRAME + 4 + SERVER_READ_SIZE;
+      }
+      if (want > conn->in_cap) {
+        if ((in = realloc(conn->in, want)) == NULL) {
+          return MMDB_ERROR;
+        }
+        conn->in = in;
+        conn->in_cap = want;
+      }
+    }
+
+    n = read(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return MMDB_OK;
+    }
+    if (n <= 0) {
+      return MMDB_ERROR;
+    }
+    conn->in_len += n;
+
+    while (conn->in_len - off >= 4) {
+      len = server_get_u32(conn->in + off);
+      if (len == 0 || len > SERVER_MAX_FRAME) {
+        return MMDB_ERROR;
+      }
+      if (conn->in_len - off < 4 + len) {
+        break;
+      }
+
+      b.p = conn->in + off + 5;
+      b.left = len - 1;
+      if (server_handle(conn, conn->in[off + 4], &b) != MMDB_OK) {
+        return MMDB_ERROR;
+      }
+      off += 4 + len;
+    }
+
+    memmove(conn->in, conn->in + off, conn->in_len - off);
+    conn->in_len -= off;
+    off = 0;
+
+    // stop reading until the client catches up with what it's been sent
+    if (conn->out_len - conn->out_off >= SERVER_MAX_PENDING) {
+      return server_arm(conn, EPOLL_CTL_MOD);
+    }
+  }
+}
+
+void server_close(server_conn_t *conn) {
+  server_t *server = conn->server;
+  int fd;
+
+  if (conn->sub != NULL) {
+    fd = mmdb_subscription_fd(conn->sub);
+    epoll_ctl(server->epoll, EPOLL_CTL_DEL, fd, NULL);
+    server->conns[fd] = NULL;
+    mmdb_unsubscribe(server->db, conn->sub);
+  }
+
+  epoll_ctl(server->epoll, EPOLL_CTL_DEL, conn->fd, NULL);
+  server->conns[conn->fd] = NULL;
+  close(conn->fd);
+
+  free(conn->in);
+  free(conn->out);
+  free(conn);
+}
+
+int server_accept(server_t *server) {
+  server_conn_t *conn = NULL;
+  int fd;
+
+  while ((fd = accept4(server->listen, NULL, NULL,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    // room for the connection and a subscription fd after it
+    if (fd + 2 >= server->conns_cap) {
+      y_log_message(Y_LOG_LEVEL_WARNING, "too many connections");
+      close(fd);
+      continue;
+    }
+
+    if ((conn = calloc(1, sizeof(server_conn_t))) == NULL) {
+      close(fd);
+      return MMDB_ERROR;
+    }
+    conn->server = server;
+    conn->fd = fd;
+    server->conns[fd] = conn;
+
+    if (server_arm(conn, EPOLL_CTL_ADD) != MMDB_OK) {
+      server_close(conn);
+    }
+  }
+
+  return errno == EAGAIN || errno == EWOULDBLOCK ? MMDB_OK : MMDB_ERROR;
+}
+
+int server_listen(server_t *server, const char *bind_addr,
+                  unsigned short port) {
+  struct sockaddr_in addr;
+  struct epoll_event ev;
+  int one = 1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+
+  if (inet_pton(AF_INET, bind_addr, &addr.sin_addr) != 1) {
+    return MMDB_ERROR;
+  }
+
+  if ((server->listen = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0 ||
+      setsockopt(server->listen, SOL_SOCKET, SO_REUSEADDR, &one,
+                 sizeof(one)) != 0 ||
+      bind(server->listen, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(server->listen, 128) != 0) {
+    return MMDB_ERROR;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = server->listen;
+
+  return epoll_ctl(server->epoll, EPOLL_CTL_ADD, server->listen, &ev) == 0
+             ? MMDB_OK
+             : MMDB_ERROR;
+}
+
+// serves the database until SIGINT or SIGTERM
+int server_run(mmdb_t *db, const char *bind_addr, unsigned short port) {
+  struct epoll_event events[64];
+  server_conn_t *conn = NULL;
+  server_t server;
+  int i, n, fd, rc, failed = 0, backlog = 0;
+  time_t swept = 0;
+
+  memset(&server, 0, sizeof(server));
+  server.db = db;
+  server.listen = -1;
+  server.conns_cap = 4096;
+
+  signal(SIGINT, server_stop);
+  signal(SIGTERM, server_stop);
+
+  if ((server.conns = calloc(server.conns_cap, sizeof(server_conn_t *))) ==
+          NULL ||
+      (server.epoll = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+      server_listen(&server, bind_addr, port) != MMDB_OK) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "couldn't listen on %s:%d", bind_addr,
+                  port);
+    failed = 1;
+  } else {
+    y_log_message(Y_LOG_LEVEL_INFO, "listening on %s:%d", bind_addr, port);
+  }
+
+  while (!failed && !server_stopped) {
+    if ((n = epoll_wait(server.epoll, events, 64, backlog ? 0 : 1000)) < 0) {
+      failed = errno != EINTR;
+      continue;
+    }
+
+    if (backlog || time(NULL) != swept) {
+      if ((rc = mmdb_expire_step(db, SERVER_EXPIRE_BUDGET)) == MMDB_ERROR) {
+        y_log_message(Y_LOG_LEVEL_WARNING, "couldn't remove expired documents");
+      }
+      backlog = rc == MMDB_OK;
+      swept = time(NULL);
+    }
+
+    for (i = 0; i < n; i++) {
+      fd = events[i].data.fd;
+
+      if (fd == server.listen) {
+        if (server_accept(&server) != MMDB_OK) {
+          y_log_message(Y_LOG_LEVEL_WARNING, "couldn't accept connection");
+        }
+        continue;
+      }
+
+      // closed earlier in this batch
+      if ((conn = server.conns[fd]) == NULL) {
+        continue;
+      }
+
+      if (fd != conn->fd) {
+        if (mmdb_subscription_poll(conn->sub, 0) != MMDB_OK ||
+            conn->closing) {
+          server_close(conn);
+        }
+        continue;
+      }
+
+      if (((events[i].events & (EPOLLERR | EPOLLHUP)) &&
+           !(events[i].events & EPOLLIN)) ||
+          ((events[i].events & EPOLLOUT) && server_flush(conn) != MMDB_OK) ||
+          ((events[i].events & EPOLLIN) && server_read(conn) != MMDB_OK)) {
+        server_close(conn);
+      }
+    }
+  }
+
+  for (i = 0; server.conns != NULL && i < server.conns_cap; i++) {
+    if ((conn = server.conns[i]) != NULL && conn->fd == i) {
+      server_close(conn);
+    }
+  }
+  free(server.conns);
+  if (server.listen >= 0) close(server.listen);
+  if (server.epoll > 0) close(server.epoll);
+
+  return failed ? MMDB_ERROR : MMDB_OK;
+}
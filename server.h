@@ -0,0 +1,45 @@
+#define SERVER_OP_GET 1
+#define SERVER_OP_PUT 2
+#define SERVER_OP_REVS 3
+#define SERVER_OP_GET_MANY 4
+#define SERVER_OP_WATCH 5
+#define SERVER_OP_CHANGE 6
+
+#define SERVER_MAX_FRAME (MMDB_MAX_DATA_LENGTH + 4096)
+// a connection isn't read from while it has this much waiting to be sent,
+// and a watcher with this much waiting is closed
+#define SERVER_MAX_PENDING (8 * 1024 * 1024)
+
+typedef struct server_s server_t;
+
+typedef struct server_conn_s {
+  server_t *server;
+  int fd;
+  unsigned char *in;
+  size_t in_len;
+  size_t in_cap;
+  // whatever the socket wouldn't take straight away
+  unsigned char *out;
+  size_t out_off;
+  size_t out_len;
+  size_t out_cap;
+  mmdb_subscription_t *sub;
+  // set when a change couldn't be sent; the event loop closes it
+  int closing;
+} server_conn_t;
+
+struct server_s {
+  mmdb_t *db;
+  int epoll;
+  int listen;
+  // by file descriptor, for both sockets and subscriptions
+  server_conn_t **conns;
+  int conns_cap;
+};
+
+int server_arm(server_conn_t *conn, int op);
+int server_flush(server_conn_t *conn);
+int server_read(server_conn_t *conn);
+void server_close(server_conn_t *conn);
+void server_change_cb(const char *id, mmdb_rev_t *rev, void *ptr);
+int server_run(mmdb_t *db, const char *bind, unsigned short port);
@@ -0,0 +1,422 @@
+#include <errno.h>
+#include <jansson.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "mmdb.h"
+#include "subscribe.h"
+
+typedef struct mmdb_change_s {
+  struct mmdb_change_s *next;
+  char id[MMDB_MAX_ID_LENGTH + 1];
+  mmdb_rev_t rev;
+} mmdb_change_t;
+
+struct mmdb_subscription_s {
+  char prefix[MMDB_MAX_ID_LENGTH + 1];
+  size_t prefix_len;
+  mmdb_subscription_cb cb;
+  void *ptr;
+  int fd;
+  pthread_mutex_t lock;
+  mmdb_change_t *queue, *queue_tail;
+};
+
+typedef struct mmdb_subs_s {
+  pthread_mutex_t lock;
+  mmdb_subscription_t **subs;
+  int subs_total;
+  // written by the transaction in progress, one entry per document, and
+  // then those of a transaction whose commit hasn't returned yet; only
+  // touched by the thread that's using the database
+  mmdb_change_t *pending;
+  mmdb_change_t *committing;
+  // how many of pending there were when each open savepoint began, so
+  // rolling one back forgets just what was written since
+  size_t *marks;
+  int marks_total;
+  int marks_cap;
+} mmdb_subs_t;
+
+void mmdb_changes_free(mmdb_change_t *c) {
+  mmdb_change_t *next = NULL;
+
+  for (; c != NULL; c = next) {
+    next = c->next;
+    free(c);
+  }
+}
+
+int mmdb_subs_enqueue(mmdb_subscription_t *sub, mmdb_change_t *change) {
+  mmdb_change_t *c = NULL;
+  uint64_t one = 1;
+
+  if (strncmp(change->id, sub->prefix, sub->prefix_len) != 0) {
+    return MMDB_OK;
+  }
+
+  if ((c = malloc(sizeof(mmdb_change_t))) == NULL) {
+    return MMDB_ERROR;
+  }
+  memcpy(c, change, sizeof(mmdb_change_t));
+  c->next = NULL;
+
+  pthread_mutex_lock(&sub->lock);
+  if (sub->queue_tail == NULL) {
+    sub->queue = c;
+  } else {
+    sub->queue_tail->next = c;
+  }
+  sub->queue_tail = c;
+  pthread_mutex_unlock(&sub->lock);
+
+  if (write(sub->fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+    return MMDB_ERROR;
+  }
+
+  return MMDB_OK;
+}
+
+// sqlite calls this just before a transaction commits, which can still fail
+// afterwards, so the changes are only set aside until mmdb_subs_settle
+int mmdb_subs_commit(void *ptr) {
+  mmdb_subs_t *subs = ptr;
+
+  subs->committing = subs->pending;
+  subs->pending = NULL;
+
+  return 0;
+}
+
+// the link to the nth pending change, or to the end if there are fewer
+mmdb_change_t **mmdb_subs_at(mmdb_subs_t *subs, size_t n) {
+  mmdb_change_t **link = &subs->pending;
+
+  for (; n > 0 && *link != NULL; n--) {
+    link = &(*link)->next;
+  }
+
+  return link;
+}
+
+void mmdb_subs_rollback(void *ptr) {
+  mmdb_subs_t *subs = ptr;
+
+  mmdb_changes_free(subs->pending);
+  subs->pending = NULL;
+  mmdb_changes_free(subs->committing);
+  subs->committing = NULL;
+}
+
+// called after every release or rollback of a savepoint. Once the outermost
+// one has committed, its changes are handed to every subscriber whose prefix
+// matches. Rolling back to a savepoint doesn't end the transaction, and the
+// release that follows commits it, so anything that didn't commit is dropped
+// once the transaction is over, and waits for another try while it's not
+void mmdb_subs_settle(mmdb_t *db, int committed) {
+  mmdb_subs_t *subs = db->subs;
+  mmdb_change_t *c = NULL, **tail = NULL;
+  int i;
+
+  // migrations commit before there's anything to subscribe to
+  if (subs == NULL) return;
+
+  if (sqlite3_get_autocommit(db->db)) {
+    subs->marks_total = 0;
+    if (!committed) {
+      mmdb_subs_rollback(subs);
+      return;
+    }
+  }
+
+  if (subs->committing == NULL) {
+    return;
+  }
+
+  if (!committed) {
+    for (tail = &subs->committing; *tail != NULL; tail = &(*tail)->next) {
+    }
+    *tail = subs->pending;
+    subs->pending = subs->committing;
+    subs->committing = NULL;
+    return;
+  }
+
+  pthread_mutex_lock(&subs->lock);
+  for (c = subs->committing; c != NULL; c = c->next) {
+    for (i = 0; i < subs->subs_total; i++) {
+      mmdb_subs_enqueue(subs->subs[i], c);
+    }
+  }
+  pthread_mutex_unlock(&subs->lock);
+
+  mmdb_changes_free(subs->committing);
+  subs->committing = NULL;
+}
+
+// called once a savepoint has begun
+int mmdb_subs_begin(mmdb_t *db) {
+  mmdb_subs_t *subs = db->subs;
+  size_t *marks = NULL, n = 0;
+  mmdb_change_t *c = NULL;
+  int cap;
+
+  if (subs == NULL) return MMDB_OK;
+
+  if (subs->marks_total == subs->marks_cap) {
+    cap = subs->marks_cap > 0 ? subs->marks_cap * 2 : 8;
+    if ((marks = realloc(subs->marks, cap * sizeof(size_t))) == NULL) {
+      return MMDB_ERROR;
+    }
+    subs->marks = marks;
+    subs->marks_cap = cap;
+  }
+
+  for (c = subs->pending; c != NULL; c = c->next) {
+    n++;
+  }
+  subs->marks[subs->marks_total++] = n;
+
+  return MMDB_OK;
+}
+
+// called once a savepoint has been released, or rolled back to, before
+// mmdb_subs_settle. A rolled back one loses its changes; a released one's
+// are folded into the savepoint around it, replacing what that wrote to the
+// same documents
+void mmdb_subs_end(mmdb_t *db, int released) {
+  mmdb_subs_t *subs = db->subs;
+  mmdb_change_t **link = NULL, **prev = NULL, *c = NULL;
+  size_t mark, outer;
+
+  if (subs == NULL || subs->marks_total == 0) return;
+
+  mark = subs->marks[--subs->marks_total];
+  outer = subs->marks_total > 0 ? subs->marks[subs->marks_total - 1] : 0;
+  link = mmdb_subs_at(subs, mark);
+
+  if (!released) {
+    mmdb_changes_free(*link);
+    *link = NULL;
+    return;
+  }
+
+  while ((c = *link) != NULL) {
+    for (prev = mmdb_subs_at(subs, outer); *prev != c; prev = &(*prev)->next) {
+      if (strcmp((*prev)->id, c->id) == 0) {
+        break;
+      }
+    }
+
+    if (*prev == c) {
+      link = &c->next;
+      continue;
+    }
+
+    (*prev)->rev = c->rev;
+    *link = c->next;
+    free(c);
+  }
+}
+
+int mmdb_subs_new(mmdb_t *db) {
+  if ((db->subs = calloc(1, sizeof(mmdb_subs_t))) == NULL) {
+    return MMDB_ERROR;
+  }
+
+  pthread_mutex_init(&db->subs->lock, NULL);
+
+  sqlite3_commit_hook(db->db, mmdb_subs_commit, db->subs);
+  sqlite3_rollback_hook(db->db, mmdb_subs_rollback, db->subs);
+
+  return MMDB_OK;
+}
+
+// subscriptions themselves belong to the caller and outlive the database
+void mmdb_subs_free(mmdb_t *db) {
+  if (db->subs == NULL) return;
+
+  pthread_mutex_destroy(&db->subs->lock);
+  mmdb_changes_free(db->subs->pending);
+  mmdb_changes_free(db->subs->committing);
+  free(db->subs->marks);
+  free(db->subs->subs);
+  free(db->subs);
+  db->subs = NULL;
+}
+
+// remembers a write made by the current transaction, replacing any earlier
+// one to the same document, so subscribers see each document once per commit.
+// writes from before the innermost savepoint are only replaced once it's
+// released, so rolling it back leaves them as they were
+int mmdb_subs_record(mmdb_t *db, const char *id, mmdb_rev_t *rev) {
+  mmdb_change_t *c = NULL, **tail = NULL;
+  mmdb_subs_t *subs = db->subs;
+  int total;
+
+  pthread_mutex_lock(&db->subs->lock);
+  total = db->subs->subs_total;
+  pthread_mutex_unlock(&db->subs->lock);
+
+  if (total == 0) {
+    return MMDB_OK;
+  }
+
+  tail = mmdb_subs_at(
+      subs, subs->marks_total > 0 ? subs->marks[subs->marks_total - 1] : 0);
+  for (; *tail != NULL; tail = &(*tail)->next) {
+    if (strcmp((*tail)->id, id) == 0) {
+      (*tail)->rev = *rev;
+      return MMDB_OK;
+    }
+  }
+
+  if ((c = malloc(sizeof(mmdb_change_t))) == NULL) {
+    return MMDB_ERROR;
+  }
+  snprintf(c->id, sizeof(c->id), "%s", id);
+  c->rev = *rev;
+  c->next = NULL;
+  *tail = c;
+
+  return MMDB_OK;
+}
+
+int mmdb_subs_add(mmdb_t *db, mmdb_subscription_t *sub) {
+  mmdb_subscription_t **subs = NULL;
+
+  pthread_mutex_lock(&db->subs->lock);
+
+  subs = realloc(db->subs->subs,
+                 sizeof(mmdb_subscription_t *) * (db->subs->subs_total + 1));
+  if (subs == NULL) {
+    pthread_mutex_unlock(&db->subs->lock);
+    return MMDB_ERROR;
+  }
+  subs[db->subs->subs_total++] = sub;
+  db->subs->subs = subs;
+
+  pthread_mutex_unlock(&db->subs->lock);
+
+  return MMDB_OK;
+}
+
+void mmdb_subs_remove(mmdb_t *db, mmdb_subscription_t *sub) {
+  int i;
+
+  pthread_mutex_lock(&db->subs->lock);
+
+  for (i = 0; i < db->subs->subs_total; i++) {
+    if (db->subs->subs[i] == sub) {
+      db->subs->subs[i] = db->subs->subs[--db->subs->subs_total];
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&db->subs->lock);
+}
+
+// every committed put or patch of a document whose id starts with prefix
+// (NULL for all of them) is queued for the subscription, once per
+// transaction; the callback runs from mmdb_subscription_poll
+int mmdb_subscribe(mmdb_t *db, mmdb_subscription_t **out, const char *prefix,
+                   mmdb_subscription_cb cb, void *ptr) {
+  mmdb_subscription_t *r = NULL;
+  int i;
+
+  if (prefix != NULL && strlen(prefix) > MMDB_MAX_ID_LENGTH) {
+    return MMDB_ERROR;
+  }
+
+  if ((r = calloc(1, sizeof(mmdb_subscription_t))) == NULL) {
+    return MMDB_ERROR;
+  }
+
+  if ((r->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    free(r);
+    return MMDB_ERROR;
+  }
+
+  if (prefix != NULL) {
+    strcpy(r->prefix, prefix);
+    r->prefix_len = strlen(prefix);
+  }
+  r->cb = cb;
+  r->ptr = ptr;
+  pthread_mutex_init(&r->lock, NULL);
+
+  for (i = 0; i < db->shards_total; i++) {
+    if (mmdb_subs_add(db->shards[i], r) != MMDB_OK) {
+      mmdb_unsubscribe(db, r);
+      return MMDB_ERROR;
+    }
+  }
+
+  if (db->shards == NULL && mmdb_subs_add(db, r) != MMDB_OK) {
+    mmdb_unsubscribe(db, r);
+    return MMDB_ERROR;
+  }
+
+  *out = r;
+
+  return MMDB_OK;
+}
+
+// changes still queued are dropped without their callbacks running
+void mmdb_unsubscribe(mmdb_t *db, mmdb_subscription_t *sub) {
+  int i;
+
+  if (sub == NULL) return;
+
+  for (i = 0; i < db->shards_total; i++) {
+    mmdb_subs_remove(db->shards[i], sub);
+  }
+
+  if (db->shards == NULL) {
+    mmdb_subs_remove(db, sub);
+  }
+
+  mmdb_changes_free(sub->queue);
+  pthread_mutex_destroy(&sub->lock);
+  close(sub->fd);
+  free(sub);
+}
+
+int mmdb_subscription_fd(mmdb_subscription_t *sub) { return sub->fd; }
+
+int mmdb_subscription_poll(mmdb_subscription_t *sub, int timeout) {
+  struct pollfd pfd = {sub->fd, POLLIN, 0};
+  mmdb_change_t *c = NULL, *next = NULL;
+  uint64_t n;
+
+  if (timeout != 0 && poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+    return MMDB_ERROR;
+  }
+
+  if (read(sub->fd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+    return MMDB_ERROR;
+  }
+
+  pthread_mutex_lock(&sub->lock);
+  c = sub->queue;
+  sub->queue = NULL;
+  sub->queue_tail = NULL;
+  pthread_mutex_unlock(&sub->lock);
+
+  for (; c != NULL; c = next) {
+    next = c->next;
+    if (sub->cb != NULL) {
+      sub->cb(c->id, &c->rev, sub->ptr);
+    }
+    free(c);
+  }
+
+  return MMDB_OK;
+}
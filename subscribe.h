@@ -0,0 +1,6 @@
+int mmdb_subs_new(mmdb_t *db);
+void mmdb_subs_free(mmdb_t *db);
+int mmdb_subs_record(mmdb_t *db, const char *id, mmdb_rev_t *rev);
+int mmdb_subs_begin(mmdb_t *db);
+void mmdb_subs_end(mmdb_t *db, int released);
+void mmdb_subs_settle(mmdb_t *db, int committed);
@@ -0,0 +1,303 @@
+#include <jansson.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "find.h"
+#include "mmdb.h"
+#include "q.h"
+#include "view.h"
+
+// a view groups the winning revision of every live document by the field at
+// its key path; view_groups holds each group's document count and the count
+// and sum of the numbers found at its value path, and view_values counts
+// each distinct number so min and max survive removals
+
+typedef struct view_s {
+  char name[MMDB_MAX_NAME_LENGTH + 1];
+  // add ($2 = 1) or take away ($2 = -1) documents' contributions, either one
+  // ($3) or all of them
+  char *groups;
+  char *groups_one;
+  char *values;
+  char *values_one;
+} view_t;
+
+typedef struct mmdb_views_s {
+  view_t *views;
+  int total;
+  // registering a view bumps view_generation in meta, which is checked
+  // whenever the file has changed under this handle
+  sqlite3_int64 generation;
+  sqlite3_int64 data_version;
+} mmdb_views_t;
+
+const char query_view_list[] = "select name, key, value from views";
+
+const char query_view_register[] =
+    "insert into views (name, key, value) values ($1, $2, nullif($3, ''))";
+
+const char query_view_bump[] =
+    "insert into meta (key, value) values ('view_generation', 1) on conflict "
+    "(key) do update set value = value + 1";
+
+const char query_view_generation[] =
+    "select coalesce((select cast(value as integer) from meta where key = "
+    "'view_generation'), 0)";
+
+const char query_view_groups[] =
+    "insert into view_groups (view, key, count, n, sum) select $1, "
+    "json_extract(b.doc, %s), $2, $2 * (%s is not null), $2 * coalesce(%s, "
+    "0) from docs d join revs r on r.docid = d.docid and r.rev = d.rev join "
+    "bodies b on b.hash = r.body where r.deleted = 0 and json_extract(b.doc, "
+    "%s) is not null%s on conflict (view, key) do update set count = count + "
+    "excluded.count, n = n + excluded.n, sum = sum + excluded.sum";
+
+const char query_view_values[] =
+    "insert into view_values (view, key, value, count) select $1, "
+    "json_extract(b.doc, %s), %s, $2 from docs d join revs r on r.docid = "
+    "d.docid and r.rev = d.rev join bodies b on b.hash = r.body where "
+    "r.deleted = 0 and json_extract(b.doc, %s) is not null and %s is not "
+    "null%s on conflict (view, key, value) do update set count = count + "
+    "excluded.count";
+
+// both use partial indexes, so they only ever look at emptied rows
+const char query_view_groups_prune[] =
+    "delete from view_groups where view = $1 and count <= 0";
+
+const char query_view_values_prune[] =
+    "delete from view_values where view = $1 and count <= 0";
+
+const char query_view_numeric[] =
+    "(case when json_type(b.doc, %s) in ('integer', 'real') then "
+    "json_extract(b.doc, %s) end)";
+
+void view_clear(view_t *view) {
+  sqlite3_free(view->groups);
+  sqlite3_free(view->groups_one);
+  sqlite3_free(view->values);
+  sqlite3_free(view->values_one);
+}
+
+int view_init(view_t *view, const char *name, const char *key,
+              const char *value) {
+  char key_path[FIND_MAX_PATH_LENGTH], value_path[FIND_MAX_PATH_LENGTH];
+  char *num = NULL;
+
+  memset(view, 0, sizeof(view_t));
+
+  if (find_name(name) != MMDB_OK ||
+      find_path(key_path, sizeof(key_path), key) != MMDB_OK ||
+      (value != NULL &&
+       find_path(value_path, sizeof(value_path), value) != MMDB_OK)) {
+    return MMDB_ERROR;
+  }
+  strcpy(view->name, name);
+
+  num = value != NULL
+            ? sqlite3_mprintf(query_view_numeric, value_path, value_path)
+            : sqlite3_mprintf("null");
+  if (num == NULL) {
+    return MMDB_ERROR;
+  }
+
+  view->groups =
+      sqlite3_mprintf(query_view_groups, key_path, num, num, key_path, "");
+  view->groups_one = sqlite3_mprintf(query_view_groups, key_path, num, num,
+                                     key_path, " and d.docid = $3");
+  view->values =
+      sqlite3_mprintf(query_view_values, key_path, num, key_path, num, "");
+  view->values_one = sqlite3_mprintf(query_view_values, key_path, num,
+                                     key_path, num, " and d.docid = $3");
+
+  sqlite3_free(num);
+
+  if (view->groups == NULL || view->groups_one == NULL ||
+      view->values == NULL || view->values_one == NULL) {
+    view_clear(view);
+    return MMDB_ERROR;
+  }
+
+  return MMDB_OK;
+}
+
+int view_load_cb(sqlite3_stmt *stmt, void *ptr) {
+  mmdb_views_t *views = ptr;
+  view_t *r = NULL;
+
+  if ((r = realloc(views->views, sizeof(view_t) * (views->total + 1))) ==
+      NULL) {
+    return MMDB_ERROR;
+  }
+  views->views = r;
+
+  if (view_init(&views->views[views->total],
+                (const char *)sqlite3_column_text(stmt, 0),
+                (const char *)sqlite3_column_text(stmt, 1),
+                (const char *)sqlite3_column_text(stmt, 2)) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+  views->total++;
+
+  return MMDB_OK;
+}
+
+int view_generation_cb(sqlite3_stmt *stmt, void *ptr) {
+  return q_scan(stmt, "l", ptr);
+}
+
+// reads the view definitions, replacing any already loaded
+int view_load(mmdb_t *db) {
+  view_free(db);
+
+  if ((db->views = calloc(1, sizeof(mmdb_views_t))) == NULL) {
+    return MMDB_ERROR;
+  }
+
+  if (mmdb_data_version(db, &db->views->data_version) != MMDB_OK ||
+      q_exec1(db->db, query_view_generation, &db->views->generation,
+              view_generation_cb, "") != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  return q_exec2(db->db, query_view_list, db->views, view_load_cb, "");
+}
+
+// reloads the definitions if another handle has registered a view since
+// they were read; within a write this happens before the first change, so
+// a document is never taken out of one set of views and put into another
+int view_refresh(mmdb_t *db) {
+  sqlite3_int64 version, generation;
+
+  if (mmdb_data_version(db, &version) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (version == db->views->data_version) {
+    return MMDB_OK;
+  }
+
+  if (q_exec1(db->db, query_view_generation, &generation, view_generation_cb,
+              "") != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (generation != db->views->generation) {
+    return view_load(db);
+  }
+
+  db->views->data_version = version;
+
+  return MMDB_OK;
+}
+
+void view_free(mmdb_t *db) {
+  int i;
+
+  if (db->views == NULL) return;
+
+  for (i = 0; i < db->views->total; i++) {
+    view_clear(&db->views->views[i]);
+  }
+  free(db->views->views);
+  free(db->views);
+  db->views = NULL;
+}
+
+int view_exists(mmdb_t *db, const char *name) {
+  int i;
+
+  if (view_refresh(db) != MMDB_OK) {
+    return 0;
+  }
+
+  for (i = 0; i < db->views->total; i++) {
+    if (strcmp(db->views->views[i].name, name) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// registers a view and adds every existing document to it; the caller owns
+// the transaction and reloads the definitions once it commits
+int view_create(mmdb_t *db, const char *name, const char *key,
+                const char *value) {
+  view_t view;
+  int failed = 0;
+
+  if (view_exists(db, name)) {
+    return MMDB_CONFLICT;
+  }
+
+  if (view_init(&view, name, key, value) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  if (q_exec0(db->db, query_view_register, "sss", name, key,
+              value != NULL ? value : "") != MMDB_OK ||
+      q_exec0(db->db, query_view_bump, "") != MMDB_OK ||
+      q_exec0(db->db, view.groups, "si", name, 1) != MMDB_OK ||
+      q_exec0(db->db, view.values, "si", name, 1) != MMDB_OK) {
+    failed = 1;
+  }
+
+  view_clear(&view);
+
+  return failed ? MMDB_ERROR : MMDB_OK;
+}
+
+// adds (sign 1) or takes away (sign -1) the contribution of the document's
+// winning revision to every view
+int view_update(mmdb_t *db, sqlite3_int64 docid, int sign) {
+  view_t *view = NULL;
+  int i;
+
+  if (view_refresh(db) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  for (i = 0; i < db->views->total; i++) {
+    view = &db->views->views[i];
+
+    if (q_exec0(db->db, view->groups_one, "sil", view->name, sign, docid) !=
+            MMDB_OK ||
+        q_exec0(db->db, view->values_one, "sil", view->name, sign, docid) !=
+            MMDB_OK) {
+      return MMDB_ERROR;
+    }
+
+    if (sign < 0 &&
+        (q_exec0(db->db, query_view_groups_prune, "s", view->name) !=
+             MMDB_OK ||
+         q_exec0(db->db, query_view_values_prune, "s", view->name) !=
+             MMDB_OK)) {
+      return MMDB_ERROR;
+    }
+  }
+
+  return MMDB_OK;
+}
+
+// adds every document to every view, for a bulk load into an empty database
+// that skipped view_update for each document
+int view_fill(mmdb_t *db) {
+  view_t *view = NULL;
+  int i;
+
+  if (view_refresh(db) != MMDB_OK) {
+    return MMDB_ERROR;
+  }
+
+  for (i = 0; i < db->views->total; i++) {
+    view = &db->views->views[i];
+
+    if (q_exec0(db->db, view->groups, "si", view->name, 1) != MMDB_OK ||
+        q_exec0(db->db, view->values, "si", view->name, 1) != MMDB_OK) {
+      return MMDB_ERROR;
+    }
+  }
+
+  return MMDB_OK;
+}
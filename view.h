@@ -0,0 +1,7 @@
+int view_load(mmdb_t *db);
+void view_free(mmdb_t *db);
+int view_create(mmdb_t *db, const char *name, const char *key,
+                const char *value);
+int view_update(mmdb_t *db, sqlite3_int64 docid, int sign);
+int view_fill(mmdb_t *db);
+int view_exists(mmdb_t *db, const char *name);